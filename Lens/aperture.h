@@ -0,0 +1,380 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// CPU version of PSAperture. Both blade shapes are N-fold symmetric, so they only depend
+// on the radius and on the position inside one angular sector: the rounded blade distance
+// is tabulated once over a single sector and every pixel looks it up instead of looping
+// over the blades twice. Rows are evaluated four pixels at a time with SSE, and pixels the
+// hard polygon edge crosses can be supersampled so the aperture fed to the FFT is
+// antialiased.
+//--------------------------------------------------------------------------------------
+
+#include <emmintrin.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "thread_pool.h"
+
+using namespace std;
+
+struct ApertureGenerator {
+	const float two_pi = 6.28318530718f;
+	const float radius = 0.7f;           // APERTURE_RADIUS
+	const float fade = 0.1f;             // APERTURE_FADE
+	const float fft_fade = 0.00001f;
+	const float max_radius = 1.5f;       // ndc corners are at sqrt(2)
+
+	int table_radii = 1024;
+	int table_steps = 256;               // per sector
+	int supersampling = 4;               // per axis, only where the hard polygon edge crosses a pixel
+
+	int table_blades = 0;
+	vector<float> rounded;               // (table_radii + 1) * (table_steps + 1) rounded blade distances
+	vector<float> hard;                  // table_steps + 1, hard polygon distance at radius 1
+
+	static float Saturate(float v) {
+		return v < 0.f ? 0.f : (v > 1.f ? 1.f : v);
+	}
+
+	static float Smax(float a, float b, float k) {
+		float diff = a - b;
+		float h = Saturate(0.5f + 0.5f * diff / k);
+		return b + h * (diff + k * (1.f - h));
+	}
+
+	static float FadeEdge(float radius, float fade, float signed_distance) {
+		float c = 1.f - Saturate(Saturate(signed_distance - radius) / fade);
+		return c * c * (3.f - 2.f * c);
+	}
+
+	static float BladeCurvature(int num_of_blades) {
+		return 0.025f + (0.001f - 0.025f) * Saturate((num_of_blades - 4) / 10.f);
+	}
+
+	// Sector position of PSAperture: 0 and 1 are polygon corners, 0.5 the middle of a blade
+	float SectorPosition(float x, float y, int num_of_blades, float opening) const {
+		float a = (atan2f(x, y) + opening) / two_pi + 3.f / 4.f;
+		float o = a * num_of_blades + 0.5f;
+		return o - floorf(o);
+	}
+
+	// ApertureBladeDistance at radius r and sector position u. The smax chain visits the blades
+	// nearest first, so unlike the shader's fixed order the result is the same in every sector
+	float SectorDistance(int num_of_blades, float r, float u) const {
+		float delta = (u - 0.5f) * two_pi / num_of_blades;
+		float side = delta > 0.f ? -1.f : 1.f;
+
+		float signed_distance = 0.f;
+		for (int i = 0; i < num_of_blades; ++i) {
+			float j = (float)((i + 1) / 2) * ((i & 1) ? side : -side);
+			signed_distance = Smax(signed_distance, r * cosf(delta + j * two_pi / num_of_blades), 0.1f);
+		}
+
+		return signed_distance + sinf(u * two_pi) * BladeCurvature(num_of_blades);
+	}
+
+	void InitTables(int num_of_blades) {
+		if (table_blades == num_of_blades)
+			return;
+
+		rounded.resize((size_t)(table_radii + 1) * (table_steps + 1));
+		hard.resize(table_steps + 1);
+
+		for (int s = 0; s <= table_steps; ++s) {
+			float u = s / (float)table_steps;
+			hard[s] = cosf((u - 0.5f) * two_pi / num_of_blades);
+		}
+
+		Workers.ParallelFor(table_radii + 1, 64, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				float r = i * max_radius / table_radii;
+				float* row = &rounded[(size_t)i * (table_steps + 1)];
+				for (int s = 0; s <= table_steps; ++s)
+					row[s] = SectorDistance(num_of_blades, r, s / (float)table_steps);
+			}
+		});
+
+		table_blades = num_of_blades;
+	}
+
+	//--------------------------------------------------------------------------------------
+	// SSE helpers
+	static __m128 Floor(__m128 v) {
+		__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+		return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, v), _mm_set1_ps(1.f)));
+	}
+
+	static __m128 Clamp01(__m128 v) {
+		return _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.f));
+	}
+
+	static __m128 Select(__m128 mask, __m128 a, __m128 b) {
+		return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+	}
+
+	// atan2(y, x), about 1e-5 radians off
+	static __m128 Atan2(__m128 y, __m128 x) {
+		const __m128 sign_bit = _mm_set1_ps(-0.f);
+		__m128 ax = _mm_andnot_ps(sign_bit, x);
+		__m128 ay = _mm_andnot_ps(sign_bit, y);
+		__m128 hi = _mm_max_ps(_mm_max_ps(ax, ay), _mm_set1_ps(1e-30f));
+		__m128 a = _mm_div_ps(_mm_min_ps(ax, ay), hi);
+		__m128 s = _mm_mul_ps(a, a);
+
+		__m128 p = _mm_set1_ps(-0.0464964749f);
+		p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(0.15931422f));
+		p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(-0.327622764f));
+		__m128 r = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, s), a), a);
+
+		r = Select(_mm_cmpgt_ps(ay, ax), _mm_sub_ps(_mm_set1_ps(1.57079637f), r), r);
+		r = Select(_mm_cmplt_ps(x, _mm_setzero_ps()), _mm_sub_ps(_mm_set1_ps(3.14159274f), r), r);
+		return _mm_or_ps(r, _mm_and_ps(y, sign_bit));
+	}
+
+	// sin(v) for any v, folded onto [-pi/2, pi/2]
+	static __m128 Sin(__m128 v) {
+		const __m128 pi = _mm_set1_ps(3.14159274f);
+		const __m128 half_pi = _mm_set1_ps(1.57079637f);
+		const __m128 inv_two_pi = _mm_set1_ps(0.159154937f);
+		v = _mm_sub_ps(v, _mm_mul_ps(Floor(_mm_add_ps(_mm_mul_ps(v, inv_two_pi), _mm_set1_ps(0.5f))), _mm_add_ps(pi, pi)));
+		v = Select(_mm_cmpgt_ps(v, half_pi), _mm_sub_ps(pi, v), v);
+		v = Select(_mm_cmplt_ps(v, _mm_sub_ps(_mm_setzero_ps(), half_pi)), _mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), pi), v), v);
+
+		__m128 s = _mm_mul_ps(v, v);
+		__m128 p = _mm_set1_ps(1.f / 362880.f);
+		p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(-1.f / 5040.f));
+		p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(1.f / 120.f));
+		p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(-1.f / 6.f));
+		p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(1.f));
+		return _mm_mul_ps(p, v);
+	}
+
+	static __m128 FadeEdge(__m128 radius, __m128 inv_fade, __m128 signed_distance) {
+		__m128 c = _mm_sub_ps(_mm_set1_ps(1.f), Clamp01(_mm_mul_ps(Clamp01(_mm_sub_ps(signed_distance, radius)), inv_fade)));
+		return _mm_mul_ps(_mm_mul_ps(c, c), _mm_sub_ps(_mm_set1_ps(3.f), _mm_add_ps(c, c)));
+	}
+
+	// Diffraction rings of PSAperture
+	static __m128 Rings(__m128 signed_distance) {
+		const __m128 one = _mm_set1_ps(1.f);
+		const __m128 w = _mm_set1_ps(0.2f);
+		__m128 s = _mm_add_ps(signed_distance, _mm_set1_ps(0.05f));
+		__m128 n = Clamp01(_mm_sub_ps(Clamp01(_mm_add_ps(s, w)), _mm_sub_ps(one, w)));
+		__m128 x = _mm_div_ps(n, w);
+		__m128 c = _mm_mul_ps(_mm_min_ps(x, _mm_sub_ps(one, x)), _mm_set1_ps(2.f));
+		__m128 t = _mm_mul_ps(_mm_add_ps(Sin(_mm_sub_ps(_mm_mul_ps(x, _mm_set1_ps(6.f * 3.14159274f)), _mm_set1_ps(1.5f))), one), _mm_set1_ps(0.5f));
+		return _mm_mul_ps(t, c);
+	}
+
+	//--------------------------------------------------------------------------------------
+	// Hard polygon coverage of the pixel centred on (x, y), size ndc units wide
+	float Coverage(float x, float y, float size, int num_of_blades, float opening) const {
+		float sum = 0.f;
+		for (int j = 0; j < supersampling; ++j) {
+			for (int i = 0; i < supersampling; ++i) {
+				float sx = x + ((i + 0.5f) / supersampling - 0.5f) * size;
+				float sy = y + ((j + 0.5f) / supersampling - 0.5f) * size;
+				float u = SectorPosition(sx, sy, num_of_blades, opening);
+				float d = sqrtf(sx * sx + sy * sy) * cosf((u - 0.5f) * two_pi / num_of_blades);
+				sum += FadeEdge(radius, fft_fade, d);
+			}
+		}
+		return sum / (supersampling * supersampling);
+	}
+
+	// Fills the three channels PSAperture writes: aperture (hard polygon for the FFT), dust and
+	// mask (rounded blades with rings, darkened by dust), all resolution * resolution. dust is
+	// sampled bilinearly with clamping like LinearSampler. Rows are done 4 pixels at a time, the
+	// last group of a row that is not a multiple of 4 only partly
+	void Generate(float number_of_blades, float opening, int resolution, const float* dust_texture, int dust_resolution,
+		vector<float>& aperture, vector<float>& dust, vector<float>& mask) {
+
+		int num_of_blades = (int)number_of_blades;
+		InitTables(num_of_blades);
+
+		size_t num_pixels = (size_t)resolution * resolution;
+		aperture.resize(num_pixels);
+		dust.resize(num_pixels);
+		mask.resize(num_pixels);
+
+		// Bilinear footprints are separable, one set per column and one per row
+		vector<int> dust_i0(resolution), dust_i1(resolution);
+		vector<float> dust_f(resolution);
+		for (int i = 0; i < resolution; ++i) {
+			float t = (i + 0.5f) / resolution * dust_resolution - 0.5f;
+			float t0 = floorf(t);
+			int i0 = (int)t0;
+			dust_f[i] = t - t0;
+			dust_i0[i] = i0 < 0 ? 0 : (i0 > dust_resolution - 1 ? dust_resolution - 1 : i0);
+			dust_i1[i] = i0 + 1 < 0 ? 0 : (i0 + 1 > dust_resolution - 1 ? dust_resolution - 1 : i0 + 1);
+		}
+
+		float pixel_size = 2.f / resolution;
+		float edge_band = pixel_size * 0.7072f;
+		int steps = table_steps;
+
+		Workers.ParallelFor(resolution, 8, [&](int begin, int end) {
+			const __m128 one = _mm_set1_ps(1.f);
+			const __m128 blades = _mm_set1_ps((float)num_of_blades);
+			const __m128 angle_offset = _mm_set1_ps(opening / two_pi + 3.f / 4.f);
+			const __m128 inv_two_pi = _mm_set1_ps(1.f / two_pi);
+			const __m128 radius_scale = _mm_set1_ps(table_radii / max_radius);
+			const __m128 max_index = _mm_set1_ps(table_radii - 0.001f);
+			const __m128 step_scale = _mm_set1_ps((float)steps);
+			const __m128 max_step = _mm_set1_ps(steps - 0.001f);
+			const __m128 lane_x = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+
+			for (int py = begin; py < end; ++py) {
+				float* aperture_row = &aperture[(size_t)py * resolution];
+				float* dust_row = &dust[(size_t)py * resolution];
+				float* mask_row = &mask[(size_t)py * resolution];
+
+				// Dust
+				const float* d0 = &dust_texture[(size_t)dust_i0[py] * dust_resolution];
+				const float* d1 = &dust_texture[(size_t)dust_i1[py] * dust_resolution];
+				float fy = dust_f[py];
+				for (int px = 0; px < resolution; ++px) {
+					int x0 = dust_i0[px], x1 = dust_i1[px];
+					float fx = dust_f[px];
+					float top = d0[x0] + (d0[x1] - d0[x0]) * fx;
+					float bottom = d1[x0] + (d1[x1] - d1[x0]) * fx;
+					dust_row[px] = top + (bottom - top) * fy;
+				}
+
+				__m128 y = _mm_set1_ps((py + 0.5f) * pixel_size - 1.f);
+				__m128 yy = _mm_mul_ps(y, y);
+
+				for (int px = 0; px < resolution; px += 4) {
+					int count = min(4, resolution - px);
+					__m128 x = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_set1_ps((float)px), lane_x), _mm_set1_ps(pixel_size)), one);
+					__m128 r = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x, x), yy));
+
+					// Sector position, same as PSAperture's o
+					__m128 o = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(Atan2(x, y), inv_two_pi), angle_offset), blades), _mm_set1_ps(0.5f));
+					__m128 u = _mm_sub_ps(o, Floor(o));
+
+					__m128 fr = _mm_min_ps(_mm_mul_ps(r, radius_scale), max_index);
+					__m128 fu = _mm_min_ps(_mm_mul_ps(u, step_scale), max_step);
+					__m128i ir = _mm_cvttps_epi32(fr);
+					__m128i iu = _mm_cvttps_epi32(fu);
+					__m128 tr = _mm_sub_ps(fr, _mm_cvtepi32_ps(ir));
+					__m128 tu = _mm_sub_ps(fu, _mm_cvtepi32_ps(iu));
+
+					// SSE2 has no gather
+					alignas(16) int ir_lanes[4], iu_lanes[4];
+					alignas(16) float r00[4], r01[4], r10[4], r11[4], h0[4], h1[4];
+					_mm_store_si128((__m128i*)ir_lanes, ir);
+					_mm_store_si128((__m128i*)iu_lanes, iu);
+					for (int l = 0; l < 4; ++l) {
+						const float* t = &rounded[(size_t)ir_lanes[l] * (steps + 1) + iu_lanes[l]];
+						r00[l] = t[0];
+						r01[l] = t[1];
+						r10[l] = t[steps + 1];
+						r11[l] = t[steps + 2];
+						h0[l] = hard[iu_lanes[l]];
+						h1[l] = hard[iu_lanes[l] + 1];
+					}
+
+					__m128 a0 = _mm_load_ps(r00), a1 = _mm_load_ps(r01);
+					__m128 b0 = _mm_load_ps(r10), b1 = _mm_load_ps(r11);
+					__m128 near_r = _mm_add_ps(a0, _mm_mul_ps(_mm_sub_ps(a1, a0), tu));
+					__m128 far_r = _mm_add_ps(b0, _mm_mul_ps(_mm_sub_ps(b1, b0), tu));
+					__m128 signed_distance = _mm_add_ps(near_r, _mm_mul_ps(_mm_sub_ps(far_r, near_r), tr));
+
+					__m128 c0 = _mm_load_ps(h0), c1 = _mm_load_ps(h1);
+					__m128 hard_distance = _mm_mul_ps(r, _mm_add_ps(c0, _mm_mul_ps(_mm_sub_ps(c1, c0), tu)));
+
+					__m128 aperture_fft = FadeEdge(_mm_set1_ps(radius), _mm_set1_ps(1.f / fft_fade), hard_distance);
+					__m128 aperture_mask = FadeEdge(_mm_set1_ps(radius), _mm_set1_ps(1.f / fade), signed_distance);
+					aperture_mask = _mm_add_ps(aperture_mask, _mm_mul_ps(Rings(signed_distance), _mm_set1_ps(0.125f)));
+
+					alignas(16) float tail[4] = { 0.f, 0.f, 0.f, 0.f };
+					for (int l = 0; count < 4 && l < count; ++l)
+						tail[l] = dust_row[px + l];
+					__m128 dust_fft = count == 4 ? _mm_loadu_ps(&dust_row[px]) : _mm_load_ps(tail);
+					aperture_mask = _mm_mul_ps(aperture_mask, Clamp01(_mm_add_ps(dust_fft, _mm_set1_ps(0.9f))));
+
+					if (count == 4) {
+						_mm_storeu_ps(&aperture_row[px], aperture_fft);
+						_mm_storeu_ps(&mask_row[px], aperture_mask);
+					} else {
+						_mm_store_ps(tail, aperture_fft);
+						copy(tail, tail + count, &aperture_row[px]);
+						_mm_store_ps(tail, aperture_mask);
+						copy(tail, tail + count, &mask_row[px]);
+					}
+
+					if (supersampling > 1) {
+						__m128 edge = _mm_cmplt_ps(_mm_andnot_ps(_mm_set1_ps(-0.f), _mm_sub_ps(hard_distance, _mm_set1_ps(radius))), _mm_set1_ps(edge_band));
+						int lanes = _mm_movemask_ps(edge);
+						for (int l = 0; l < count; ++l) {
+							if (lanes & (1 << l))
+								aperture_row[px + l] = Coverage((px + l + 0.5f) * pixel_size - 1.f, (py + 0.5f) * pixel_size - 1.f, pixel_size, num_of_blades, opening);
+						}
+					}
+				}
+			}
+		});
+	}
+
+	// Straight transcription of PSAperture (blades in the shader's order, no supersampling), used
+	// to validate Generate
+	void GenerateReference(float number_of_blades, float opening, int resolution, const float* dust_texture, int dust_resolution,
+		vector<float>& aperture, vector<float>& dust, vector<float>& mask) const {
+
+		int num_of_blades = (int)number_of_blades;
+		size_t num_pixels = (size_t)resolution * resolution;
+		aperture.resize(num_pixels);
+		dust.resize(num_pixels);
+		mask.resize(num_pixels);
+
+		for (int py = 0; py < resolution; ++py) {
+			for (int px = 0; px < resolution; ++px) {
+				float uv_x = (px + 0.5f) / resolution;
+				float uv_y = (py + 0.5f) / resolution;
+				float x = (uv_x - 0.5f) * 2.f;
+				float y = (uv_y - 0.5f) * 2.f;
+
+				float hard_distance = 0.f;
+				float signed_distance = 0.f;
+				for (int i = 0; i < num_of_blades; ++i) {
+					float angle = opening + (i / float(num_of_blades)) * two_pi;
+					float d = cosf(angle) * x + sinf(angle) * y;
+					hard_distance = hard_distance > d ? hard_distance : d;
+					signed_distance = Smax(signed_distance, d, 0.1f);
+				}
+				float u = SectorPosition(x, y, num_of_blades, opening);
+				signed_distance += sinf(u * two_pi) * BladeCurvature(num_of_blades);
+
+				float aperture_mask = FadeEdge(radius, fade, signed_distance);
+				{
+					float w = 0.2f;
+					float s = signed_distance + 0.05f;
+					float n = Saturate(Saturate(s + w) - (1.f - w));
+					float t = (sinf(n / w * 6.f * 3.14159274f - 1.5f) + 1.f) * 0.5f;
+					float c = (n / w < 1.f - n / w ? n / w : 1.f - n / w) * 2.f;
+					aperture_mask += t * c * 0.125f;
+				}
+
+				float tx = uv_x * dust_resolution - 0.5f, ty = uv_y * dust_resolution - 0.5f;
+				int x0 = (int)floorf(tx), y0 = (int)floorf(ty);
+				float fx = tx - x0, fy = ty - y0;
+				auto texel = [&](int i, int j) {
+					i = i < 0 ? 0 : (i > dust_resolution - 1 ? dust_resolution - 1 : i);
+					j = j < 0 ? 0 : (j > dust_resolution - 1 ? dust_resolution - 1 : j);
+					return dust_texture[(size_t)j * dust_resolution + i];
+				};
+				float top = texel(x0, y0) + (texel(x0 + 1, y0) - texel(x0, y0)) * fx;
+				float bottom = texel(x0, y0 + 1) + (texel(x0 + 1, y0 + 1) - texel(x0, y0 + 1)) * fx;
+				float dust_fft = top + (bottom - top) * fy;
+
+				size_t p = (size_t)py * resolution + px;
+				aperture[p] = FadeEdge(radius, fft_fade, hard_distance);
+				dust[p] = dust_fft;
+				mask[p] = aperture_mask * Saturate(dust_fft + 0.9f);
+			}
+		}
+	}
+};
@@ -7,12 +7,6 @@ float fade_aperture_edge(float radius, float fade, float signed_distance) {
 	float c = 1.f - saturate(saturate(signed_distance - l)/s);
 	return smoothstep(0, 1, c);
 }
- 
-float smax(float a, float b, float k) {
-	float diff = a - b;
-	float h = saturate(0.5 + 0.5 * diff / k);
-	return b + h * (diff + k * (1.0f - h));
-}
 
 float4 PSAperture(float4 pos : SV_POSITION) : SV_Target {
 
@@ -24,10 +18,8 @@ float4 PSAperture(float4 pos : SV_POSITION) : SV_Target {
 	float a = (atan2(ndc.x, ndc.y) + aperture_opening)/TWOPI + 3.f/4.f;
 	float o = frac(a * num_of_blades + 0.5);
 	float w1 = lerp(0.010, 0.001f, saturate((num_of_blades - 4)/10.f));
-	float w2 = lerp(0.025, 0.001f, saturate((num_of_blades - 4)/10.f));
 	float s0 = sin(o * 2 * PI);
 	float s1 = s0 * w1;
-	float s2 = s0 * w2;
 
 	// fft aperture shape
 	float signed_distance = 0.f;
@@ -41,15 +33,8 @@ float4 PSAperture(float4 pos : SV_POSITION) : SV_Target {
 	float aperture_fft = fade_aperture_edge(0.7, 0.00001, signed_distance);
 
 	// camera aperture shape
-	signed_distance = 0.f;
-	for(int i = 0; i < num_of_blades; ++i) {
-		float angle = aperture_opening + (i/float(num_of_blades)) * TWOPI;
-		float2 axis = float2(cos(angle), sin(angle));
-		signed_distance = smax(signed_distance, dot(axis, ndc), 0.1);
-	}
-
-	signed_distance += s2;
-	float aperture_mask = fade_aperture_edge(0.7, 0.1, signed_distance);
+	signed_distance = ApertureBladeDistance(ndc);
+	float aperture_mask = fade_aperture_edge(APERTURE_RADIUS, APERTURE_FADE, signed_distance);
 
 	{ // Diffraction rings
 		float w = 0.2;
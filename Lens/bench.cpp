@@ -0,0 +1,660 @@
+//--------------------------------------------------------------------------------------
+// Microbenchmarks of the CPU kernels, a console program next to the viewer:
+//
+//   Bench [--filter text] [--sizes 256,512,...] [--raster-sizes 320,...] [--threads 1,2,...]
+//         [--rays n] [--min-time ms] [--repetitions n] [--lenses directory] [--json path]
+//
+// Every benchmark runs its op until a repetition takes at least min-time, then times
+// repetitions of that many ops. It reports the mean ns per op with its relative standard
+// deviation and the fastest repetition, items (rays, pixels, points) per second and GB/s.
+// The bytes are what the op reads and writes once, so GB/s is an effective rate and not
+// what the caches see. Kernels that run on the shared pool (thread_pool.h) are measured at
+// every thread count of --threads, with their speedup over one thread. --json writes the
+// results for comparing builds.
+//
+// Image kernels take their side from --sizes, the flare raster its width from --raster-sizes
+// (it draws every ghost patch over most of the image, so it is the slowest per pixel). Trace
+// kernels use the viewer's two lenses, read from nikon_28_75mm.lens and angenieux.lens in
+// --lenses (lenses by default), with a light slightly off axis, the spectral ones at the
+// dispersion samples, the flare ones at the viewer's three wavelengths. Plate glare
+// (glare.h) is first checked against a direct convolution on a small plate, a mismatch
+// fails the run. The tonemap is the CPU port of post.hlsl, the GPU stages themselves are
+// timed by the viewer's timestamp queries. The frame benchmarks render whole CPU frames
+// (flare_frame.h) with their stages in order, as a task graph and pipelined.
+//--------------------------------------------------------------------------------------
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "aperture.h"
+#include "cpu_fft.h"
+#include "flare_context.h"
+#include "flare_frame.h"
+#include "glare.h"
+#include "hdr_image.h"
+#include "starburst.h"
+
+using namespace std;
+
+struct BenchOptions {
+	string filter;
+	vector<int> sizes = { 256, 512, 1024, 2048 };
+	vector<int> raster_sizes = { 320, 640 };
+	vector<int> threads;
+	int rays = 4096;
+	double min_time_ms = 100.0;
+	int repetitions = 5;
+	string lenses = "lenses";
+	string json;
+};
+
+struct BenchResult {
+	string name;
+	int threads;
+	int64_t iterations;       // ops per repetition
+	double ns_per_op;         // mean over the repetitions
+	double ns_stddev;
+	double ns_min;
+	double items_per_op;
+	double bytes_per_op;
+	double speedup;           // over one thread, 0 when not measured
+};
+
+struct Bench {
+	BenchOptions options;
+	vector<BenchResult> results;
+	LensPrescription nikon, angenieux;
+	int failed_checks = 0;
+	volatile float sink = 0.f;  // keeps results of the ops alive
+
+	bool Matches(const string& name) const {
+		return options.filter.empty() || name.find(options.filter) != string::npos;
+	}
+
+	static double Seconds(chrono::steady_clock::time_point a, chrono::steady_clock::time_point b) {
+		return chrono::duration<double>(b - a).count();
+	}
+
+	// Times op at one thread count
+	BenchResult Measure(const string& name, int threads, double items, double bytes, const function<void()>& op) {
+		op();
+
+		int64_t n = 1;
+		while (true) {
+			auto start = chrono::steady_clock::now();
+			for (int64_t i = 0; i < n; ++i)
+				op();
+			double elapsed = Seconds(start, chrono::steady_clock::now());
+			if (elapsed * 1000.0 >= options.min_time_ms || n >= (int64_t(1) << 40))
+				break;
+			n = elapsed > 0.0 ? max(n * 2, (int64_t)(n * options.min_time_ms / (elapsed * 1000.0) * 1.2)) : n * 16;
+		}
+
+		vector<double> times;
+		for (int r = 0; r < options.repetitions; ++r) {
+			auto start = chrono::steady_clock::now();
+			for (int64_t i = 0; i < n; ++i)
+				op();
+			times.push_back(Seconds(start, chrono::steady_clock::now()) * 1e9 / n);
+		}
+
+		double mean = 0.0, variance = 0.0;
+		for (double t : times)
+			mean += t;
+		mean /= times.size();
+		for (double t : times)
+			variance += (t - mean) * (t - mean);
+		variance = times.size() > 1 ? variance / (times.size() - 1) : 0.0;
+
+		BenchResult result = { name, threads, n, mean, sqrt(variance), *min_element(times.begin(), times.end()), items, bytes, 0.0 };
+		return result;
+	}
+
+	void Print(const BenchResult& r) {
+		char speedup[32] = "", bandwidth[32] = "-";
+		if (r.speedup > 0.0)
+			snprintf(speedup, sizeof(speedup), "%6.2fx", r.speedup);
+		if (r.bytes_per_op > 0.0)
+			snprintf(bandwidth, sizeof(bandwidth), "%9.3f", r.bytes_per_op / r.ns_per_op);
+		printf("%-44s %3d %14.1f %6.1f%% %14.1f %12.3f %9s %8s\n", r.name.c_str(), r.threads, r.ns_per_op, r.ns_per_op > 0.0 ? 100.0 * r.ns_stddev / r.ns_per_op : 0.0,
+			r.ns_min, r.items_per_op * 1e3 / r.ns_per_op, bandwidth, speedup);
+		fflush(stdout);
+	}
+
+	// Runs op at one thread, or at every thread count of the options when threaded. items and
+	// bytes are per op
+	void Run(const string& name, double items, double bytes, bool threaded, const function<void()>& op) {
+		if (!Matches(name))
+			return;
+
+		vector<int> counts = threaded ? options.threads : vector<int>(1, 1);
+		double single = 0.0;
+		for (int threads : counts) {
+			if (threaded)
+				Workers.SetNumThreads(threads);
+			BenchResult result = Measure(name, threads, items, bytes, op);
+			if (threaded && threads == 1)
+				single = result.ns_per_op;
+			if (threaded && single > 0.0)
+				result.speedup = single / result.ns_per_op;
+			Print(result);
+			results.push_back(result);
+		}
+		if (threaded)
+			Workers.SetNumThreads(options.threads.back());
+	}
+
+	static void WriteJSONString(FILE* file, const string& s) {
+		fputc('"', file);
+		for (char c : s) {
+			if (c == '"' || c == '\\')
+				fputc('\\', file);
+			fputc(c, file);
+		}
+		fputc('"', file);
+	}
+
+	bool WriteJSON(const string& path) const {
+		FILE* file = fopen(path.c_str(), "wb");
+		if (!file)
+			return false;
+
+	#if defined(_MSC_VER)
+		string compiler = "msvc " + to_string(_MSC_VER);
+	#elif defined(__VERSION__)
+		string compiler = __VERSION__;
+	#else
+		string compiler = "unknown";
+	#endif
+
+		fprintf(file, "{\n\"machine\":{\"hardware_threads\":%u,\"pointer_bits\":%d,\"compiler\":", thread::hardware_concurrency(), (int)sizeof(void*) * 8);
+		WriteJSONString(file, compiler);
+		fprintf(file, "},\n\"options\":{\"min_time_ms\":%g,\"repetitions\":%d,\"rays\":%d},\n\"results\":[\n", options.min_time_ms, options.repetitions, options.rays);
+		for (size_t i = 0; i < results.size(); ++i) {
+			const BenchResult& r = results[i];
+			fprintf(file, "{\"name\":");
+			WriteJSONString(file, r.name);
+			fprintf(file, ",\"threads\":%d,\"iterations\":%lld,\"ns_per_op\":%.3f,\"ns_stddev\":%.3f,\"ns_min\":%.3f,\"items_per_op\":%.0f,\"items_per_second\":%.1f,\"bytes_per_op\":%.0f,\"gb_per_second\":%.4f,\"speedup\":%.4f}%s\n",
+				r.threads, (long long)r.iterations, r.ns_per_op, r.ns_stddev, r.ns_min, r.items_per_op, r.items_per_op * 1e9 / r.ns_per_op,
+				r.bytes_per_op, r.bytes_per_op / r.ns_per_op, r.speedup, i + 1 < results.size() ? "," : "");
+		}
+		fprintf(file, "]\n}\n");
+		return fclose(file) == 0;
+	}
+} Bench;
+
+//--------------------------------------------------------------------------------------
+// Kernels
+//--------------------------------------------------------------------------------------
+
+struct BenchLens {
+	const char* name;
+	FlareContext context;
+};
+
+// One of the viewer's lenses at the default settings, traced for one light slightly off axis
+static void InitLens(BenchLens& lens, bool nikon, bool dispersion) {
+	lens.name = nikon ? "nikon" : "angenieux";
+	lens.context.SetLens(nikon ? Bench.nikon : Bench.angenieux);
+	lens.context.settings.dispersion = dispersion;
+
+	SceneLight light = { { 0.02f, 0.01f, -0.9997f }, { 1.f, 1.f, 1.f }, 6000.f };
+	lens.context.SetLights(&light, 1);
+	lens.context.Prepare();
+}
+
+// The patch grid TracePatches starts from, n * n rays at the entrance
+static vector<Ray> EntryRays(const FlareContext& context, int n, vec3 direction) {
+	vector<Ray> rays;
+	for (int k = 0; k < n * n; ++k) {
+		float sx = ((k % n) / float(n - 1) - 0.5f) * 2.f * context.settings.rays_spread;
+		float sy = ((k / n) / float(n - 1) - 0.5f) * 2.f * context.settings.rays_spread;
+		float c = cosf(2.f), s = sinf(2.f);
+		Ray r = { vec3(sx * c - sy * s, sy * c + sx * s, 1000.f), vec3(0.f, 0.f, -1.f), vec4() };
+		Intersection entry = testSPHERE(r, context.interfaces[0]);
+		Ray start = { entry.pos - direction, direction, vec4(0.f, 0.f, 0.f, 1.f) };
+		rays.push_back(start);
+	}
+	return rays;
+}
+
+static void BenchIntersections() {
+	BenchLens lens;
+	InitLens(lens, true, false);
+	const vector<LensInterface>& interfaces = lens.context.interfaces;
+	int n = max(2, (int)sqrtf((float)Bench.options.rays));
+	vector<Ray> rays = EntryRays(lens.context, n, vec3(0.02f, 0.01f, -0.9997f));
+	double count = (double)rays.size();
+
+	Bench.Run("intersect/sphere", count, count * sizeof(Ray), false, [&]() {
+		float sum = 0.f;
+		for (const Ray& r : rays)
+			sum += testSPHERE(r, interfaces[1]).pos.z;
+		Bench.sink = sum;
+	});
+
+	Bench.Run("intersect/flat", count, count * sizeof(Ray), false, [&]() {
+		float sum = 0.f;
+		for (const Ray& r : rays)
+			sum += testFLAT(r, interfaces[lens.context.aperture_id]).pos.x;
+		Bench.sink = sum;
+	});
+}
+
+static void BenchFresnel() {
+	int n = Bench.options.rays;
+	vector<float> theta(n), lambda(n);
+	for (int i = 0; i < n; ++i) {
+		theta[i] = (i % 97) / 97.f * 1.4f + 0.001f;
+		lambda[i] = (400.f + (i % 31) * 10.f) * 0.0000001f;
+	}
+
+	Bench.Run("fresnel_ar", n, n * 2.0 * sizeof(float), false, [&]() {
+		float sum = 0.f;
+		for (int i = 0; i < n; ++i)
+			sum += FresnelAR(theta[i], lambda[i], 0.0000001f * 1.f, 1.f, 1.38f, 1.62f);
+		Bench.sink = sum;
+	});
+}
+
+static void BenchTrace(bool nikon) {
+	BenchLens lens;
+	InitLens(lens, nikon, true);
+	string prefix = string("/") + lens.name;
+	FlareContext& context = lens.context;
+	const vector<LensInterface>& interfaces = context.interfaces;
+	int num_ghosts = context.NumGhosts();
+	vec3 direction(context.traces[0].direction[0], context.traces[0].direction[1], context.traces[0].direction[2]);
+
+	// Scalar Trace, one wavelength, the way the 2D view traces
+	int n = max(2, (int)sqrtf((float)Bench.options.rays));
+	vector<Ray> rays = EntryRays(context, n, direction);
+	vector<vec3> i1, i2, i3;
+	auto trace_ghost = [&](int ghost, float& sum) {
+		int2 bounces = { (int)context.ghosts[ghost * 4], (int)context.ghosts[ghost * 4 + 1] };
+		for (const Ray& r : rays)
+			sum += Trace(r, 0.00005f, interfaces, i1, i2, i3, bounces, nullptr, context.aperture_id).tex.a;
+	};
+
+	int samples[] = { 0, num_ghosts / 2, num_ghosts - 1 };
+	for (int ghost : samples) {
+		char name[64];
+		snprintf(name, sizeof(name), "trace/ghost%s/%d_%d", prefix.c_str(), (int)context.ghosts[ghost * 4], (int)context.ghosts[ghost * 4 + 1]);
+		Bench.Run(name, (double)rays.size(), 0.0, false, [&]() {
+			float sum = 0.f;
+			trace_ghost(ghost, sum);
+			Bench.sink = sum;
+		});
+	}
+
+	// Every ghost from a coarser grid, so one op stays short
+	vector<Ray> coarse = EntryRays(context, 16, direction);
+	Bench.Run("trace/lens" + prefix, (double)coarse.size() * num_ghosts, 0.0, false, [&]() {
+		float sum = 0.f;
+		for (int ghost = 0; ghost < num_ghosts; ++ghost) {
+			int2 bounces = { (int)context.ghosts[ghost * 4], (int)context.ghosts[ghost * 4 + 1] };
+			for (const Ray& r : coarse)
+				sum += Trace(r, 0.00005f, interfaces, i1, i2, i3, bounces, nullptr, context.aperture_id).tex.a;
+		}
+		Bench.sink = sum;
+	});
+
+	// SpectralTracer at every wavelength
+	vector<SpectralHit> hits(context.tracer.num_wavelengths);
+	double lanes = (double)coarse.size() * num_ghosts * context.tracer.num_wavelengths;
+	Bench.Run("spectral/lens" + prefix, lanes, 0.0, false, [&]() {
+		float sum = 0.f;
+		for (int ghost = 0; ghost < num_ghosts; ++ghost) {
+			int2 bounces = { (int)context.ghosts[ghost * 4], (int)context.ghosts[ghost * 4 + 1] };
+			for (const Ray& r : coarse) {
+				context.tracer.Trace(r.pos, r.dir, bounces, nullptr, hits.data());
+				sum += hits[0].intensity;
+			}
+		}
+		Bench.sink = sum;
+	});
+}
+
+// The whole CPU flare trace and raster on the pool
+static void BenchFlare(bool nikon) {
+	BenchLens lens;
+	InitLens(lens, nikon, false);
+	FlareContext& context = lens.context;
+	string prefix = string("/") + lens.name;
+	int num_ghosts = context.NumGhosts();
+
+	int patch_size = context.settings.patch_tesselation * context.settings.patch_tesselation;
+	Bench.Run("flare/trace" + prefix, (double)context.traces.size() * num_ghosts * patch_size * context.NumWavelengths(), 0.0, true, [&]() {
+		context.TracePatches();
+	});
+
+	HDRImage image;
+	for (int size : Bench.options.raster_sizes) {
+		context.settings.width = size;
+		context.settings.height = size / 2;
+		double pixels = (double)size * (size / 2);
+		Bench.Run("flare/raster" + prefix + "/" + to_string(size), pixels, pixels * 3 * sizeof(float), true, [&]() {
+			context.Render(image);
+		});
+	}
+}
+
+static void BenchFFT() {
+	for (int size : Bench.options.sizes) {
+		string name = "fft/" + to_string(size);
+		if (!Bench.Matches(name))
+			continue;
+
+		FFT2D fft;
+		vector<float> re((size_t)size * size), im((size_t)size * size);
+		for (size_t i = 0; i < re.size(); ++i) {
+			re[i] = (float)(i % 13) / 13.f;
+			im[i] = 0.f;
+		}
+		double points = (double)size * size;
+		Bench.Run(name, points, points * 2 * sizeof(float) * 2, true, [&]() {
+			fft.Forward(re.data(), im.data(), size, size);
+			Bench.sink = re[0];
+		});
+	}
+}
+
+static void BenchApertureAndStarburst() {
+	const int dust_resolution = 512;
+	vector<float> dust_texture((size_t)dust_resolution * dust_resolution, 1.f);
+	ApertureGenerator generator;
+	vector<float> aperture, dust, mask;
+
+	for (int size : Bench.options.sizes) {
+		double pixels = (double)size * size;
+		Bench.Run("aperture/" + to_string(size), pixels, pixels * 3 * sizeof(float), true, [&]() {
+			generator.Generate(5.f, 7.f, size, dust_texture.data(), dust_resolution, aperture, dust, mask);
+		});
+	}
+
+	// The spectrum takes a while, only made when a starburst benchmark runs
+	bool starburst = false;
+	for (int size : Bench.options.sizes)
+		starburst = starburst || Bench.Matches("starburst/synthesis/" + to_string(size)) || Bench.Matches("starburst/filter/" + to_string(size));
+	if (!starburst && !Bench.Matches("starburst/spectrum/512"))
+		return;
+
+	// Spectrum of the viewer's 512 aperture, synthesized and filtered at every size
+	const int spectrum_size = 512;
+	generator.Generate(5.f, 7.f, spectrum_size, dust_texture.data(), dust_resolution, aperture, dust, mask);
+	StarburstPipeline pipeline;
+	ApertureKey key = { 5.f, 7.f };
+	pipeline.SetSpectrum(key, aperture.data(), dust.data(), spectrum_size);
+
+	double spectrum_points = (double)spectrum_size * spectrum_size;
+	Bench.Run("starburst/spectrum/" + to_string(spectrum_size), spectrum_points, spectrum_points * 2 * sizeof(float), true, [&]() {
+		pipeline.SetSpectrum(key, aperture.data(), dust.data(), spectrum_size);
+	});
+
+	vector<float> rgb;
+	for (int size : Bench.options.sizes) {
+		double pixels = (double)size * size;
+		Bench.Run("starburst/synthesis/" + to_string(size), pixels, pixels * 3 * sizeof(float), true, [&]() {
+			pipeline.synthesis.Synthesize(pipeline.spectrum, size, rgb);
+		});
+		pipeline.synthesis.Transform(pipeline.spectrum);
+		Bench.Run("starburst/filter/" + to_string(size), pixels, pixels * 3 * sizeof(float), true, [&]() {
+			pipeline.filter.Filter(pipeline.synthesis, size, rgb);
+		});
+	}
+}
+
+// Plate with a bright spot every 48 pixels over a dim ramp, so no tile is skipped, and a radial
+// PSF with four spikes, the shape of a starburst without computing one
+static void GlareInputs(int width, int height, int psf_resolution, HDRImage& plate, vector<float>& psf) {
+	plate.Resize(width, height);
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x)
+			for (int c = 0; c < 3; ++c)
+				plate.Pixel(x, y)[c] = 0.5f * x / width + 0.1f * c;
+	for (int y = 11; y < height; y += 48) {
+		for (int x = 5 + y % 7; x < width; x += 48) {
+			float* p = plate.Pixel(x, y);
+			p[0] = 40.f + x % 5, p[1] = 20.f, p[2] = 10.f * (y % 3);
+		}
+	}
+
+	psf.resize((size_t)psf_resolution * psf_resolution * 3);
+	float c = (psf_resolution - 1) * 0.5f;
+	for (int y = 0; y < psf_resolution; ++y) {
+		for (int x = 0; x < psf_resolution; ++x) {
+			float dx = (x - c) / psf_resolution, dy = (y - c) / psf_resolution;
+			float spikes = expf(-fabsf(dx) * 200.f) + expf(-fabsf(dy) * 200.f);
+			float value = expf(-(dx * dx + dy * dy) * 400.f) + 0.2f * spikes;
+			for (int k = 0; k < 3; ++k)
+				psf[((size_t)y * psf_resolution + x) * 3 + k] = value * (1.f + 0.2f * k);
+		}
+	}
+}
+
+// The overlap-save glare against a direct convolution with the same threshold, PSF centre and
+// normalization. The PSF is given at its plate size, so it is not resampled
+static bool CheckGlare() {
+	const int width = 300, height = 200, m = 31;
+	HDRImage plate;
+	vector<float> psf;
+	GlareInputs(width, height, m, plate, psf);
+
+	GlareConvolution glare;
+	glare.SetPSF(1, psf.data(), m, m);
+	vector<float> fast((size_t)width * height * 3);
+	glare.Convolve(plate.rgb.data(), width, height, fast.data());
+
+	double total = 0.0;
+	for (int i = 0; i < m * m; ++i)
+		total += GlareConvolution::Luminance(&psf[i * 3]);
+	float scale = (float)(glare.intensity / total);
+
+	vector<float> excess((size_t)width * height * 3);
+	for (size_t i = 0; i < (size_t)width * height; ++i) {
+		float luminance = GlareConvolution::Luminance(&plate.rgb[i * 3]);
+		float f = luminance > glare.threshold ? (luminance - glare.threshold) / luminance : 0.f;
+		for (int c = 0; c < 3; ++c)
+			excess[i * 3 + c] = plate.rgb[i * 3 + c] * f;
+	}
+
+	double largest = 0.0, difference = 0.0;
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			double sum[3] = { 0.0, 0.0, 0.0 };
+			for (int j = 0; j < m; ++j) {
+				int sy = y + m / 2 - j;
+				if (sy < 0 || sy >= height)
+					continue;
+				for (int i = 0; i < m; ++i) {
+					int sx = x + m / 2 - i;
+					if (sx < 0 || sx >= width)
+						continue;
+					for (int c = 0; c < 3; ++c)
+						sum[c] += (double)psf[((size_t)j * m + i) * 3 + c] * excess[((size_t)sy * width + sx) * 3 + c];
+				}
+			}
+			for (int c = 0; c < 3; ++c) {
+				double direct = sum[c] * scale;
+				largest = max(largest, fabs(direct));
+				difference = max(difference, fabs(direct - fast[((size_t)y * width + x) * 3 + c]));
+			}
+		}
+	}
+
+	if (largest == 0.0 || difference > largest * 1e-4) {
+		fprintf(stderr, "glare: overlap-save differs from the direct convolution by %g of %g\n", difference, largest);
+		return false;
+	}
+	return true;
+}
+
+// Plates of every size through a 128 pixel PSF, an op is the whole plate
+static void BenchGlare() {
+	bool any = false;
+	for (int size : Bench.options.sizes)
+		any = any || Bench.Matches("glare/" + to_string(size));
+	if (!any)
+		return;
+
+	if (!CheckGlare())
+		Bench.failed_checks++;
+
+	const int psf_resolution = 256, psf_size = 128;
+	for (int size : Bench.options.sizes) {
+		HDRImage plate;
+		vector<float> psf, out((size_t)size * size * 3);
+		GlareInputs(size, size, psf_resolution, plate, psf);
+		GlareConvolution glare;
+		glare.SetPSF(1, psf.data(), psf_resolution, psf_size);
+
+		double pixels = (double)size * size;
+		Bench.Run("glare/" + to_string(size), pixels, pixels * 2 * 3 * sizeof(float), true, [&]() {
+			glare.Convolve(plate.rgb.data(), size, size, out.data());
+			Bench.sink = out[0];
+		});
+	}
+}
+
+static void BenchToneMap() {
+	for (int size : Bench.options.sizes) {
+		string name = "tonemap/" + to_string(size);
+		if (!Bench.Matches(name))
+			continue;
+
+		HDRImage image;
+		image.Resize(size, size / 2);
+		for (size_t i = 0; i < image.rgb.size(); ++i)
+			image.rgb[i] = (float)(i % 1024) / 256.f;
+		vector<uint8_t> rgba;
+		double pixels = (double)image.width * image.height;
+		Bench.Run(name, pixels, pixels * (3 * sizeof(float) + 4), false, [&]() {
+			image.ToneMap(rgba);
+			Bench.sink = rgba[0];
+		});
+	}
+}
+
+// Whole frames of a light moving across the Angenieux (flare_frame.h), the stages one after the
+// other, as a task graph, and pipelined across frames. An op is a sequence of frames
+static void BenchFrame() {
+	const int num_frames = 4;
+	const char* modes[] = { "serial", "graph", "pipelined" };
+
+	for (int size : Bench.options.raster_sizes) {
+		FlareSettings settings;
+		settings.width = size;
+		settings.height = size / 2;
+
+		for (int mode = 0; mode < 3; ++mode) {
+			string name = string("frame/") + modes[mode] + "/angenieux/" + to_string(size);
+			if (!Bench.Matches(name))
+				continue;
+
+			FlareFramePipeline pipeline;
+			pipeline.SetLens(Bench.angenieux);
+			pipeline.concurrent = mode != 0;
+			pipeline.starburst_resolution = 256;
+
+			int64_t frame = 0;
+			double pixels = (double)num_frames * settings.width * settings.height;
+			Bench.Run(name, pixels, 0.0, true, [&]() {
+				for (int i = 0; i < num_frames; ++i, ++frame) {
+					float x = 0.02f + 0.01f * (frame % 8);
+					vector<SceneLight> scene(1, SceneLight{ { x, 0.01f, -1.f }, { 1.f, 1.f, 1.f }, 6000.f });
+					if (mode == 2)
+						pipeline.Submit(settings, scene);
+					else
+						pipeline.Render(settings, scene);
+				}
+				if (mode == 2)
+					pipeline.Flush();
+			});
+		}
+	}
+}
+
+static vector<int> ParseList(const char* text) {
+	vector<int> values;
+	for (const char* p = text; *p;) {
+		values.push_back(atoi(p));
+		const char* comma = strchr(p, ',');
+		if (!comma)
+			break;
+		p = comma + 1;
+	}
+	return values;
+}
+
+int main(int argc, char** argv) {
+	BenchOptions& options = Bench.options;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		auto value = [&]() -> const char* { return i + 1 < argc ? argv[++i] : ""; };
+		if (arg == "--filter")
+			options.filter = value();
+		else if (arg == "--sizes")
+			options.sizes = ParseList(value());
+		else if (arg == "--raster-sizes")
+			options.raster_sizes = ParseList(value());
+		else if (arg == "--threads")
+			options.threads = ParseList(value());
+		else if (arg == "--rays")
+			options.rays = max(4, atoi(value()));
+		else if (arg == "--min-time")
+			options.min_time_ms = max(1.0, atof(value()));
+		else if (arg == "--repetitions")
+			options.repetitions = max(1, atoi(value()));
+		else if (arg == "--lenses")
+			options.lenses = value();
+		else if (arg == "--json")
+			options.json = value();
+		else {
+			fprintf(stderr, "usage: Bench [--filter text] [--sizes 256,512] [--raster-sizes 320] [--threads 1,2,4] [--rays n] [--min-time ms] [--repetitions n] [--lenses directory] [--json path]\n");
+			return 1;
+		}
+	}
+
+	string error;
+	if (!Bench.nikon.Load(options.lenses + "/nikon_28_75mm.lens", &error) || !Bench.angenieux.Load(options.lenses + "/angenieux.lens", &error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+
+	int hardware = max(1, (int)thread::hardware_concurrency());
+	if (options.threads.empty()) {
+		for (int t = 1; t < hardware; t *= 2)
+			options.threads.push_back(t);
+		options.threads.push_back(hardware);
+	}
+	for (int& t : options.threads)
+		t = max(1, t);
+
+	printf("%-44s %3s %14s %7s %14s %12s %9s %8s\n", "benchmark", "thr", "ns/op", "rsd", "min ns/op", "Mitems/s", "GB/s", "speedup");
+	BenchIntersections();
+	BenchFresnel();
+	BenchTrace(true);
+	BenchTrace(false);
+	BenchFlare(true);
+	BenchFlare(false);
+	BenchFFT();
+	BenchApertureAndStarburst();
+	BenchGlare();
+	BenchToneMap();
+	BenchFrame();
+
+	if (!options.json.empty() && !Bench.WriteJSON(options.json)) {
+		fprintf(stderr, "cannot write %s\n", options.json.c_str());
+		return 1;
+	}
+	return Bench.failed_checks > 0 ? 2 : 0;
+}
@@ -0,0 +1,608 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// CPU counterpart of fft.hlsl: computes the same unnormalized forward 2D DFT as
+// FFT::RunDispatchSLM (row pass then column pass) on split real / imaginary planes.
+// 1D transforms are self-sorting (Stockham) mixed radix passes: SIMD radix-4 and radix-2
+// for the powers of two, generic radix 3, 5 and 7 for the remaining factors, and
+// Bluestein's chirp-z algorithm for lengths with any larger prime factor. The column pass
+// runs on rows of a cache-blocked transpose, and rows are spread over the worker pool.
+//--------------------------------------------------------------------------------------
+
+#include <emmintrin.h>
+#include <math.h>
+#include <string.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "profiler.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+// Per thread scratch memory for the 1D passes, grows to the largest transform seen
+inline float* FFTScratch(size_t num_floats) {
+	static thread_local vector<float> scratch;
+	if (scratch.size() < num_floats)
+		scratch.resize(num_floats);
+	return scratch.data();
+}
+
+struct FFTPlan {
+	struct Stage {
+		int radix;
+		int m;        // butterflies per sub transform (sub transform length / radix)
+		int s;        // number of interleaved sub transforms
+		int twiddles; // offset of the (radix - 1) * m twiddles of this stage
+	};
+
+	int length = 0;
+	vector<Stage> stages;
+	vector<float> twiddle_re;
+	vector<float> twiddle_im;
+
+	// Bluestein: x * chirp convolved with conj(chirp) through a power of two transform
+	unique_ptr<FFTPlan> bluestein;
+	vector<float> chirp_re, chirp_im;
+	vector<float> kernel_re, kernel_im;
+
+	static int SmallestRadix(int n) {
+		if (n % 4 == 0) return 4;
+		if (n % 2 == 0) return 2;
+		if (n % 3 == 0) return 3;
+		if (n % 5 == 0) return 5;
+		if (n % 7 == 0) return 7;
+		return 0;
+	}
+
+	// True when the length only has factors 2, 3, 5 and 7 and runs without Bluestein
+	static bool IsSmooth(int n) {
+		while (n > 1) {
+			int radix = SmallestRadix(n);
+			if (radix == 0)
+				return false;
+			n /= radix;
+		}
+		return true;
+	}
+
+	// Floats of scratch memory Forward and Inverse need
+	int WorkSize() const {
+		return bluestein ? bluestein->length * 2 + bluestein->WorkSize() : length * 2;
+	}
+
+	void Init(int n) {
+		length = n;
+		stages.clear();
+		twiddle_re.clear();
+		twiddle_im.clear();
+		bluestein.reset();
+
+		if (!IsSmooth(n)) {
+			InitBluestein(n);
+			return;
+		}
+
+		int s = 1;
+		while (n > 1) {
+			int radix = SmallestRadix(n);
+			Stage stage = { radix, n / radix, s, (int)twiddle_re.size() };
+
+			for (int k = 1; k < radix; ++k) {
+				for (int p = 0; p < stage.m; ++p) {
+					double a = -2.0 * 3.14159265358979323846 * double(k * p) / double(n);
+					twiddle_re.push_back((float)cos(a));
+					twiddle_im.push_back((float)sin(a));
+				}
+			}
+
+			stages.push_back(stage);
+			n /= radix;
+			s *= radix;
+		}
+	}
+
+	void InitBluestein(int n) {
+		int m = 1;
+		while (m < 2 * n - 1)
+			m *= 2;
+
+		bluestein.reset(new FFTPlan());
+		bluestein->Init(m);
+
+		// chirp(k) = exp(-i pi k^2 / n), k^2 taken modulo 2n to keep the angle exact
+		chirp_re.resize(n);
+		chirp_im.resize(n);
+		for (int k = 0; k < n; ++k) {
+			long long k2 = ((long long)k * k) % (2LL * n);
+			double a = -3.14159265358979323846 * double(k2) / double(n);
+			chirp_re[k] = (float)cos(a);
+			chirp_im[k] = (float)sin(a);
+		}
+
+		// Transform of the conjugated chirp wrapped around m, with the 1 / m of the inverse folded in
+		kernel_re.assign(m, 0.f);
+		kernel_im.assign(m, 0.f);
+		for (int k = 0; k < n; ++k) {
+			kernel_re[k] = chirp_re[k] / m;
+			kernel_im[k] = -chirp_im[k] / m;
+			if (k > 0) {
+				kernel_re[m - k] = kernel_re[k];
+				kernel_im[m - k] = kernel_im[k];
+			}
+		}
+
+		vector<float> work(bluestein->WorkSize());
+		bluestein->Forward(kernel_re.data(), kernel_im.data(), work.data());
+	}
+
+	static inline void Mul(__m128 ar, __m128 ai, __m128 wr, __m128 wi, __m128& r, __m128& i) {
+		r = _mm_sub_ps(_mm_mul_ps(ar, wr), _mm_mul_ps(ai, wi));
+		i = _mm_add_ps(_mm_mul_ps(ar, wi), _mm_mul_ps(ai, wr));
+	}
+
+	void Radix4(const Stage& st, const float* xr, const float* xi, float* yr, float* yi) const {
+		const int m = st.m;
+		const int s = st.s;
+		const float* w1r = &twiddle_re[st.twiddles];
+		const float* w1i = &twiddle_im[st.twiddles];
+		const float* w2r = w1r + m;
+		const float* w2i = w1i + m;
+		const float* w3r = w2r + m;
+		const float* w3i = w2i + m;
+
+		if (s % 4 == 0) {
+			// Vectorize over the interleaved sub transforms, twiddles are uniform across lanes
+			for (int p = 0; p < m; ++p) {
+				__m128 t1r = _mm_set1_ps(w1r[p]), t1i = _mm_set1_ps(w1i[p]);
+				__m128 t2r = _mm_set1_ps(w2r[p]), t2i = _mm_set1_ps(w2i[p]);
+				__m128 t3r = _mm_set1_ps(w3r[p]), t3i = _mm_set1_ps(w3i[p]);
+
+				for (int q = 0; q < s; q += 4) {
+					int i0 = q + s * p;
+					__m128 ar = _mm_loadu_ps(xr + i0),             ai = _mm_loadu_ps(xi + i0);
+					__m128 br = _mm_loadu_ps(xr + i0 + s * m),     bi = _mm_loadu_ps(xi + i0 + s * m);
+					__m128 cr = _mm_loadu_ps(xr + i0 + s * m * 2), ci = _mm_loadu_ps(xi + i0 + s * m * 2);
+					__m128 dr = _mm_loadu_ps(xr + i0 + s * m * 3), di = _mm_loadu_ps(xi + i0 + s * m * 3);
+
+					__m128 apcr = _mm_add_ps(ar, cr), apci = _mm_add_ps(ai, ci);
+					__m128 amcr = _mm_sub_ps(ar, cr), amci = _mm_sub_ps(ai, ci);
+					__m128 bpdr = _mm_add_ps(br, dr), bpdi = _mm_add_ps(bi, di);
+					__m128 jbmdr = _mm_sub_ps(bi, di), jbmdi = _mm_sub_ps(dr, br); // -j * (b - d)
+
+					int o = q + s * 4 * p;
+					__m128 r, i;
+					_mm_storeu_ps(yr + o, _mm_add_ps(apcr, bpdr));
+					_mm_storeu_ps(yi + o, _mm_add_ps(apci, bpdi));
+
+					Mul(_mm_add_ps(amcr, jbmdr), _mm_add_ps(amci, jbmdi), t1r, t1i, r, i);
+					_mm_storeu_ps(yr + o + s, r);
+					_mm_storeu_ps(yi + o + s, i);
+
+					Mul(_mm_sub_ps(apcr, bpdr), _mm_sub_ps(apci, bpdi), t2r, t2i, r, i);
+					_mm_storeu_ps(yr + o + s * 2, r);
+					_mm_storeu_ps(yi + o + s * 2, i);
+
+					Mul(_mm_sub_ps(amcr, jbmdr), _mm_sub_ps(amci, jbmdi), t3r, t3i, r, i);
+					_mm_storeu_ps(yr + o + s * 3, r);
+					_mm_storeu_ps(yi + o + s * 3, i);
+				}
+			}
+		} else if (s == 1 && m % 4 == 0) {
+			// First pass: vectorize over butterflies and transpose the 4x4 outputs on store
+			for (int p = 0; p < m; p += 4) {
+				__m128 ar = _mm_loadu_ps(xr + p),         ai = _mm_loadu_ps(xi + p);
+				__m128 br = _mm_loadu_ps(xr + p + m),     bi = _mm_loadu_ps(xi + p + m);
+				__m128 cr = _mm_loadu_ps(xr + p + m * 2), ci = _mm_loadu_ps(xi + p + m * 2);
+				__m128 dr = _mm_loadu_ps(xr + p + m * 3), di = _mm_loadu_ps(xi + p + m * 3);
+
+				__m128 apcr = _mm_add_ps(ar, cr), apci = _mm_add_ps(ai, ci);
+				__m128 amcr = _mm_sub_ps(ar, cr), amci = _mm_sub_ps(ai, ci);
+				__m128 bpdr = _mm_add_ps(br, dr), bpdi = _mm_add_ps(bi, di);
+				__m128 jbmdr = _mm_sub_ps(bi, di), jbmdi = _mm_sub_ps(dr, br);
+
+				__m128 y0r = _mm_add_ps(apcr, bpdr), y0i = _mm_add_ps(apci, bpdi);
+				__m128 y1r, y1i, y2r, y2i, y3r, y3i;
+				Mul(_mm_add_ps(amcr, jbmdr), _mm_add_ps(amci, jbmdi), _mm_loadu_ps(w1r + p), _mm_loadu_ps(w1i + p), y1r, y1i);
+				Mul(_mm_sub_ps(apcr, bpdr), _mm_sub_ps(apci, bpdi), _mm_loadu_ps(w2r + p), _mm_loadu_ps(w2i + p), y2r, y2i);
+				Mul(_mm_sub_ps(amcr, jbmdr), _mm_sub_ps(amci, jbmdi), _mm_loadu_ps(w3r + p), _mm_loadu_ps(w3i + p), y3r, y3i);
+
+				_MM_TRANSPOSE4_PS(y0r, y1r, y2r, y3r);
+				_MM_TRANSPOSE4_PS(y0i, y1i, y2i, y3i);
+
+				_mm_storeu_ps(yr + 4 * p +  0, y0r); _mm_storeu_ps(yi + 4 * p +  0, y0i);
+				_mm_storeu_ps(yr + 4 * p +  4, y1r); _mm_storeu_ps(yi + 4 * p +  4, y1i);
+				_mm_storeu_ps(yr + 4 * p +  8, y2r); _mm_storeu_ps(yi + 4 * p +  8, y2i);
+				_mm_storeu_ps(yr + 4 * p + 12, y3r); _mm_storeu_ps(yi + 4 * p + 12, y3i);
+			}
+		} else {
+			for (int p = 0; p < m; ++p) {
+				for (int q = 0; q < s; ++q) {
+					int i0 = q + s * p;
+					float ar = xr[i0],             ai = xi[i0];
+					float br = xr[i0 + s * m],     bi = xi[i0 + s * m];
+					float cr = xr[i0 + s * m * 2], ci = xi[i0 + s * m * 2];
+					float dr = xr[i0 + s * m * 3], di = xi[i0 + s * m * 3];
+
+					float apcr = ar + cr, apci = ai + ci;
+					float amcr = ar - cr, amci = ai - ci;
+					float bpdr = br + dr, bpdi = bi + di;
+					float jbmdr = bi - di, jbmdi = dr - br;
+
+					float y1r = amcr + jbmdr, y1i = amci + jbmdi;
+					float y2r = apcr - bpdr,  y2i = apci - bpdi;
+					float y3r = amcr - jbmdr, y3i = amci - jbmdi;
+
+					int o = q + s * 4 * p;
+					yr[o] = apcr + bpdr;
+					yi[o] = apci + bpdi;
+					yr[o + s] = y1r * w1r[p] - y1i * w1i[p];
+					yi[o + s] = y1r * w1i[p] + y1i * w1r[p];
+					yr[o + s * 2] = y2r * w2r[p] - y2i * w2i[p];
+					yi[o + s * 2] = y2r * w2i[p] + y2i * w2r[p];
+					yr[o + s * 3] = y3r * w3r[p] - y3i * w3i[p];
+					yi[o + s * 3] = y3r * w3i[p] + y3i * w3r[p];
+				}
+			}
+		}
+	}
+
+	void Radix2(const Stage& st, const float* xr, const float* xi, float* yr, float* yi) const {
+		const int m = st.m;
+		const int s = st.s;
+		const float* wr = &twiddle_re[st.twiddles];
+		const float* wi = &twiddle_im[st.twiddles];
+
+		if (s % 4 == 0) {
+			for (int p = 0; p < m; ++p) {
+				__m128 tr = _mm_set1_ps(wr[p]), ti = _mm_set1_ps(wi[p]);
+				for (int q = 0; q < s; q += 4) {
+					int i0 = q + s * p;
+					__m128 ar = _mm_loadu_ps(xr + i0),     ai = _mm_loadu_ps(xi + i0);
+					__m128 br = _mm_loadu_ps(xr + i0 + s * m), bi = _mm_loadu_ps(xi + i0 + s * m);
+
+					int o = q + s * 2 * p;
+					__m128 r, i;
+					_mm_storeu_ps(yr + o, _mm_add_ps(ar, br));
+					_mm_storeu_ps(yi + o, _mm_add_ps(ai, bi));
+					Mul(_mm_sub_ps(ar, br), _mm_sub_ps(ai, bi), tr, ti, r, i);
+					_mm_storeu_ps(yr + o + s, r);
+					_mm_storeu_ps(yi + o + s, i);
+				}
+			}
+		} else {
+			for (int p = 0; p < m; ++p) {
+				for (int q = 0; q < s; ++q) {
+					int i0 = q + s * p;
+					float ar = xr[i0],     ai = xi[i0];
+					float br = xr[i0 + s * m], bi = xi[i0 + s * m];
+					float dr = ar - br, di = ai - bi;
+
+					int o = q + s * 2 * p;
+					yr[o] = ar + br;
+					yi[o] = ai + bi;
+					yr[o + s] = dr * wr[p] - di * wi[p];
+					yi[o + s] = dr * wi[p] + di * wr[p];
+				}
+			}
+		}
+	}
+
+	// Generic odd radix (3, 5, 7) butterfly: a radix point DFT followed by the stage twiddles
+	void RadixN(const Stage& st, const float* xr, const float* xi, float* yr, float* yi) const {
+		const int r = st.radix;
+		const int m = st.m;
+		const int s = st.s;
+
+		float root_re[7], root_im[7];
+		for (int k = 0; k < r; ++k) {
+			double a = -2.0 * 3.14159265358979323846 * k / r;
+			root_re[k] = (float)cos(a);
+			root_im[k] = (float)sin(a);
+		}
+
+		if (s % 4 == 0) {
+			__m128 vr[7], vi[7];
+			for (int p = 0; p < m; ++p) {
+				for (int q = 0; q < s; q += 4) {
+					for (int j = 0; j < r; ++j) {
+						vr[j] = _mm_loadu_ps(xr + q + s * (p + j * m));
+						vi[j] = _mm_loadu_ps(xi + q + s * (p + j * m));
+					}
+
+					for (int k = 0; k < r; ++k) {
+						__m128 sr = vr[0], si = vi[0];
+						for (int j = 1; j < r; ++j) {
+							int jk = (j * k) % r;
+							__m128 wr = _mm_set1_ps(root_re[jk]), wi = _mm_set1_ps(root_im[jk]), tr, ti;
+							Mul(vr[j], vi[j], wr, wi, tr, ti);
+							sr = _mm_add_ps(sr, tr);
+							si = _mm_add_ps(si, ti);
+						}
+
+						int o = q + s * (r * p + k);
+						if (k > 0) {
+							__m128 tr, ti;
+							int t = st.twiddles + (k - 1) * m + p;
+							Mul(sr, si, _mm_set1_ps(twiddle_re[t]), _mm_set1_ps(twiddle_im[t]), tr, ti);
+							sr = tr;
+							si = ti;
+						}
+						_mm_storeu_ps(yr + o, sr);
+						_mm_storeu_ps(yi + o, si);
+					}
+				}
+			}
+		} else {
+			float vr[7], vi[7];
+			for (int p = 0; p < m; ++p) {
+				for (int q = 0; q < s; ++q) {
+					for (int j = 0; j < r; ++j) {
+						vr[j] = xr[q + s * (p + j * m)];
+						vi[j] = xi[q + s * (p + j * m)];
+					}
+
+					for (int k = 0; k < r; ++k) {
+						float sr = vr[0], si = vi[0];
+						for (int j = 1; j < r; ++j) {
+							int jk = (j * k) % r;
+							sr += vr[j] * root_re[jk] - vi[j] * root_im[jk];
+							si += vr[j] * root_im[jk] + vi[j] * root_re[jk];
+						}
+
+						int o = q + s * (r * p + k);
+						if (k > 0) {
+							int t = st.twiddles + (k - 1) * m + p;
+							float tr = sr * twiddle_re[t] - si * twiddle_im[t];
+							si = sr * twiddle_im[t] + si * twiddle_re[t];
+							sr = tr;
+						}
+						yr[o] = sr;
+						yi[o] = si;
+					}
+				}
+			}
+		}
+	}
+
+	void ForwardBluestein(float* re, float* im, float* work) const {
+		const int m = bluestein->length;
+		float* ar = work;
+		float* ai = work + m;
+
+		for (int k = 0; k < length; ++k) {
+			ar[k] = re[k] * chirp_re[k] - im[k] * chirp_im[k];
+			ai[k] = re[k] * chirp_im[k] + im[k] * chirp_re[k];
+		}
+		memset(ar + length, 0, (m - length) * sizeof(float));
+		memset(ai + length, 0, (m - length) * sizeof(float));
+
+		bluestein->Forward(ar, ai, work + m * 2);
+		for (int k = 0; k < m; ++k) {
+			float r = ar[k] * kernel_re[k] - ai[k] * kernel_im[k];
+			ai[k] = ar[k] * kernel_im[k] + ai[k] * kernel_re[k];
+			ar[k] = r;
+		}
+		bluestein->Inverse(ar, ai, work + m * 2);
+
+		for (int k = 0; k < length; ++k) {
+			re[k] = ar[k] * chirp_re[k] - ai[k] * chirp_im[k];
+			im[k] = ar[k] * chirp_im[k] + ai[k] * chirp_re[k];
+		}
+	}
+
+	// In place forward transform of one row, work holds at least WorkSize() floats
+	void Forward(float* re, float* im, float* work) const {
+		if (bluestein) {
+			ForwardBluestein(re, im, work);
+			return;
+		}
+
+		float* xr = re;
+		float* xi = im;
+		float* yr = work;
+		float* yi = work + length;
+
+		for (const Stage& stage : stages) {
+			if (stage.radix == 4)
+				Radix4(stage, xr, xi, yr, yi);
+			else if (stage.radix == 2)
+				Radix2(stage, xr, xi, yr, yi);
+			else
+				RadixN(stage, xr, xi, yr, yi);
+
+			swap(xr, yr);
+			swap(xi, yi);
+		}
+
+		if (xr != re) {
+			memcpy(re, xr, length * sizeof(float));
+			memcpy(im, xi, length * sizeof(float));
+		}
+	}
+
+	// Unnormalized inverse through the swapped real / imaginary identity
+	void Inverse(float* re, float* im, float* work) const {
+		Forward(im, re, work);
+	}
+};
+
+// Plans are built once per length and shared by every caller
+struct FFTPlans {
+	map<int, unique_ptr<FFTPlan>> plans;
+	mutex plans_mutex;
+
+	const FFTPlan& Get(int length) {
+		lock_guard<mutex> lock(plans_mutex);
+		unique_ptr<FFTPlan>& plan = plans[length];
+		if (!plan) {
+			plan.reset(new FFTPlan());
+			plan->Init(length);
+		}
+		return *plan;
+	}
+} FFTPlans;
+
+// Spectra of two real images (aperture and dust) stored as half planes: only the columns
+// u = [0, width / 2] are kept, the rest follow from the Hermitian symmetry F(-k) = conj(F(k))
+struct RealPairSpectrum {
+	int width = 0;
+	int height = 0;
+	int half_width = 0;
+	vector<float> a_re, a_im;
+	vector<float> b_re, b_im;
+
+	void Resize(int w, int h) {
+		width = w;
+		height = h;
+		half_width = w / 2 + 1;
+		a_re.resize(half_width * h);
+		a_im.resize(half_width * h);
+		b_re.resize(half_width * h);
+		b_im.resize(half_width * h);
+	}
+
+	// Symmetric accessor over the full (u, v) plane, u and v in [0, width) and [0, height)
+	void Get(int u, int v, float& ar, float& ai, float& br, float& bi) const {
+		float sign = 1.f;
+		if (u >= half_width) {
+			u = width - u;
+			v = (height - v) % height;
+			sign = -1.f;
+		}
+
+		int i = v * half_width + u;
+		ar = a_re[i];
+		ai = a_im[i] * sign;
+		br = b_re[i];
+		bi = b_im[i] * sign;
+	}
+
+	// Squared magnitudes, what the starburst is built from
+	void Power(int u, int v, float& a, float& b) const {
+		if (u >= half_width) {
+			u = width - u;
+			v = (height - v) % height;
+		}
+
+		int i = v * half_width + u;
+		a = a_re[i] * a_re[i] + a_im[i] * a_im[i];
+		b = b_re[i] * b_re[i] + b_im[i] * b_im[i];
+	}
+};
+
+struct FFT2D {
+	const int block_size = 32;
+
+	vector<float> transposed_re;
+	vector<float> transposed_im;
+	vector<float> packed_re;
+	vector<float> packed_im;
+
+	// dst (height x width) = transpose of src (width x height), in cache sized tiles
+	void Transpose(const float* src, float* dst, int width, int height) {
+		int blocks_y = (height + block_size - 1) / block_size;
+		Workers.ParallelFor(blocks_y, 1, [&](int begin, int end) {
+			for (int by = begin; by < end; ++by) {
+				int y0 = by * block_size;
+				int y1 = min(y0 + block_size, height);
+				for (int x0 = 0; x0 < width; x0 += block_size) {
+					int x1 = min(x0 + block_size, width);
+					int y = y0;
+					if ((width % 4) == 0 && (height % 4) == 0) {
+						for (; y + 4 <= y1; y += 4) {
+							for (int x = x0; x + 4 <= x1; x += 4) {
+								__m128 r0 = _mm_loadu_ps(src + (y + 0) * width + x);
+								__m128 r1 = _mm_loadu_ps(src + (y + 1) * width + x);
+								__m128 r2 = _mm_loadu_ps(src + (y + 2) * width + x);
+								__m128 r3 = _mm_loadu_ps(src + (y + 3) * width + x);
+								_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+								_mm_storeu_ps(dst + (x + 0) * height + y, r0);
+								_mm_storeu_ps(dst + (x + 1) * height + y, r1);
+								_mm_storeu_ps(dst + (x + 2) * height + y, r2);
+								_mm_storeu_ps(dst + (x + 3) * height + y, r3);
+							}
+						}
+					}
+					for (; y < y1; ++y)
+						for (int x = x0; x < x1; ++x)
+							dst[x * height + y] = src[y * width + x];
+				}
+			}
+		});
+	}
+
+	void Rows(float* re, float* im, int width, int height, bool inverse) {
+		const FFTPlan& plan = FFTPlans.Get(width);
+		int grain = max(1, 16384 / max(width, 1));
+		Workers.ParallelFor(height, grain, [&](int begin, int end) {
+			float* work = FFTScratch(plan.WorkSize());
+			for (int y = begin; y < end; ++y) {
+				if (inverse)
+					plan.Inverse(re + y * width, im + y * width, work);
+				else
+					plan.Forward(re + y * width, im + y * width, work);
+			}
+		});
+	}
+
+	// Row pass then column pass, same as FFT::RunDispatchSLM(0) followed by RunDispatchSLM(1)
+	void Forward(float* re, float* im, int width, int height, bool inverse = false) {
+		transposed_re.resize(width * height);
+		transposed_im.resize(width * height);
+
+		PROFILE_SCOPE("fft 2d");
+		{
+			PROFILE_SCOPE("fft rows");
+			Rows(re, im, width, height, inverse);
+		}
+		{
+			PROFILE_SCOPE("fft transpose");
+			Transpose(re, transposed_re.data(), width, height);
+			Transpose(im, transposed_im.data(), width, height);
+		}
+		{
+			PROFILE_SCOPE("fft columns");
+			Rows(transposed_re.data(), transposed_im.data(), height, width, inverse);
+		}
+		{
+			PROFILE_SCOPE("fft transpose");
+			Transpose(transposed_re.data(), re, height, width);
+			Transpose(transposed_im.data(), im, height, width);
+		}
+	}
+
+	void Inverse(float* re, float* im, int width, int height) {
+		Forward(re, im, width, height, true);
+	}
+	// Transforms the real planes a and b with a single complex FFT of z = a + i * b and splits the
+	// result: A(k) = (Z(k) + conj(Z(-k))) / 2, B(k) = (Z(k) - conj(Z(-k))) / 2i
+	void ForwardRealPair(const float* a, const float* b, int width, int height, RealPairSpectrum& out) {
+		packed_re.assign(a, a + width * height);
+		packed_im.assign(b, b + width * height);
+		Forward(packed_re.data(), packed_im.data(), width, height);
+
+		out.Resize(width, height);
+		const float* zr = packed_re.data();
+		const float* zi = packed_im.data();
+		Workers.ParallelFor(height, 16, [&](int begin, int end) {
+			for (int v = begin; v < end; ++v) {
+				int mv = (height - v) % height;
+				for (int u = 0; u < out.half_width; ++u) {
+					int mu = (width - u) % width;
+					float z_re = zr[v * width + u], z_im = zi[v * width + u];
+					float m_re = zr[mv * width + mu], m_im = -zi[mv * width + mu];
+
+					int o = v * out.half_width + u;
+					out.a_re[o] = (z_re + m_re) * 0.5f;
+					out.a_im[o] = (z_im + m_im) * 0.5f;
+					out.b_re[o] = (z_im - m_im) * 0.5f;
+					out.b_im[o] = (m_re - z_re) * 0.5f;
+				}
+			}
+		});
+	}
+};
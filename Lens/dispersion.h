@@ -0,0 +1,100 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// Glass dispersion. Lens prescriptions give each glass its index at the d line (587.56nm)
+// and its Abbe number vd = (nd - 1) / (nF - nC). A glass found in the small Sellmeier
+// catalogue below uses its measured curve, offset to the prescription's nd; any other glass
+// uses the two term Cauchy fit n = A + B / w^2 through nd with the given F - C spread.
+// vd = 0 means no dispersion.
+//--------------------------------------------------------------------------------------
+
+#include <math.h>
+#include <vector>
+
+#include "spectral_color.h"
+
+using namespace std;
+
+struct SellmeierGlass {
+	const char* name;
+	float nd;
+	float vd;
+	double b[3];
+	double c[3];  // um^2
+};
+
+static const SellmeierGlass sellmeier_catalogue[] = {
+	{ "N-BK7",        1.51680f, 64.17f, { 1.03961212, 0.231792344, 1.01046945 }, { 0.00600069867, 0.0200179144, 103.560653 } },
+	{ "N-SK16",       1.62041f, 60.32f, { 1.34317774, 0.241144399, 0.994317969 }, { 0.00704687339, 0.0229005000, 92.7508526 } },
+	{ "N-SF6",        1.80518f, 25.36f, { 1.77931763, 0.338149866, 2.08734474 }, { 0.0133714182, 0.0617533621, 174.017590 } },
+	{ "Fused silica", 1.45846f, 67.82f, { 0.6961663, 0.4079426, 0.8974794 }, { 0.00467914826, 0.0135120631, 97.9340025 } },
+};
+
+struct Dispersion {
+	static constexpr float wavelength_d = 587.56f;
+	static constexpr float wavelength_f = 486.13f;
+	static constexpr float wavelength_c = 656.27f;
+
+	static double Sellmeier(const SellmeierGlass& glass, float wavelength) {
+		double w2 = (wavelength * 1e-3) * (wavelength * 1e-3);
+		double n2 = 1.0;
+		for (int i = 0; i < 3; ++i)
+			n2 += glass.b[i] * w2 / (w2 - glass.c[i]);
+		return sqrt(n2);
+	}
+
+	static const SellmeierGlass* FindGlass(float nd, float vd) {
+		for (const SellmeierGlass& glass : sellmeier_catalogue)
+			if (fabsf(glass.nd - nd) < 5e-4f && fabsf(glass.vd - vd) < 0.5f)
+				return &glass;
+		return nullptr;
+	}
+
+	// Index of a glass given by (nd, vd) at a wavelength in nm
+	static float RefractiveIndex(float nd, float vd, float wavelength) {
+		if (vd <= 0.f || nd == 1.f)
+			return nd;
+
+		if (const SellmeierGlass* glass = FindGlass(nd, vd))
+			return (float)(Sellmeier(*glass, wavelength) - Sellmeier(*glass, wavelength_d) + nd);
+
+		float b = (nd - 1.f) / vd / (1.f / (wavelength_f * wavelength_f) - 1.f / (wavelength_c * wavelength_c));
+		return nd + b * (1.f / (wavelength * wavelength) - 1.f / (wavelength_d * wavelength_d));
+	}
+};
+
+// The wavelengths the ghosts are traced at and the rgb each one adds. Without dispersion
+// these are the three wavelengths the ghosts always used, each giving one channel. With it
+// the visible range is split into equal bins, each with the CIE colour of its band,
+// normalized so an equal energy spectrum sums to white
+struct SpectralSamples {
+	vector<float> wavelengths;
+	vector<float> rgb;
+
+	void Init(int count, bool dispersion) {
+		if (!dispersion) {
+			wavelengths = { 650.f, 510.f, 475.f };
+			rgb = { 1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 1.f };
+			return;
+		}
+
+		wavelengths.resize(count);
+		rgb.resize(count * 3);
+
+		float sum[3] = { 0.f, 0.f, 0.f };
+		for (int i = 0; i < count; ++i) {
+			float first = 400.f + 300.f * i / count;
+			float last = 400.f + 300.f * (i + 1) / count;
+			wavelengths[i] = (first + last) * 0.5f;
+			SpectralColor.Band(first, last, &rgb[i * 3]);
+			for (int c = 0; c < 3; ++c) {
+				rgb[i * 3 + c] = max(rgb[i * 3 + c], 0.f);
+				sum[c] += rgb[i * 3 + c];
+			}
+		}
+
+		for (int i = 0; i < count; ++i)
+			for (int c = 0; c < 3; ++c)
+				rgb[i * 3 + c] /= max(sum[c], 1e-6f);
+	}
+};
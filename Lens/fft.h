@@ -17,12 +17,13 @@ struct FFT {
 	ID3D11Texture2D *mTextures[FFTTexture_Count];
 	ID3D11UnorderedAccessView *mTextureUAV[FFTTexture_Count];
 	ID3D11ShaderResourceView *mTextureSRV[FFTTexture_Count];
-	ID3D11RenderTargetView *mRenderTargetViews[FFTTexture_Count];
 
+	// The aperture and dust images are packed into a single complex plane (see PackRealPair),
+	// so every texture only holds one float channel
 	void InitFFTTetxtures(ID3D11Device *device, int aperture_resolution) {
 		D3D11_TEXTURE2D_DESC textureDesc;
 		memset(&textureDesc, 0, sizeof(textureDesc));
-		textureDesc.Format = DXGI_FORMAT_R32G32B32A32_FLOAT;
+		textureDesc.Format = DXGI_FORMAT_R32_FLOAT;
 		textureDesc.Width = (UINT)aperture_resolution;
 		textureDesc.Height = (UINT)aperture_resolution;
 		textureDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS;
@@ -35,18 +36,10 @@ struct FFT {
 
 		for (int i = 0; i < FFTTexture_Count; i++) {
 			textureDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE;
-			if (i == FFTTexture_Real0 || i == FFTTexture_Imaginary0) {
-				textureDesc.BindFlags = textureDesc.BindFlags | D3D11_BIND_RENDER_TARGET;
-			}
-
 			device->CreateTexture2D(&textureDesc, NULL, &mTextures[i]);
 			device->CreateUnorderedAccessView(mTextures[i], NULL, &mTextureUAV[i]);
 			device->CreateShaderResourceView(mTextures[i], NULL, &mTextureSRV[i]);
-
 		}
-
-		device->CreateRenderTargetView(mTextures[FFTTexture_Real0], NULL, &mRenderTargetViews[FFTTexture_Real0]);
-		device->CreateRenderTargetView(mTextures[FFTTexture_Imaginary0], NULL, &mRenderTargetViews[FFTTexture_Imaginary0]);
 	}
 
 	#define roundup(x,y) ( (int)y * (int)((x + y - 1)/y))
@@ -71,6 +64,31 @@ struct FFT {
 		context->CSSetUnorderedAccessViews(0, 2, pClearUAVs, NULL);
 	}
 
+	// Writes aperture.r into FFTTexture_Real0 and aperture.g (dust) into FFTTexture_Imaginary0
+	void PackRealPair(ID3D11DeviceContext *context, ID3D11ShaderResourceView *srcSRV, int size, ID3D11ComputeShader* packShader) {
+		ID3D11UnorderedAccessView* pUAVs[] = { NULL, NULL };
+		ID3D11ShaderResourceView* pSRVs[] = { NULL, NULL, NULL };
+
+		context->PSSetShaderResources(0, 3, pSRVs);
+		context->CSSetShaderResources(0, 3, pSRVs);
+		context->CSSetUnorderedAccessViews(0, 2, pUAVs, NULL);
+		context->CSSetShader(packShader, NULL, 0);
+
+		pSRVs[2] = srcSRV;
+		pUAVs[0] = mTextureUAV[FFTTexture_Real0];
+		pUAVs[1] = mTextureUAV[FFTTexture_Imaginary0];
+		context->CSSetShaderResources(0, 3, pSRVs);
+		context->CSSetUnorderedAccessViews(0, 2, pUAVs, NULL);
+
+		int dispatch = (size + 15) / 16;
+		context->Dispatch(dispatch, dispatch, 1);
+
+		pSRVs[2] = NULL;
+		pUAVs[0] = NULL; pUAVs[1] = NULL;
+		context->CSSetShaderResources(0, 3, pSRVs);
+		context->CSSetUnorderedAccessViews(0, 2, pUAVs, NULL);
+	}
+
 	void RunDispatchSLM(ID3D11DeviceContext *context, int pass, ID3D11ComputeShader* shader, int aperture_resolution) {
 		ID3D11UnorderedAccessView* pUAVs[] = { NULL, NULL };
 		ID3D11ShaderResourceView* pSRVs[] = { NULL, NULL, NULL };
@@ -19,11 +19,18 @@
 // BUTTERFLY_COUNT: number of passes to perform
 // ROWPASS: defined for tranformation along the x axis
 // LENGTH: pixel length of row or column
+// FFT_TYPE: element type of the transformed planes (float3 when not defined)
+// PACKED_INPUT: the row pass reads a complex input (two real images packed as real + i * imaginary)
 
-Texture2D<float3> TextureSourceR  : register(t0);
-Texture2D<float3> TextureSourceI  : register(t1);
-RWTexture2D<float3> TextureTargetR  : register(u0);
-RWTexture2D<float3> TextureTargetI  : register(u1);
+#ifndef FFT_TYPE
+	#define FFT_TYPE float3
+#endif
+
+Texture2D<FFT_TYPE> TextureSourceR  : register(t0);
+Texture2D<FFT_TYPE> TextureSourceI  : register(t1);
+Texture2D<float4> PackSource : register(t2);
+RWTexture2D<FFT_TYPE> TextureTargetR  : register(u0);
+RWTexture2D<FFT_TYPE> TextureTargetI  : register(u1);
 
 static const float PI = 3.14159265f;
 
@@ -46,17 +53,17 @@ void GetButterflyValues(uint passIndex, uint x, out uint2 indices, out float2 we
 	}
 }
 
-groupshared float3 pingPongArray[4][LENGTH];
-void ButterflyPass(int passIndex, uint x, uint t0, uint t1, out float3 resultR, out float3 resultI) {
+groupshared FFT_TYPE pingPongArray[4][LENGTH];
+void ButterflyPass(int passIndex, uint x, uint t0, uint t1, out FFT_TYPE resultR, out FFT_TYPE resultI) {
 	uint2 Indices;
 	float2 Weights;
 	GetButterflyValues(passIndex, x, Indices, Weights);
 	
-	float3 inputR1 = pingPongArray[t0][Indices.x];
-	float3 inputI1 = pingPongArray[t1][Indices.x];
+	FFT_TYPE inputR1 = pingPongArray[t0][Indices.x];
+	FFT_TYPE inputI1 = pingPongArray[t1][Indices.x];
 
-	float3 inputR2 = pingPongArray[t0][Indices.y];
-	float3 inputI2 = pingPongArray[t1][Indices.y];
+	FFT_TYPE inputR2 = pingPongArray[t0][Indices.y];
+	FFT_TYPE inputI2 = pingPongArray[t1][Indices.y];
 
 	resultR = inputR1 + Weights.x * inputR2 - Weights.y * inputI2;
 	resultI = inputI1 + Weights.y * inputR2 + Weights.x * inputI2;
@@ -71,18 +78,18 @@ void ButterflySLM(uint3 position : SV_DispatchThreadID) {
 	#endif
 
 		// Load entire row or column into scratch array
-		pingPongArray[0][position.x].xyz = TextureSourceR[texturePos];
-	#if defined(ROWPASS)
+		pingPongArray[0][position.x] = TextureSourceR[texturePos];
+	#if defined(ROWPASS) && !defined(PACKED_INPUT)
 		// don't load values from the imaginary texture when loading the original texture
-		pingPongArray[1][position.x].xyz = 0;
+		pingPongArray[1][position.x] = 0;
 	#else
-		pingPongArray[1][position.x].xyz = TextureSourceI[texturePos];
+		pingPongArray[1][position.x] = TextureSourceI[texturePos];
 	#endif
 	
 	uint4 textureIndices = uint4(0, 1, 2, 3);
 	for (int i = 0; i < BUTTERFLY_COUNT-1; i++) {
 		GroupMemoryBarrierWithGroupSync();
-		ButterflyPass( i, position.x, textureIndices.x, textureIndices.y, pingPongArray[textureIndices.z][position.x].xyz, pingPongArray[textureIndices.w][position.x].xyz );
+		ButterflyPass( i, position.x, textureIndices.x, textureIndices.y, pingPongArray[textureIndices.z][position.x], pingPongArray[textureIndices.w][position.x] );
 		textureIndices.xyzw = textureIndices.zwxy;
 	}
 
@@ -93,3 +100,13 @@ void ButterflySLM(uint3 position : SV_DispatchThreadID) {
 	ButterflyPass(BUTTERFLY_COUNT - 1, position.x, textureIndices.x, textureIndices.y, TextureTargetR[texturePos], TextureTargetI[texturePos]);
 
 }
+
+// The aperture (r) and dust (g) images are both real, so they share one complex transform:
+// z = aperture + i * dust. Their spectra are separated again with the Hermitian symmetry
+// when the transform is read (see SampleRealPairSpectrum in starburst.hlsl)
+[numthreads(16, 16, 1)]
+void PackRealPairCS(uint3 position : SV_DispatchThreadID) {
+	float4 source = PackSource[position.xy];
+	TextureTargetR[position.xy] = source.r;
+	TextureTargetI[position.xy] = source.g;
+}
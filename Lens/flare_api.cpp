@@ -0,0 +1,222 @@
+#include <new>
+#include <string>
+
+#include "flare_api.h"
+#include "flare_context.h"
+
+using namespace std;
+
+static_assert(sizeof(FlareLightDesc) == sizeof(SceneLight), "FlareLightDesc must match SceneLight");
+
+struct FlareApiContext {
+	FlareContext context;
+	LensPack pack;
+	string pack_path;
+	string error;
+
+	int Fail(int status, const string& message) {
+		error = message;
+		return status;
+	}
+};
+
+static void ToSettings(const FlareParameters& p, FlareSettings& s) {
+	s.patch_tesselation = p.patch_tesselation;
+	s.rays_spread = p.rays_spread;
+	s.coating_quality = p.coating_quality;
+	s.aperture_opening = p.aperture_opening;
+	s.number_of_blades = p.number_of_blades;
+	s.analytic_aperture = p.analytic_aperture != 0;
+	s.dispersion = p.dispersion != 0;
+	s.num_spectral_samples = p.num_spectral_samples;
+	s.zoom = p.zoom;
+	s.focus = p.focus;
+	s.max_flare_lights = p.max_flare_lights;
+	s.max_flare_traces = p.max_flare_traces;
+}
+
+static bool SetLights(FlareApiContext* api, const FlareLightSet& set) {
+	if (set.num_lights < 0 || (set.num_lights > 0 && !set.lights))
+		return false;
+	api->context.SetLights((const SceneLight*)set.lights, set.num_lights);
+	return true;
+}
+
+extern "C" {
+
+FLARE_API FlareHandle FlareCreate(void) {
+	return new (nothrow) FlareApiContext();
+}
+
+FLARE_API void FlareDestroy(FlareHandle handle) {
+	delete handle;
+}
+
+FLARE_API const char* FlareGetError(FlareHandle handle) {
+	return handle ? handle->error.c_str() : "no handle";
+}
+
+FLARE_API void FlareDefaultParameters(FlareParameters* parameters) {
+	if (!parameters)
+		return;
+
+	FlareSettings s;
+	FlareParameters p = {
+		sizeof(FlareParameters), s.patch_tesselation, s.rays_spread, s.coating_quality, s.aperture_opening, s.number_of_blades,
+		s.analytic_aperture, s.dispersion, s.num_spectral_samples, s.zoom, s.focus, s.max_flare_lights, s.max_flare_traces
+	};
+	*parameters = p;
+}
+
+FLARE_API int FlareSetParameters(FlareHandle handle, const FlareParameters* parameters) {
+	if (!handle || !parameters)
+		return FLARE_INVALID_ARGUMENT;
+
+	// Older callers pass a shorter struct, the fields they do not know keep their defaults
+	FlareParameters p;
+	FlareDefaultParameters(&p);
+	memcpy(&p, parameters, min((size_t)parameters->size, sizeof(FlareParameters)));
+
+	if (p.patch_tesselation < 2 || p.num_spectral_samples < 1 || p.number_of_blades < 1.f || p.max_flare_traces < 1)
+		return handle->Fail(FLARE_INVALID_ARGUMENT, "parameters out of range");
+
+	ToSettings(p, handle->context.settings);
+	return FLARE_OK;
+}
+
+FLARE_API int FlareLoadLensText(FlareHandle handle, const char* text) {
+	if (!handle || !text)
+		return FLARE_INVALID_ARGUMENT;
+
+	try {
+		LensPrescription prescription;
+		string error;
+		if (!prescription.Parse(text, &error))
+			return handle->Fail(FLARE_LENS_ERROR, error);
+		if (!handle->context.SetLens(prescription))
+			return handle->Fail(FLARE_LENS_ERROR, "prescription has no aperture stop");
+	} catch (const bad_alloc&) {
+		return handle->Fail(FLARE_OUT_OF_MEMORY, "out of memory");
+	}
+	return FLARE_OK;
+}
+
+FLARE_API int FlareLoadLens(FlareHandle handle, const char* path) {
+	if (!handle || !path)
+		return FLARE_INVALID_ARGUMENT;
+
+	try {
+		LensPrescription prescription;
+		string error;
+		if (!prescription.Load(path, &error))
+			return handle->Fail(FLARE_LENS_ERROR, error);
+		if (!handle->context.SetLens(prescription))
+			return handle->Fail(FLARE_LENS_ERROR, "prescription has no aperture stop");
+	} catch (const bad_alloc&) {
+		return handle->Fail(FLARE_OUT_OF_MEMORY, "out of memory");
+	}
+	return FLARE_OK;
+}
+
+FLARE_API int FlareLoadLensPack(FlareHandle handle, const char* pack_path, const char* lens_name) {
+	if (!handle || !pack_path || !lens_name)
+		return FLARE_INVALID_ARGUMENT;
+
+	try {
+		// The pack stays mapped for further lenses from it
+		if (handle->pack_path != pack_path) {
+			handle->pack_path.clear();
+			if (!handle->pack.Open(pack_path))
+				return handle->Fail(FLARE_LENS_ERROR, string("cannot open lens pack ") + pack_path);
+			handle->pack_path = pack_path;
+		}
+
+		LensView view;
+		string error;
+		if (!handle->pack.Find(lens_name, view, &error))
+			return handle->Fail(FLARE_LENS_ERROR, pack_path + string(": ") + error);
+		if (!handle->context.SetLens(view))
+			return handle->Fail(FLARE_LENS_ERROR, pack_path + string(": ") + lens_name + " has no aperture stop");
+	} catch (const bad_alloc&) {
+		return handle->Fail(FLARE_OUT_OF_MEMORY, "out of memory");
+	}
+	return FLARE_OK;
+}
+
+FLARE_API int FlareRender(FlareHandle handle, const FlareLightSet* sets, const FlareImageDesc* images, int32_t count) {
+	if (!handle || count < 0 || (count > 0 && (!sets || !images)))
+		return FLARE_INVALID_ARGUMENT;
+	if (handle->context.interfaces.empty())
+		return handle->Fail(FLARE_NO_LENS, "no lens loaded");
+
+	for (int32_t i = 0; i < count; ++i) {
+		const FlareImageDesc& image = images[i];
+		if (!image.pixels || image.width <= 0 || image.height <= 0)
+			return handle->Fail(FLARE_INVALID_ARGUMENT, "image without pixels");
+
+		ptrdiff_t pixel_stride = image.pixel_stride < 0 ? -image.pixel_stride : image.pixel_stride;
+		ptrdiff_t row_stride = image.row_stride < 0 ? -image.row_stride : image.row_stride;
+		if (pixel_stride < (ptrdiff_t)(3 * sizeof(float)) || row_stride < image.width * pixel_stride)
+			return handle->Fail(FLARE_INVALID_ARGUMENT, "image strides overlap pixels");
+	}
+
+	try {
+		for (int32_t i = 0; i < count; ++i) {
+			const FlareImageDesc& image = images[i];
+			if (!SetLights(handle, sets[i]))
+				return handle->Fail(FLARE_INVALID_ARGUMENT, "light set without lights");
+
+			FlareTarget target;
+			target.pixels = image.pixels;
+			target.width = image.width;
+			target.height = image.height;
+			target.pixel_stride = image.pixel_stride;
+			target.row_stride = image.row_stride;
+			handle->context.Render(target, image.accumulate != 0);
+		}
+	} catch (const bad_alloc&) {
+		return handle->Fail(FLARE_OUT_OF_MEMORY, "out of memory");
+	}
+	return FLARE_OK;
+}
+
+FLARE_API int FlareExportGhosts(FlareHandle handle, const FlareLightSet* set, FlareMeshDesc* mesh) {
+	if (!handle || !set || !mesh || mesh->aspect <= 0.f || (mesh->capacity > 0 && (!mesh->vertices || mesh->vertex_stride < (ptrdiff_t)sizeof(FlareMeshVertex))))
+		return FLARE_INVALID_ARGUMENT;
+	if (handle->context.interfaces.empty())
+		return handle->Fail(FLARE_NO_LENS, "no lens loaded");
+
+	try {
+		if (!SetLights(handle, *set))
+			return handle->Fail(FLARE_INVALID_ARGUMENT, "light set without lights");
+
+		FlareContext& context = handle->context;
+		context.Update();
+
+		uint32_t count = 0;
+		char* out = (char*)mesh->vertices;
+		context.VisitTriangles(mesh->aspect, -1e30f, 1e30f, [&](const float* tint, const FlareCorner& a, const FlareCorner& b, const FlareCorner& c) {
+			if (count + 3 <= mesh->capacity) {
+				for (const FlareCorner* corner : { &a, &b, &c }) {
+					FlareMeshVertex v = {
+						corner->x, corner->y, tint[0], tint[1], tint[2], corner->intensity, corner->area,
+						corner->lens_x, corner->lens_y, corner->u, corner->v, corner->max_radius
+					};
+					memcpy(out + (count++) * mesh->vertex_stride, &v, sizeof(v));
+				}
+			} else {
+				count += 3;
+			}
+		});
+
+		bool fits = count <= mesh->capacity;
+		mesh->num_vertices = count;
+		if (!fits)
+			return handle->Fail(FLARE_BUFFER_TOO_SMALL, "mesh buffer too small");
+	} catch (const bad_alloc&) {
+		return handle->Fail(FLARE_OUT_OF_MEMORY, "out of memory");
+	}
+	return FLARE_OK;
+}
+
+}
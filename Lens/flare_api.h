@@ -0,0 +1,135 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// C interface to the CPU flare renderer (flare_context.h), for embedding it in another
+// process. Every handle is an independent FlareContext, so handles can be used from
+// different threads at once, though a single handle must not be used by two threads at the
+// same time.
+//
+// Results go straight into caller memory. Images are rgb floats at any pixel and row stride,
+// and ghost meshes are triangle lists at any vertex stride. Lights are read in place. A
+// handle that has rendered once reuses its buffers, so later calls of the same size
+// allocate nothing.
+//
+// Functions return FLARE_OK or an error code. FlareGetError describes the last error of a
+// handle.
+//--------------------------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+	#if defined(FLARE_API_EXPORTS)
+		#define FLARE_API __declspec(dllexport)
+	#else
+		#define FLARE_API __declspec(dllimport)
+	#endif
+#else
+	#define FLARE_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct FlareApiContext* FlareHandle;
+
+enum FlareStatus {
+	FLARE_OK = 0,
+	FLARE_INVALID_ARGUMENT = 1,
+	FLARE_LENS_ERROR = 2,       // the prescription or pack could not be read
+	FLARE_NO_LENS = 3,
+	FLARE_BUFFER_TOO_SMALL = 4, // the mesh needs more vertices than the buffer holds
+	FLARE_OUT_OF_MEMORY = 5
+};
+
+// Settings of FlareContext. size is sizeof(FlareParameters), so later versions can add
+// fields at the end. FlareDefaultParameters fills in the interactive defaults
+typedef struct FlareParameters {
+	uint32_t size;
+	int32_t patch_tesselation;    // rays per side of a ghost patch
+	float rays_spread;
+	float coating_quality;
+	float aperture_opening;       // height of the aperture stop and rotation of the blades
+	float number_of_blades;
+	int32_t analytic_aperture;    // kill rays at the blades in the trace
+	int32_t dispersion;           // trace num_spectral_samples wavelengths instead of three
+	int32_t num_spectral_samples;
+	float zoom;                   // wide 0 to tele 1
+	float focus;                  // infinity 0 to closest 1
+	int32_t max_flare_lights;
+	int32_t max_flare_traces;     // directions traced per light set, see FlarePlanner
+} FlareParameters;
+
+// Same layout as SceneLight. direction is the one the light travels in, (0, 0, -1) on the
+// optical axis, a temperature of 0 leaves rgb untinted
+typedef struct FlareLightDesc {
+	float direction[3];
+	float rgb[3];
+	float temperature;
+} FlareLightDesc;
+
+typedef struct FlareLightSet {
+	const FlareLightDesc* lights;
+	int32_t num_lights;
+} FlareLightSet;
+
+// rgb floats, strides in bytes and either sign, but pixels and rows must not overlap: at
+// least 3 floats between pixels and width pixels between rows. Cleared before rendering
+// unless accumulate is set
+typedef struct FlareImageDesc {
+	float* pixels;
+	int32_t width;
+	int32_t height;
+	ptrdiff_t pixel_stride;
+	ptrdiff_t row_stride;
+	int32_t accumulate;
+} FlareImageDesc;
+
+// A ghost triangle corner, the attributes lens.hlsl's VS hands its PS. A pixel's colour is
+// rgb * area * intensity times the PS alpha terms of lens_x, lens_y, u, v and max_radius,
+// all interpolated linearly
+typedef struct FlareMeshVertex {
+	float x, y;            // ndc of a target with the mesh's aspect
+	float r, g, b;         // tint of the light at the patch's wavelength
+	float intensity;       // reflectance of the ghost's path, 0 for a lost ray
+	float area;            // area ratio of the patch around the vertex
+	float lens_x, lens_y;  // position on the entrance, -1 to 1
+	float u, v;            // position on the aperture stop relative to its height
+	float max_radius;      // largest relative height on the way, 1 or more is clipped
+} FlareMeshVertex;
+
+// Every triangle is three vertices, each a FlareMeshVertex at the start of vertex_stride
+// bytes so it can lead a larger caller vertex. num_vertices is set to the count written,
+// or needed when it is more than capacity
+typedef struct FlareMeshDesc {
+	void* vertices;
+	ptrdiff_t vertex_stride;
+	uint32_t capacity;
+	uint32_t num_vertices;
+	float aspect;          // width / height of the target the mesh is drawn to
+} FlareMeshDesc;
+
+FLARE_API FlareHandle FlareCreate(void);
+FLARE_API void FlareDestroy(FlareHandle handle);
+FLARE_API const char* FlareGetError(FlareHandle handle);
+
+FLARE_API void FlareDefaultParameters(FlareParameters* parameters);
+FLARE_API int FlareSetParameters(FlareHandle handle, const FlareParameters* parameters);
+
+// A prescription in the text format of lens_pack.h, from a file or from memory, or a lens
+// of a compiled lens pack
+FLARE_API int FlareLoadLens(FlareHandle handle, const char* path);
+FLARE_API int FlareLoadLensText(FlareHandle handle, const char* text);
+FLARE_API int FlareLoadLensPack(FlareHandle handle, const char* pack_path, const char* lens_name);
+
+// Renders each light set into its image. Sets whose planned trace directions match the
+// previous set's reuse its traced ghosts
+FLARE_API int FlareRender(FlareHandle handle, const FlareLightSet* sets, const FlareImageDesc* images, int32_t count);
+
+// The ghost triangles of a light set instead of the image
+FLARE_API int FlareExportGhosts(FlareHandle handle, const FlareLightSet* set, FlareMeshDesc* mesh);
+
+#ifdef __cplusplus
+}
+#endif
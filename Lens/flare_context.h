@@ -0,0 +1,630 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// Self contained CPU flare renderer. Everything a render reads or writes lives in one
+// FlareContext: the lens and its ghosts, the settings, the spectral tracer, the traced ghost
+// patches and the raster scratch. Contexts with different lenses and settings can render at
+// the same time from any number of threads. What they share is either read only once built
+// (SpectralColor) or locked (Workers, FFTPlans, StarburstCache).
+//
+// Render follows the GPU path of lens.hlsl. The CS part traces a patch_tesselation² grid of
+// rays per (ghost, trace) and gives every vertex its area ratio. The VS part rotates each
+// patch by its light and scales it to the plate. The PS part applies the same alpha terms,
+// and patches are added to a caller owned FlareTarget, or handed to another rasterizer by
+// VisitTriangles. Traced patches are kept, so frames that only change the lights' colours
+// or azimuths, or that reuse the same traces, skip the trace. Planner, patch and trace
+// buffers are kept too, so a context that has rendered once allocates nothing for later
+// frames of the same size.
+//
+// CollectRayStats traces the current lights once more recording where and why every ray
+// ends (ray_stats.h). Renders are not affected.
+//--------------------------------------------------------------------------------------
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "dispersion.h"
+#include "hdr_image.h"
+#include "lens_pack.h"
+#include "lens_zoom.h"
+#include "light_sources.h"
+#include "profiler.h"
+#include "ray_stats.h"
+#include "spectral_trace.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+// The interactive defaults of UI and App in lens.cpp
+struct FlareSettings {
+	int width = 1800;
+	int height = 900;
+	int patch_tesselation = 32;
+	float rays_spread = 0.75f;
+	float coating_quality = 1.25f;
+	float aperture_opening = 7.f;     // height of the aperture stop and rotation of the blades
+	float number_of_blades = 5.f;
+	bool analytic_aperture = true;
+	bool dispersion = false;
+	int num_spectral_samples = 8;
+	float zoom = 0.f;                 // wide 0 to tele 1
+	float focus = 0.f;                // infinity 0 to closest 1
+	int max_flare_lights = 1024;
+	int max_flare_traces = 8;
+
+	// The settings the traced patches depend on
+	bool SameTrace(const FlareSettings& s) const {
+		return patch_tesselation == s.patch_tesselation && rays_spread == s.rays_spread && coating_quality == s.coating_quality &&
+			aperture_opening == s.aperture_opening && number_of_blades == s.number_of_blades && analytic_aperture == s.analytic_aperture &&
+			dispersion == s.dispersion && num_spectral_samples == s.num_spectral_samples && zoom == s.zoom && focus == s.focus;
+	}
+};
+
+// Caller owned rgb float image, strides in bytes so it can be a view into a larger pixel
+// format or a sub rectangle
+struct FlareTarget {
+	float* pixels = nullptr;
+	int width = 0;
+	int height = 0;
+	ptrdiff_t pixel_stride = 0;
+	ptrdiff_t row_stride = 0;
+
+	FlareTarget() {}
+
+	explicit FlareTarget(HDRImage& image) :
+		pixels(image.rgb.data()), width(image.width), height(image.height),
+		pixel_stride(3 * sizeof(float)), row_stride(image.width * 3 * sizeof(float)) {}
+
+	float* Pixel(int x, int y) const {
+		return (float*)((char*)pixels + y * row_stride + x * pixel_stride);
+	}
+};
+
+// A patch corner as VS outputs it: x, y in ndc of the target, rotated by its light
+struct FlareCorner {
+	float x, y;
+	float lens_x, lens_y;  // coordinates.xy
+	float u, v;            // coordinates.zw
+	float max_radius;
+	float intensity;
+	float area;
+};
+
+// One traced ray of a ghost patch, what the CS writes to uav_buffer
+struct FlareVertex {
+	float x, y;          // position on the sensor
+	float ndc_x, ndc_y;  // position on the entrance, coordinates.xy
+	float u, v;          // aperture coordinates, coordinates.zw
+	float max_radius;    // color.z
+	float intensity;     // reflectance.a
+	float area;          // color.w
+};
+
+struct FlareContext {
+	FlareSettings settings;
+
+	// Lens as given and as moved to settings.zoom and settings.focus
+	vector<PatentFormat> components;
+	vector<LensGap> gaps;
+	vector<LensInterface> interfaces;
+	vector<float> ghosts;  // bounce1, bounce2, 0, 0 per ghost
+	int aperture_id = AP_IDX;
+
+	SpectralSamples spectral;
+	vector<float> ior_table;
+	SpectralTracer tracer;
+
+	FlarePlanner planner;
+	vector<FlareTrace> traces;
+	vector<FlareLight> lights;
+
+	// Patches of the last trace, [(trace * num_wavelengths + wavelength) * num_ghosts + ghost]
+	// each patch_tesselation² vertices, with the bounds of every patch on the sensor
+	vector<FlareVertex> patches;
+	vector<float> patch_bounds;  // min x, min y, max x, max y
+	vector<float> blade_directions;  // cos, sin of every blade, see BladeDistance
+	float blade_ripple[3] = {};      // cos, sin of the ripple's phase and its amplitude
+	vector<FlareTrace> traced;
+	FlareSettings traced_settings;
+	bool lens_changed = true;
+
+	// Set while CollectRayStats traces
+	RayStats* ray_stats = nullptr;
+
+	int NumGhosts() const {
+		return (int)ghosts.size() / 4;
+	}
+
+	int NumWavelengths() const {
+		return (int)spectral.wavelengths.size();
+	}
+
+	void SetLens(const vector<PatentFormat>& lens_components, int aperture, const vector<LensGap>& lens_gaps = vector<LensGap>()) {
+		LensGeometry geometry;
+		geometry.Build(lens_components);
+		components = lens_components;
+		gaps = lens_gaps;
+		interfaces = geometry.interfaces;
+		ghosts = geometry.ghosts;
+		aperture_id = aperture;
+		lens_changed = true;
+	}
+
+	bool SetLens(const LensPrescription& prescription) {
+		if (prescription.aperture_id < 0 || prescription.aperture_id >= (int)prescription.components.size())
+			return false;
+		SetLens(prescription.components, prescription.aperture_id, prescription.gaps);
+		return true;
+	}
+
+	// A lens of a mapped pack, copied so the pack may be closed afterwards
+	bool SetLens(const LensView& view) {
+		if (!view.entry)
+			return false;
+		const LensPackEntry& lens = *view.entry;
+		if (lens.aperture_id < 0 || (uint32_t)lens.aperture_id >= lens.num_components)
+			return false;
+		components.assign(view.components, view.components + lens.num_components);
+		gaps = view.Gaps();
+		interfaces.assign(view.interfaces, view.interfaces + lens.num_components);
+		ghosts.assign(view.ghosts, view.ghosts + lens.num_ghosts * 4);
+		aperture_id = lens.aperture_id;
+		lens_changed = true;
+		return true;
+	}
+
+	void SetLights(const SceneLight* scene, int count) {
+		planner.max_lights = settings.max_flare_lights;
+		planner.max_traced_directions = settings.max_flare_traces;
+		planner.Plan(scene, count, traces, lights);
+	}
+
+	void SetLights(const vector<SceneLight>& scene) {
+		SetLights(scene.data(), (int)scene.size());
+	}
+
+	// Brings the lens, the indices and the tracer to the current settings, what
+	// ParseLensComponents and UpdateLensGaps do for the interactive lens
+	void Prepare() {
+		MoveLensGaps(gaps, settings.zoom, settings.focus, components, interfaces);
+		interfaces[aperture_id].sa = settings.aperture_opening;
+
+		spectral.Init(settings.num_spectral_samples, settings.dispersion);
+		int num_wavelengths = NumWavelengths();
+		ior_table.resize(interfaces.size() * num_wavelengths * 2);
+		for (size_t i = 0; i < interfaces.size(); ++i) {
+			float left_abbe = i == 0 ? 0.f : components[i - 1].v;
+			for (int w = 0; w < num_wavelengths; ++w) {
+				float wavelength = spectral.wavelengths[w];
+				float* ior = &ior_table[(i * num_wavelengths + w) * 2];
+				ior[0] = settings.dispersion ? Dispersion::RefractiveIndex(interfaces[i].n.x, left_abbe, wavelength) : interfaces[i].n.x;
+				ior[1] = settings.dispersion ? Dispersion::RefractiveIndex(interfaces[i].n.z, components[i].v, wavelength) : interfaces[i].n.z;
+			}
+		}
+
+		tracer.Init(interfaces, spectral.wavelengths, ior_table, aperture_id, settings.coating_quality);
+	}
+
+	bool NeedsTrace() const {
+		if (lens_changed || !settings.SameTrace(traced_settings) || traced.size() != traces.size())
+			return true;
+		for (size_t i = 0; i < traces.size(); ++i)
+			if (memcmp(&traced[i], &traces[i], sizeof(FlareTrace)))
+				return true;
+		return false;
+	}
+
+	// GetTraceResult for every vertex of the (ghost, trace) patches, at every wavelength at once
+	void TracePatches() {
+		PROFILE_SCOPE("trace");
+		int num_ghosts = NumGhosts();
+		int num_wavelengths = NumWavelengths();
+		int n = settings.patch_tesselation;
+		int patch_size = n * n;
+
+		size_t capacity = patches.capacity();
+		patches.resize(traces.size() * num_wavelengths * num_ghosts * patch_size);
+		patch_bounds.resize(traces.size() * num_wavelengths * num_ghosts * 4);
+		if (patches.capacity() != capacity) {
+			PROFILE_COUNT("allocations", 1);
+			PROFILE_COUNT("bytes allocated", patches.capacity() * sizeof(FlareVertex));
+		}
+
+		ApertureShape aperture = { settings.number_of_blades, settings.aperture_opening };
+
+		Workers.ParallelFor((int)traces.size() * num_ghosts, 1, [&](int first, int last) {
+			static thread_local vector<SpectralHit> hits;
+			static thread_local vector<RayEnd> ends;
+			static thread_local GhostRayStats local;
+			hits.resize(num_wavelengths);
+			ends.resize(num_wavelengths);
+			for (int job = first; job < last; ++job) {
+				PROFILE_SCOPE("ghost");
+				int t = job / num_ghosts;
+				int ghost = job % num_ghosts;
+				const FlareTrace& trace = traces[t];
+				vec3 direction(trace.direction[0], trace.direction[1], trace.direction[2]);
+				int2 bounces = { (int)ghosts[ghost * 4], (int)ghosts[ghost * 4 + 1] };
+
+				// A rotated trace is drawn for lights at other azimuths, its blades are applied
+				// per pixel instead
+				const ApertureShape* blades = settings.analytic_aperture && trace.rotated == 0.f ? &aperture : nullptr;
+
+				if (ray_stats)
+					local.Reset((int)interfaces.size());
+
+				for (int k = 0; k < patch_size; ++k) {
+					float ndc_x = ((k % n) / float(n - 1) - 0.5f) * 2.f;
+					float ndc_y = ((k / n) / float(n - 1) - 0.5f) * 2.f;
+
+					// Project the starting points onto the entry lens
+					float sx = ndc_x * settings.rays_spread;
+					float sy = ndc_y * settings.rays_spread;
+					float c = cosf(2.f), s = sinf(2.f);
+					Ray r = { vec3(sx * c - sy * s, sy * c + sx * s, 1000.f), vec3(0.f, 0.f, -1.f), vec4() };
+					Intersection entry = testSPHERE(r, interfaces[0]);
+
+					tracer.Trace(entry.pos - direction, direction, bounces, blades, hits.data(), ray_stats ? ends.data() : nullptr);
+
+					for (int w = 0; w < num_wavelengths; ++w) {
+						const SpectralHit& h = hits[w];
+						FlareVertex vertex = { h.x, h.y, ndc_x, ndc_y, h.u, h.v, h.max_radius, h.intensity, 0.f };
+						patches[((size_t)(t * num_wavelengths + w) * num_ghosts + ghost) * patch_size + k] = vertex;
+						if (ray_stats)
+							local.Add(ends[w], h.intensity);
+					}
+				}
+
+				if (ray_stats)
+					ray_stats->Merge(ghost, local);
+
+				for (int w = 0; w < num_wavelengths; ++w)
+					PatchAreas((t * num_wavelengths + w) * num_ghosts + ghost);
+
+				PROFILE_COUNT("rays traced", patch_size * num_wavelengths);
+				// Interfaces crossed: in to bounce1, back to bounce2, then out to the sensor
+				PROFILE_COUNT("intersections", (int64_t)patch_size * num_wavelengths * (2 * bounces.x - 2 * bounces.y + (int)interfaces.size() - 1));
+			}
+		});
+
+		traced = traces;
+		traced_settings = settings;
+		lens_changed = false;
+	}
+
+	// Traces the lights given to SetLights with every ray's end recorded into stats, which is
+	// reset first. The patches are traced as usual, so a following Render reuses them
+	void CollectRayStats(RayStats& stats) {
+		stats.Reset(ghosts, (int)interfaces.size());
+		if (interfaces.empty())
+			return;
+
+		Prepare();
+		ray_stats = &stats;
+		TracePatches();
+		ray_stats = nullptr;
+	}
+
+	// GetArea for every vertex of a patch, and the patch's bounds over its lit vertices
+	void PatchAreas(int patch) {
+		int n = settings.patch_tesselation;
+		FlareVertex* p = &patches[(size_t)patch * n * n];
+		auto at = [&](int x, int y) -> const FlareVertex& { return p[min(max(y, 0), n - 1) * n + min(max(x, 0), n - 1)]; };
+		auto distance = [](const FlareVertex& a, const FlareVertex& b) { return sqrtf((a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y)); };
+
+		float unit_patch_length = settings.rays_spread / (float)n;
+		float* bounds = &patch_bounds[patch * 4];
+		bounds[0] = bounds[1] = 1e30f;
+		bounds[2] = bounds[3] = -1e30f;
+
+		for (int y = 0; y < n; ++y) {
+			for (int x = 0; x < n; ++x) {
+				const FlareVertex &a = at(x - 1, y + 1), &b = at(x, y + 1), &c = at(x + 1, y + 1);
+				const FlareVertex &d = at(x - 1, y), &e = at(x, y), &f = at(x + 1, y);
+				const FlareVertex &g = at(x - 1, y - 1), &h = at(x, y - 1), &i = at(x + 1, y - 1);
+
+				float ab = distance(a, b), bc = distance(b, c), ad = distance(a, d), be = distance(b, e);
+				float cf = distance(c, f), de = distance(d, e), ef = distance(e, f), dg = distance(d, g);
+				float eh = distance(e, h), fi = distance(f, i), gh = distance(g, h), hi = distance(h, i);
+
+				bool left_edge = x == 0, right_edge = x == n - 1;
+				bool bottom_edge = y == 0, top_edge = y == n - 1;
+
+				float A = (ab + de) * 0.5f * (ad + be) * 0.5f * (!left_edge && !top_edge);
+				float B = (bc + ef) * 0.5f * (be + cf) * 0.5f * (!right_edge && !top_edge);
+				float C = (de + gh) * 0.5f * (dg + eh) * 0.5f * (!left_edge && !bottom_edge);
+				float D = (ef + hi) * 0.5f * (eh + fi) * 0.5f * (!right_edge && !bottom_edge);
+
+				bool is_edge = left_edge || right_edge || bottom_edge || top_edge;
+				bool is_corner = (left_edge || right_edge) && (bottom_edge || top_edge);
+				float no_area_contributors = is_corner ? 1.f : is_edge ? 2.f : 4.f;
+
+				float Oa = unit_patch_length * unit_patch_length * no_area_contributors;
+				float Na = (A + B + C + D) / no_area_contributors;
+				float area = Oa / (Na + 0.00001f) * 4.f;
+
+				FlareVertex& vertex = p[y * n + x];
+				vertex.area = area == area ? area : 0.f;
+
+				if (vertex.intensity > 0.f) {
+					bounds[0] = min(bounds[0], vertex.x);
+					bounds[1] = min(bounds[1], vertex.y);
+					bounds[2] = max(bounds[2], vertex.x);
+					bounds[3] = max(bounds[3], vertex.y);
+				}
+			}
+		}
+	}
+
+	// ApertureBladeDistance for the settings' aperture without its arctangent and sines: a pixel
+	// would take two per blade. The blades' directions come from PrepareBlades, and the ripple
+	// sin(o * 2 pi) = sin(N (atan2(x, y) + opening) + 3 pi N / 2 + pi) from the N-th power of
+	// (y + i x) / r, N the number of blades and r the length of (x, y)
+	float BladeDistance(float x, float y, float r) const {
+		int num_of_blades = (int)blade_directions.size() / 2;
+
+		float c = r > 0.f ? y / r : 1.f, s = r > 0.f ? x / r : 0.f;
+		float cos_n = 1.f, sin_n = 0.f;
+		for (int i = 0; i < num_of_blades; ++i) {
+			float t = cos_n * c - sin_n * s;
+			sin_n = sin_n * c + cos_n * s;
+			cos_n = t;
+		}
+		float s2 = (sin_n * blade_ripple[0] + cos_n * blade_ripple[1]) * blade_ripple[2];
+
+		float signed_distance = 0.f;
+		for (int i = 0; i < num_of_blades; ++i)
+			signed_distance = smax(signed_distance, blade_directions[i * 2] * x + blade_directions[i * 2 + 1] * y, 0.1f);
+
+		return signed_distance + s2;
+	}
+
+	void PrepareBlades() {
+		int num_of_blades = max((int)settings.number_of_blades, 0);
+		blade_directions.resize(num_of_blades * 2);
+		for (int i = 0; i < num_of_blades; ++i) {
+			float angle = settings.aperture_opening + (i / float(num_of_blades)) * 2.f * PI;
+			blade_directions[i * 2] = cosf(angle);
+			blade_directions[i * 2 + 1] = sinf(angle);
+		}
+
+		float phase = num_of_blades * (settings.aperture_opening + 1.5f * PI) + PI;
+		blade_ripple[0] = cosf(phase);
+		blade_ripple[1] = sinf(phase);
+		blade_ripple[2] = 0.025f + (0.001f - 0.025f) * saturate((num_of_blades - 4) / 10.f);
+	}
+
+	// What PS weighs a pixel of a patch by, the vertex terms interpolated
+	float Alpha(float ndc_x, float ndc_y, float u, float v, float max_radius, float area) const {
+		if (max_radius >= 1.f)
+			return 0.f;
+
+		auto smoothstep = [](float t) { return t * t * (3.f - 2.f * t); };
+
+		float fade = 0.2f;
+		float lens_distance = sqrtf(ndc_x * ndc_x + ndc_y * ndc_y);
+		float sun_disk = smoothstep(1.f - saturate((lens_distance - 1.f + fade) / fade));
+		sun_disk *= 0.5f + 0.5f * saturate(lens_distance);
+
+		float aperture_distance = sqrtf(u * u + v * v);
+		float aperture_disk = smoothstep(saturate(aperture_distance * 0.25f));
+		aperture_disk = 0.5f + 0.5f * aperture_disk;
+
+		float aperture = 1.f - saturate((BladeDistance(u, v, aperture_distance) - APERTURE_RADIUS) / APERTURE_FADE);
+
+		return sun_disk * area * aperture * aperture_disk;
+	}
+
+	// Calls visit(rgb, a, b, c) for the lit triangles of every (light, wavelength, ghost)
+	// patch whose bounds reach the ndc rows [y_min, y_max], corners as VS places them on a
+	// target of the given width / height and rgb the patch's tint. Lost rays end at the
+	// origin (SpectralTracer::End), so triangles with a lost corner are left out rather than
+	// stretched to the centre: the ones visited lie within the patch's lit bounds
+	template <class Visit>
+	void VisitTriangles(float aspect, float y_min, float y_max, Visit visit) const {
+		int num_ghosts = NumGhosts();
+		int num_wavelengths = NumWavelengths();
+		int n = settings.patch_tesselation;
+		float scale_x = 1.f / interfaces.back().sa;
+		float scale_y = scale_x * aspect;
+
+		for (const FlareLight& light : lights) {
+			float cs = light.rotation[0], sn = light.rotation[1];
+
+			for (int w = 0; w < num_wavelengths; ++w) {
+				const float* rgb = &spectral.rgb[w * 3];
+				float tint[3] = { rgb[0] * light.intensity[0], rgb[1] * light.intensity[1], rgb[2] * light.intensity[2] };
+				if (tint[0] <= 0.f && tint[1] <= 0.f && tint[2] <= 0.f)
+					continue;
+
+				for (int ghost = 0; ghost < num_ghosts; ++ghost) {
+					int patch = ((int)light.trace * num_wavelengths + w) * num_ghosts + ghost;
+					const float* bounds = &patch_bounds[patch * 4];
+					if (bounds[0] > bounds[2])
+						continue;
+
+					// Rows the rotated bounds cover
+					float top = -1e30f, bottom = 1e30f;
+					for (int k = 0; k < 4; ++k) {
+						float ry = sn * bounds[(k & 1) * 2] + cs * bounds[1 + (k >> 1) * 2];
+						top = max(top, ry);
+						bottom = min(bottom, ry);
+					}
+					if (bottom * scale_y > y_max || top * scale_y < y_min)
+						continue;
+
+					const FlareVertex* p = &patches[(size_t)patch * n * n];
+					auto corner = [&](int x, int y) {
+						const FlareVertex& vertex = p[y * n + x];
+						FlareCorner c = {
+							(cs * vertex.x - sn * vertex.y) * scale_x,
+							(sn * vertex.x + cs * vertex.y) * scale_y,
+							vertex.ndc_x, vertex.ndc_y,
+							cs * vertex.u - sn * vertex.v,
+							sn * vertex.u + cs * vertex.v,
+							vertex.max_radius, vertex.intensity, vertex.area
+						};
+						return c;
+					};
+
+					for (int y = 0; y + 1 < n; ++y) {
+						for (int x = 0; x + 1 < n; ++x) {
+							const FlareVertex *va = &p[y * n + x], *vb = va + 1, *vc = va + n, *vd = vc + 1;
+							bool lit_a = va->intensity > 0.f, lit_d = vd->intensity > 0.f;
+							if (vb->intensity <= 0.f || vc->intensity <= 0.f || (!lit_a && !lit_d))
+								continue;
+
+							// Rows of the quad, as patches reach across many bands
+							float ya = sn * va->x + cs * va->y, yb = sn * vb->x + cs * vb->y;
+							float yc = sn * vc->x + cs * vc->y, yd = sn * vd->x + cs * vd->y;
+							if (max(max(ya, yb), max(yc, yd)) * scale_y < y_min || min(min(ya, yb), min(yc, yd)) * scale_y > y_max)
+								continue;
+
+							FlareCorner b = corner(x + 1, y), c = corner(x, y + 1);
+							if (lit_a)
+								visit(tint, corner(x, y), b, c);
+							if (lit_d)
+								visit(tint, b, corner(x + 1, y + 1), c);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Adds every patch to the rows [y0, y1) of the target
+	void RasterizeRows(int y0, int y1, const FlareTarget& target) const {
+		float half_width = target.width * 0.5f, half_height = target.height * 0.5f;
+		float aspect = (float)target.width / (float)target.height;
+
+		VisitTriangles(aspect, (half_height - y1) / half_height, (half_height - y0 + 1) / half_height,
+			[&](const float* tint, const FlareCorner& a, const FlareCorner& b, const FlareCorner& c) {
+				float ax = half_width + a.x * half_width, ay = half_height - a.y * half_height;
+				float bx = half_width + b.x * half_width, by = half_height - b.y * half_height;
+				float cx = half_width + c.x * half_width, cy = half_height - c.y * half_height;
+				RasterizeTriangle(ax, ay, bx, by, cx, cy, a, b, c, tint, y0, y1, target);
+			});
+	}
+
+	void RasterizeTriangle(
+		float ax, float ay, float bx, float by, float cx, float cy,
+		const FlareCorner& a, const FlareCorner& b, const FlareCorner& c,
+		const float* tint, int y0, int y1, const FlareTarget& target
+	) const {
+		float area = (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
+		if (area == 0.f || area != area)
+			return;
+
+		int min_x = max((int)floorf(min(min(ax, bx), cx)), 0);
+		int max_x = min((int)ceilf(max(max(ax, bx), cx)), target.width - 1);
+		int min_y = max((int)floorf(min(min(ay, by), cy)), y0);
+		int max_y = min((int)ceilf(max(max(ay, by), cy)), y1 - 1);
+		float inv_area = 1.f / area;
+
+		// The barycentric weights change by these from one column to the next
+		float step_a = (by - cy) * inv_area;
+		float step_b = (cy - ay) * inv_area;
+		float step_c = -step_a - step_b;
+
+		for (int y = min_y; y <= max_y; ++y) {
+			float py = y + 0.5f;
+			float px = min_x + 0.5f;
+			float wa = ((bx - px) * (cy - py) - (by - py) * (cx - px)) * inv_area;
+			float wb = ((cx - px) * (ay - py) - (cy - py) * (ax - px)) * inv_area;
+			float wc = 1.f - wa - wb;
+
+			// Columns where no weight is negative, a pixel wider for the rounding of the steps
+			float first = (float)min_x, last = (float)max_x;
+			bool empty = false;
+			auto clip = [&](float w, float step) {
+				if (step > 0.f)
+					first = max(first, min_x + ceilf(-w / step) - 1.f);
+				else if (step < 0.f)
+					last = min(last, min_x + floorf(w / -step) + 1.f);
+				else if (w < 0.f)
+					empty = true;
+			};
+			clip(wa, step_a);
+			clip(wb, step_b);
+			clip(wc, step_c);
+			if (empty || first > last)
+				continue;
+
+			int x_begin = (int)first, x_end = (int)last;
+			wa += step_a * (x_begin - min_x);
+			wb += step_b * (x_begin - min_x);
+			wc += step_c * (x_begin - min_x);
+
+			for (int x = x_begin; x <= x_end; ++x, wa += step_a, wb += step_b, wc += step_c) {
+				if (wa < 0.f || wb < 0.f || wc < 0.f)
+					continue;
+
+				float intensity = wa * a.intensity + wb * b.intensity + wc * c.intensity;
+				if (intensity <= 0.f)
+					continue;
+
+				float alpha = Alpha(
+					wa * a.lens_x + wb * b.lens_x + wc * c.lens_x,
+					wa * a.lens_y + wb * b.lens_y + wc * c.lens_y,
+					wa * a.u + wb * b.u + wc * c.u,
+					wa * a.v + wb * b.v + wc * c.v,
+					wa * a.max_radius + wb * b.max_radius + wc * c.max_radius,
+					wa * a.area + wb * b.area + wc * c.area
+				) * intensity;
+				if (alpha <= 0.f)
+					continue;
+
+				float* pixel = target.Pixel(x, y);
+				pixel[0] += alpha * tint[0];
+				pixel[1] += alpha * tint[1];
+				pixel[2] += alpha * tint[2];
+			}
+		}
+	}
+
+	// Traces the patches if the lens, the settings or the planned traces changed since the
+	// last call
+	void Update() {
+		if (!interfaces.empty() && NeedsTrace()) {
+			Prepare();
+			TracePatches();
+		}
+	}
+
+	// Adds the flare of the lights given to SetLights to target, cleared first unless
+	// accumulating. Writes nothing outside the target's pixels
+	void Render(const FlareTarget& target, bool accumulate = false) {
+		PROFILE_SCOPE("flare render");
+		const int band = 16;
+		int num_bands = (target.height + band - 1) / band;
+		bool draw = !interfaces.empty() && !lights.empty();
+		if (draw) {
+			Update();
+			PrepareBlades();
+		}
+
+		Workers.ParallelFor(num_bands, 1, [&](int first, int last) {
+			for (int b = first; b < last; ++b) {
+				PROFILE_SCOPE("raster band");
+				int y0 = b * band, y1 = min((b + 1) * band, target.height);
+				if (!accumulate)
+					for (int y = y0; y < y1; ++y)
+						for (int x = 0; x < target.width; ++x)
+							target.Pixel(x, y)[0] = target.Pixel(x, y)[1] = target.Pixel(x, y)[2] = 0.f;
+				if (draw)
+					RasterizeRows(y0, y1, target);
+			}
+		});
+	}
+
+	// Renders into image at settings.width by settings.height
+	void Render(HDRImage& image) {
+		image.Resize(settings.width, settings.height);
+		Render(FlareTarget(image), true);
+	}
+};
@@ -0,0 +1,284 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// The whole CPU frame as a TaskGraph (task_graph.h): the aperture, its spectrum and the
+// starburst (starburst.h), the ghost trace and raster (flare_context.h), the starburst added
+// over the ghosts and the tonemap. The starburst chain and the ghost trace only meet at the
+// composite, so Render runs them at the same time. The aperture and its spectrum only run
+// when the aperture changed, as DrawStarBurstCPU keeps them. A frame given an HDR plate also
+// glares it (glare.h) through its starburst next to the raster, added at the composite.
+//
+// Submit pipelines a sequence: frame N+1's lights, trace and starburst run in the same graph
+// as frame N's raster, composite and tonemap, so frames come at the pace of the slower half
+// rather than of every stage, one Submit later. What the halves hand over is double
+// buffered in the two FlareFrames, each with its own FlareContext (settings, lights and
+// traced patches), starburst and images. The spectrum is shared, only first halves use it.
+//--------------------------------------------------------------------------------------
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "aperture.h"
+#include "flare_context.h"
+#include "glare.h"
+#include "hdr_image.h"
+#include "spectral_color.h"
+#include "starburst.h"
+#include "task_graph.h"
+
+using namespace std;
+
+struct FlareFrame {
+	int64_t number = -1;     // of the Render or Submit that started it
+	FlareContext context;
+	vector<SceneLight> scene;
+	ApertureKey aperture_key = {};
+	vector<float> starburst; // starburst_resolution² rgb, what PSStarburstFilter writes
+	const HDRImage* plate = nullptr;  // glared when set, see glare_psf_size
+	HDRImage glare;
+	HDRImage image;          // ghosts, starburst and glare
+	vector<uint8_t> rgba;    // tonemapped
+};
+
+struct FlareFramePipeline {
+	FlareFrame frames[2];
+	FlareFrame* pending = nullptr;  // submitted, its second half not run yet
+	int64_t started = 0;
+
+	bool draw_starburst = true;
+	bool concurrent = true;  // false runs the stages one after the other
+	int aperture_resolution = 512;
+	int starburst_resolution = 512;
+	vector<float> dust_texture = vector<float>(1, 0.f);  // dust_resolution², none by default
+	int dust_resolution = 1;
+
+	// Glare of a plate handed to Render or Submit, through the frame's starburst scaled to
+	// glare_psf_size pixels, 0 for none. The plate has the settings' size and stays valid
+	// until its frame is returned
+	int glare_psf_size = 256;
+	GlareConvolution glare;
+
+	ApertureGenerator aperture_generator;
+	StarburstPipeline starburst;
+	vector<float> aperture, dust, mask;
+	TaskGraph graph;
+
+	// Lenses change between frames, not while one is pending
+	void SetLens(const vector<PatentFormat>& components, int aperture, const vector<LensGap>& gaps = vector<LensGap>()) {
+		frames[0].context.SetLens(components, aperture, gaps);
+		frames[1].context.SetLens(components, aperture, gaps);
+	}
+
+	bool SetLens(const LensPrescription& prescription) {
+		return frames[0].context.SetLens(prescription) && frames[1].context.SetLens(prescription);
+	}
+
+	bool SetLens(const LensView& view) {
+		return frames[0].context.SetLens(view) && frames[1].context.SetLens(view);
+	}
+
+	// One frame with its independent stages at the same time
+	FlareFrame& Render(const FlareSettings& settings, const vector<SceneLight>& scene, const HDRImage* plate = nullptr) {
+		PROFILE_SCOPE("flare frame");
+		Flush();
+		FlareFrame& frame = Start(settings, scene, plate);
+		int trace = -1, starburst_task = -1;
+		graph.Clear();
+		AddFirstHalf(frame, trace, starburst_task);
+		AddSecondHalf(frame, trace, starburst_task);
+		Run();
+		return frame;
+	}
+
+	// Starts a frame and finishes the one submitted before it, which is returned, nullptr on
+	// the first call. Its pixels stay until the next Render or Submit
+	FlareFrame* Submit(const FlareSettings& settings, const vector<SceneLight>& scene, const HDRImage* plate = nullptr) {
+		PROFILE_SCOPE("flare frame");
+		FlareFrame* previous = pending;
+		FlareFrame& frame = Start(settings, scene, plate);
+		int trace = -1, starburst_task = -1;
+		graph.Clear();
+		AddFirstHalf(frame, trace, starburst_task);
+		if (previous)
+			AddSecondHalf(*previous, -1, -1);
+		Run();
+		pending = &frame;
+		return previous;
+	}
+
+	// Finishes the frame Submit left pending, nullptr when there is none
+	FlareFrame* Flush() {
+		FlareFrame* previous = pending;
+		if (!previous)
+			return nullptr;
+		graph.Clear();
+		AddSecondHalf(*previous, -1, -1);
+		Run();
+		pending = nullptr;
+		return previous;
+	}
+
+	FlareFrame& Start(const FlareSettings& settings, const vector<SceneLight>& scene, const HDRImage* plate) {
+		FlareFrame& frame = frames[started & 1];
+		frame.number = started++;
+		frame.context.settings = settings;
+		frame.scene = scene;
+		bool glares = draw_starburst && glare_psf_size > 0 && plate && plate->width == settings.width && plate->height == settings.height;
+		frame.plate = glares ? plate : nullptr;
+		frame.aperture_key.num_of_blades = settings.number_of_blades;
+		frame.aperture_key.opening = settings.aperture_opening;
+		if (frame.image.width != settings.width || frame.image.height != settings.height)
+			frame.image.Resize(settings.width, settings.height);
+		return frame;
+	}
+
+	void Run() {
+		if (concurrent)
+			graph.Run();
+		else
+			graph.RunInOrder();
+	}
+
+	// Lights and trace, aperture, spectrum and starburst
+	void AddFirstHalf(FlareFrame& frame, int& trace, int& starburst_task) {
+		trace = graph.Add("lights and trace", [&frame]() {
+			frame.context.SetLights(frame.scene);
+			frame.context.Update();
+		});
+
+		if (!draw_starburst)
+			return;
+
+		int aperture_task = -1, spectrum_task = -1;
+		if (starburst.NeedsSpectrum(frame.aperture_key)) {
+			aperture_task = graph.Add("aperture", [this, &frame]() {
+				aperture_generator.Generate(frame.aperture_key.num_of_blades, frame.aperture_key.opening, aperture_resolution,
+					dust_texture.data(), dust_resolution, aperture, dust, mask);
+			});
+			spectrum_task = graph.Add("spectrum", [this, &frame]() {
+				starburst.SetSpectrum(frame.aperture_key, aperture.data(), dust.data(), aperture_resolution);
+			}, { aperture_task });
+		}
+		starburst_task = graph.Add("starburst", [this, &frame]() {
+			starburst.Render(starburst_resolution, frame.starburst);
+		}, { spectrum_task });
+	}
+
+	// Raster and glare, composite and tonemap, after the first half's trace and starburst when
+	// they are in the same graph
+	void AddSecondHalf(FlareFrame& frame, int trace, int starburst_task) {
+		int last = graph.Add("raster", [&frame]() {
+			frame.context.Render(FlareTarget(frame.image));
+		}, { trace });
+
+		if (draw_starburst) {
+			int glare_task = -1;
+			if (frame.plate) {
+				glare_task = graph.Add("glare", [this, &frame]() {
+					Glare(frame);
+				}, { starburst_task });
+			}
+			last = graph.Add("composite", [this, &frame]() {
+				AddGlare(frame);
+				CompositeStarburst(frame);
+			}, { last, starburst_task, glare_task });
+		}
+
+		graph.Add("tonemap", [&frame]() {
+			frame.image.ToneMap(frame.rgba);
+		}, { last });
+	}
+
+	// The plate's glare through the frame's starburst. The PSF spectrum is kept per aperture,
+	// the dust texture and the starburst resolution being fixed while frames run
+	void Glare(FlareFrame& frame) {
+		const HDRImage& plate = *frame.plate;
+		uint64_t key = HashBytes(&starburst_resolution, sizeof(starburst_resolution));
+		key = HashBytes(&frame.aperture_key, sizeof(frame.aperture_key), key);
+		glare.SetPSF(key, frame.starburst.data(), starburst_resolution, glare_psf_size);
+		if (frame.glare.width != plate.width || frame.glare.height != plate.height)
+			frame.glare.Resize(plate.width, plate.height);
+		glare.Convolve(plate.rgb.data(), plate.width, plate.height, frame.glare.rgb.data());
+	}
+
+	void AddGlare(FlareFrame& frame) const {
+		if (!frame.plate)
+			return;
+		HDRImage& image = frame.image;
+		Workers.ParallelFor(image.height, 16, [&](int first, int last) {
+			size_t end = (size_t)last * image.width * 3;
+			for (size_t i = (size_t)first * image.width * 3; i < end; ++i)
+				image.rgb[i] += frame.glare.rgb[i];
+		});
+	}
+
+	// VSStarburst and PSStarburst for every light, without the flicker over time: the
+	// starburst on a quad around where the light's direction meets the plane at z = 20
+	void CompositeStarburst(FlareFrame& frame) const {
+		HDRImage& image = frame.image;
+		int size = starburst_resolution;
+		if ((int)frame.starburst.size() != size * size * 3)
+			return;
+
+		const float white[3] = { 1.f, 1.f, 1.f };
+		float opening = 0.2f + saturate(frame.context.settings.aperture_opening / 10.f);
+
+		for (const SceneLight& light : frame.scene) {
+			vec3 l = normalize(vec3(light.direction[0], light.direction[1], light.direction[2]));
+			float intensity = 1.f - saturate(fabsf(l.x * 9.f));
+			if (intensity <= 0.f)
+				continue;
+
+			// IntersectPlane, 0 for directions away from the plane
+			float cx = 0.f, cy = 0.f;
+			if (-l.z > 1e-6f) {
+				cx = l.x * 20.f / l.z * 0.5f;
+				cy = l.y * 20.f / l.z;
+			}
+
+			const float* tint = light.temperature > 0.f ? SpectralColor.Blackbody(light.temperature) : white;
+			float color[3] = { light.rgb[0] * tint[0] * intensity, light.rgb[1] * tint[1] * intensity, light.rgb[2] * tint[2] * intensity };
+
+			// Pixel rows and columns the quad covers
+			int x0 = max(0, (int)floorf((cx - opening + 1.f) * 0.5f * image.width));
+			int x1 = min(image.width, (int)ceilf((cx + opening + 1.f) * 0.5f * image.width));
+			int y0 = max(0, (int)floorf((1.f - cy - opening) * 0.5f * image.height));
+			int y1 = min(image.height, (int)ceilf((1.f - cy + opening) * 0.5f * image.height));
+			if (x0 >= x1 || y0 >= y1)
+				continue;
+
+			Workers.ParallelFor(y1 - y0, 16, [&](int first, int last) {
+				for (int y = y0 + first; y < y0 + last; ++y) {
+					float qy = (1.f - (y + 0.5f) / image.height * 2.f - cy) / opening;
+					for (int x = x0; x < x1; ++x) {
+						float qx = ((x + 0.5f) / image.width * 2.f - 1.f - cx) / opening;
+						if (qx < -1.f || qx > 1.f || qy < -1.f || qy > 1.f)
+							continue;
+
+						// uv of VSStarburst, sampled like linear_wrap_sampler
+						float u = (qx + 1.f) * 0.5f * size - 0.5f;
+						float v = (qy * 0.5f + 1.f) * 0.5f * size - 0.5f;
+						float fu = floorf(u), fv = floorf(v);
+						float tu = u - fu, tv = v - fv;
+						int u0 = ((int)fu % size + size) % size, v0 = ((int)fv % size + size) % size;
+						int u1 = (u0 + 1) % size, v1 = (v0 + 1) % size;
+						const float* a = &frame.starburst[((size_t)v0 * size + u0) * 3];
+						const float* b = &frame.starburst[((size_t)v0 * size + u1) * 3];
+						const float* c = &frame.starburst[((size_t)v1 * size + u0) * 3];
+						const float* d = &frame.starburst[((size_t)v1 * size + u1) * 3];
+
+						float* pixel = image.Pixel(x, y);
+						for (int k = 0; k < 3; ++k) {
+							float top = a[k] + (b[k] - a[k]) * tu;
+							float bottom = c[k] + (d[k] - c[k]) * tu;
+							pixel[k] += (top + (bottom - top) * tv) * color[k];
+						}
+					}
+				}
+			});
+		}
+	}
+};
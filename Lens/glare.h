@@ -0,0 +1,352 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// Glare for whole HDR plates: every pixel above a threshold is spread by the starburst PSF
+// instead of one starburst quad being stamped at the light. The convolution runs on the CPU
+// FFT with overlap-save: the plate is cut into tiles whose FFT blocks overlap by the PSF
+// size, each block is transformed, multiplied with the cached PSF spectrum and transformed
+// back, and only the part free of wrap around is kept. Plates stream through one strip of
+// tile rows at a time, the tiles of a strip are spread over the worker pool and tiles with
+// nothing above the threshold are skipped.
+//--------------------------------------------------------------------------------------
+
+#include <math.h>
+#include <string.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "cpu_fft.h"
+#include "profiler.h"
+#include "starburst_cache.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+struct GlareConvolution {
+	// Spectra of one PSF zero padded to a tile, divided by tile_size² so the unnormalized
+	// inverse FFT comes out at the right scale
+	struct Kernel {
+		int psf_size = 0;
+		int tile_size = 0;
+		vector<float> re[3];
+		vector<float> im[3];
+		uint64_t last_use = 0;
+	};
+
+	struct TileScratch {
+		FFT2D fft;
+		vector<float> rg_re, rg_im;  // r + i * g
+		vector<float> b_re, b_im;    // b
+	};
+
+	typedef function<void(int y, float* row)> RowSource;        // fills width rgb pixels of row y
+	typedef function<void(int y, const float* row)> RowSink;    // receives width rgb glare pixels
+
+	float threshold = 1.f;   // luminance where pixels start to glare
+	float intensity = 0.05f; // fraction of the luminance above the threshold the PSF spreads
+	int max_kernels = 4;
+
+	map<uint64_t, shared_ptr<Kernel>> kernels;
+	shared_ptr<Kernel> kernel;
+	uint64_t use_counter = 0;
+
+	static float Luminance(const float* rgb) {
+		return rgb[0] * 0.2126f + rgb[1] * 0.7152f + rgb[2] * 0.0722f;
+	}
+
+	static int TileSize(int psf_size) {
+		int n = 256;
+		while (n < psf_size * 2)
+			n *= 2;
+		return n;
+	}
+
+	// Area weights of a size -> new_size resample, one (first source index, weights) per output
+	static void ResampleWeights(int size, int new_size, vector<int>& first, vector<vector<float>>& weights) {
+		first.resize(new_size);
+		weights.assign(new_size, vector<float>());
+		float ratio = (float)size / new_size;
+		for (int i = 0; i < new_size; ++i) {
+			float x0 = i * ratio, x1 = (i + 1) * ratio;
+			if (ratio < 1.f) {
+				// Upsampling, bilinear
+				float t = (i + 0.5f) * ratio - 0.5f;
+				int j = (int)floorf(t);
+				float f = t - j;
+				first[i] = max(0, min(j, size - 2));
+				f = j < 0 ? 0.f : (j > size - 2 ? 1.f : f);
+				weights[i].push_back(1.f - f);
+				weights[i].push_back(f);
+				continue;
+			}
+			first[i] = (int)x0;
+			for (int j = (int)x0; j < size && j < x1; ++j) {
+				float covered = min(x1, (float)(j + 1)) - max(x0, (float)j);
+				weights[i].push_back(covered / ratio);
+			}
+		}
+	}
+
+	// Uses rgb (resolution * resolution, e.g. the filtered starburst) as the PSF, psf_size plate
+	// pixels wide and centred on its middle pixel. key names the PSF, spectra of the last few
+	// keys are kept so animated plates with a fixed aperture only transform the PSF once
+	void SetPSF(uint64_t key, const float* rgb, int resolution, int psf_size) {
+		uint64_t full_key = HashBytes(&psf_size, sizeof(psf_size), key);
+		full_key = HashBytes(&intensity, sizeof(intensity), full_key);
+
+		auto it = kernels.find(full_key);
+		if (it != kernels.end()) {
+			kernel = it->second;
+			kernel->last_use = ++use_counter;
+			return;
+		}
+
+		int n = TileSize(psf_size);
+		shared_ptr<Kernel> k(new Kernel());
+		k->psf_size = psf_size;
+		k->tile_size = n;
+
+		// Resample into the top left psf_size² corner of the tile, rows then columns
+		vector<int> first;
+		vector<vector<float>> weights;
+		ResampleWeights(resolution, psf_size, first, weights);
+
+		vector<float> rows((size_t)resolution * psf_size * 3, 0.f);
+		for (int y = 0; y < resolution; ++y) {
+			const float* src = &rgb[(size_t)y * resolution * 3];
+			float* dst = &rows[(size_t)y * psf_size * 3];
+			for (int x = 0; x < psf_size; ++x)
+				for (size_t w = 0; w < weights[x].size(); ++w)
+					for (int c = 0; c < 3; ++c)
+						dst[x * 3 + c] += src[(first[x] + w) * 3 + c] * weights[x][w];
+		}
+
+		vector<float> planes[3];
+		for (int c = 0; c < 3; ++c)
+			planes[c].assign((size_t)n * n, 0.f);
+
+		double total = 0.0;
+		for (int y = 0; y < psf_size; ++y) {
+			for (int x = 0; x < psf_size; ++x) {
+				float value[3] = { 0.f, 0.f, 0.f };
+				for (size_t w = 0; w < weights[y].size(); ++w)
+					for (int c = 0; c < 3; ++c)
+						value[c] += rows[((first[y] + w) * psf_size + x) * 3 + c] * weights[y][w];
+				for (int c = 0; c < 3; ++c)
+					planes[c][(size_t)y * n + x] = value[c];
+				total += Luminance(value);
+			}
+		}
+
+		// Spread intensity times the energy above the threshold, folded with the 1 / n² of the inverse
+		float scale = total > 0.0 ? (float)(intensity / total) / ((float)n * n) : 0.f;
+
+		FFT2D fft;
+		vector<float> zero((size_t)n * n, 0.f);
+		RealPairSpectrum rg, b;
+		fft.ForwardRealPair(planes[0].data(), planes[1].data(), n, n, rg);
+		fft.ForwardRealPair(planes[2].data(), zero.data(), n, n, b);
+
+		for (int c = 0; c < 3; ++c) {
+			k->re[c].resize((size_t)n * n);
+			k->im[c].resize((size_t)n * n);
+		}
+		Workers.ParallelFor(n, 16, [&](int begin, int end) {
+			for (int v = begin; v < end; ++v) {
+				for (int u = 0; u < n; ++u) {
+					size_t i = (size_t)v * n + u;
+					float ar, ai, br, bi, cr, ci, dr, di;
+					rg.Get(u, v, ar, ai, br, bi);
+					b.Get(u, v, cr, ci, dr, di);
+					k->re[0][i] = ar * scale, k->im[0][i] = ai * scale;
+					k->re[1][i] = br * scale, k->im[1][i] = bi * scale;
+					k->re[2][i] = cr * scale, k->im[2][i] = ci * scale;
+				}
+			}
+		});
+
+		if ((int)kernels.size() >= max_kernels) {
+			auto oldest = kernels.begin();
+			for (auto i = kernels.begin(); i != kernels.end(); ++i)
+				if (i->second->last_use < oldest->second->last_use)
+					oldest = i;
+			kernels.erase(oldest);
+		}
+
+		k->last_use = ++use_counter;
+		kernels[full_key] = k;
+		kernel = k;
+	}
+
+	// Convolves one block of the thresholded window, writes its valid part to out. window rows
+	// are window_width rgb pixels, the block starts at column x0 (may be negative)
+	void ConvolveTile(const float* window, int window_width, int x0, float* out, int out_x0, int out_width, int out_rows, TileScratch& scratch) const {
+		const Kernel& k = *kernel;
+		int n = k.tile_size;
+		int m = k.psf_size;
+		size_t n2 = (size_t)n * n;
+
+		scratch.rg_re.resize(n2);
+		scratch.rg_im.resize(n2);
+		scratch.b_re.resize(n2);
+		scratch.b_im.assign(n2, 0.f);
+		float* rg_re = scratch.rg_re.data();
+		float* rg_im = scratch.rg_im.data();
+		float* b_re = scratch.b_re.data();
+		float* b_im = scratch.b_im.data();
+
+		bool any = false;
+		for (int y = 0; y < n; ++y) {
+			const float* row = &window[(size_t)y * window_width * 3];
+			for (int x = 0; x < n; ++x) {
+				int sx = x0 + x;
+				size_t i = (size_t)y * n + x;
+				if (sx < 0 || sx >= window_width) {
+					rg_re[i] = rg_im[i] = b_re[i] = 0.f;
+					continue;
+				}
+				rg_re[i] = row[sx * 3 + 0];
+				rg_im[i] = row[sx * 3 + 1];
+				b_re[i] = row[sx * 3 + 2];
+				any = any || rg_re[i] != 0.f || rg_im[i] != 0.f || b_re[i] != 0.f;
+			}
+		}
+
+		if (!any) {
+			for (int y = 0; y < out_rows; ++y)
+				memset(&out[((size_t)y * out_width + out_x0) * 3], 0, (size_t)min(n - m + 1, out_width - out_x0) * 3 * sizeof(float));
+			return;
+		}
+
+		TileScratch& s = scratch;
+		s.fft.Forward(rg_re, rg_im, n, n);
+		s.fft.Forward(b_re, b_im, n, n);
+
+		// Split z = R + i G with the Hermitian symmetry and form R Kr + i G Kg, k and -k together
+		for (int v = 0; v < n; ++v) {
+			int mv = (n - v) % n;
+			for (int u = 0; u < n; ++u) {
+				int mu = (n - u) % n;
+				size_t i = (size_t)v * n + u;
+				size_t j = (size_t)mv * n + mu;
+				if (j < i)
+					continue;
+
+				float zr = rg_re[i], zi = rg_im[i];
+				float mr = rg_re[j], mi = -rg_im[j];
+				float r_re = (zr + mr) * 0.5f, r_im = (zi + mi) * 0.5f;
+				float g_re = (zi - mi) * 0.5f, g_im = (mr - zr) * 0.5f;
+
+				// k
+				float p_re = r_re * k.re[0][i] - r_im * k.im[0][i];
+				float p_im = r_re * k.im[0][i] + r_im * k.re[0][i];
+				float q_re = g_re * k.re[1][i] - g_im * k.im[1][i];
+				float q_im = g_re * k.im[1][i] + g_im * k.re[1][i];
+				rg_re[i] = p_re - q_im;
+				rg_im[i] = p_im + q_re;
+
+				// -k, where R and G are conjugated
+				if (j != i) {
+					p_re = r_re * k.re[0][j] + r_im * k.im[0][j];
+					p_im = r_re * k.im[0][j] - r_im * k.re[0][j];
+					q_re = g_re * k.re[1][j] + g_im * k.im[1][j];
+					q_im = g_re * k.im[1][j] - g_im * k.re[1][j];
+					rg_re[j] = p_re - q_im;
+					rg_im[j] = p_im + q_re;
+				}
+			}
+		}
+
+		for (size_t i = 0; i < n2; ++i) {
+			float br = b_re[i], bi = b_im[i];
+			b_re[i] = br * k.re[2][i] - bi * k.im[2][i];
+			b_im[i] = br * k.im[2][i] + bi * k.re[2][i];
+		}
+
+		s.fft.Inverse(rg_re, rg_im, n, n);
+		s.fft.Inverse(b_re, b_im, n, n);
+
+		// Rows and columns below m - 1 hold wrapped around results
+		for (int y = 0; y < out_rows; ++y) {
+			const float* r = &rg_re[(size_t)(y + m - 1) * n + m - 1];
+			const float* g = &rg_im[(size_t)(y + m - 1) * n + m - 1];
+			const float* b = &b_re[(size_t)(y + m - 1) * n + m - 1];
+			float* o = &out[((size_t)y * out_width + out_x0) * 3];
+			int count = min(n - m + 1, out_width - out_x0);
+			for (int x = 0; x < count; ++x) {
+				o[x * 3 + 0] = r[x];
+				o[x * 3 + 1] = g[x];
+				o[x * 3 + 2] = b[x];
+			}
+		}
+	}
+
+	// Streams a width * height plate through the current PSF. Memory is bounded by one window of
+	// tile_size rows (plus a tile per worker), whatever the plate height
+	void Convolve(int width, int height, const RowSource& source, const RowSink& sink) const {
+		if (!kernel)
+			return;
+		PROFILE_SCOPE("glare");
+
+		int n = kernel->tile_size;
+		int m = kernel->psf_size;
+		int valid = n - m + 1;
+		int offset = m / 2 - (m - 1);  // block start relative to the first output pixel
+		size_t row_floats = (size_t)width * 3;
+
+		vector<float> window((size_t)n * row_floats, 0.f);
+		vector<float> strip((size_t)valid * row_floats);
+		vector<float> pixels(row_floats);
+
+		// Plate row y, thresholded, into window row w
+		auto read_row = [&](int y, int w) {
+			float* dst = &window[(size_t)w * row_floats];
+			if (y < 0 || y >= height) {
+				memset(dst, 0, row_floats * sizeof(float));
+				return;
+			}
+			source(y, pixels.data());
+			for (int x = 0; x < width; ++x) {
+				const float* p = &pixels[x * 3];
+				float luminance = Luminance(p);
+				float excess = luminance > threshold ? (luminance - threshold) / luminance : 0.f;
+				for (int c = 0; c < 3; ++c)
+					dst[x * 3 + c] = p[c] * excess;
+			}
+		};
+
+		int tiles_x = (width + valid - 1) / valid;
+		for (int oy = 0; oy < height; oy += valid) {
+			int first_row = oy + offset;
+			if (oy == 0) {
+				for (int w = 0; w < n; ++w)
+					read_row(first_row + w, w);
+			} else {
+				memmove(window.data(), &window[(size_t)valid * row_floats], (size_t)(n - valid) * row_floats * sizeof(float));
+				for (int w = n - valid; w < n; ++w)
+					read_row(first_row + w, w);
+			}
+
+			int rows = min(valid, height - oy);
+			Workers.ParallelFor(tiles_x, 1, [&](int begin, int end) {
+				static thread_local TileScratch scratch;
+				for (int t = begin; t < end; ++t)
+					ConvolveTile(window.data(), width, t * valid + offset, strip.data(), t * valid, width, rows, scratch);
+			});
+
+			for (int y = 0; y < rows; ++y)
+				sink(oy + y, &strip[(size_t)y * row_floats]);
+		}
+	}
+
+	// In memory plate, rgb and glare hold width * height rgb pixels
+	void Convolve(const float* rgb, int width, int height, float* glare) const {
+		size_t row_floats = (size_t)width * 3;
+		Convolve(width, height,
+			[&](int y, float* row) { memcpy(row, &rgb[y * row_floats], row_floats * sizeof(float)); },
+			[&](int y, const float* row) { memcpy(&glare[y * row_floats], row, row_floats * sizeof(float)); });
+	}
+};
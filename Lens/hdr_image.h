@@ -0,0 +1,106 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// Float rgb image with PFM (portable float map) reading and writing, rows top to bottom.
+//--------------------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct HDRImage {
+	int width = 0;
+	int height = 0;
+	vector<float> rgb;
+
+	void Resize(int w, int h) {
+		width = w;
+		height = h;
+		rgb.assign((size_t)w * h * 3, 0.f);
+	}
+
+	float* Pixel(int x, int y) {
+		return &rgb[((size_t)y * width + x) * 3];
+	}
+
+	const float* Pixel(int x, int y) const {
+		return &rgb[((size_t)y * width + x) * 3];
+	}
+
+	// ACESFilm of post.hlsl's PSToneMapping to 8 bit rgba, what the swap chain shows
+	void ToneMap(vector<uint8_t>& rgba) const {
+		rgba.resize((size_t)width * height * 4);
+		for (size_t i = 0; i < (size_t)width * height; ++i) {
+			for (int c = 0; c < 3; ++c) {
+				float x = rgb[i * 3 + c];
+				float y = (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+				rgba[i * 4 + c] = (uint8_t)(min(max(y, 0.f), 1.f) * 255.f + 0.5f);
+			}
+			rgba[i * 4 + 3] = 255;
+		}
+	}
+
+	static bool LittleEndian() {
+		const uint16_t probe = 1;
+		return *(const unsigned char*)&probe == 1;
+	}
+
+	static void SwapBytes(float* values, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			unsigned char* b = (unsigned char*)&values[i];
+			swap(b[0], b[3]);
+			swap(b[1], b[2]);
+		}
+	}
+
+	// "PF" colour and "Pf" greyscale maps, PFM stores rows bottom to top
+	bool LoadPFM(const string& path) {
+		FILE* file = fopen(path.c_str(), "rb");
+		if (!file)
+			return false;
+
+		char type[3] = { 0, 0, 0 };
+		int w = 0, h = 0;
+		float scale = 0.f;
+		bool ok = fscanf(file, "%2s %d %d %f", type, &w, &h, &scale) == 4 && w > 0 && h > 0 && fgetc(file) != EOF;
+		int channels = strcmp(type, "PF") == 0 ? 3 : (strcmp(type, "Pf") == 0 ? 1 : 0);
+		if (!ok || channels == 0) {
+			fclose(file);
+			return false;
+		}
+
+		Resize(w, h);
+		vector<float> row((size_t)w * channels);
+		bool swap_bytes = (scale < 0.f) != LittleEndian();
+		for (int y = h - 1; y >= 0 && ok; --y) {
+			ok = fread(row.data(), sizeof(float), row.size(), file) == row.size();
+			if (swap_bytes)
+				SwapBytes(row.data(), row.size());
+			for (int x = 0; x < w; ++x)
+				for (int c = 0; c < 3; ++c)
+					Pixel(x, y)[c] = row[(size_t)x * channels + (channels == 3 ? c : 0)];
+		}
+
+		fclose(file);
+		return ok;
+	}
+
+	bool SavePFM(const string& path) const {
+		FILE* file = fopen(path.c_str(), "wb");
+		if (!file)
+			return false;
+
+		bool ok = fprintf(file, "PF\n%d %d\n%s\n", width, height, LittleEndian() ? "-1.0" : "1.0") > 0;
+		for (int y = height - 1; y >= 0 && ok; --y)
+			ok = fwrite(Pixel(0, y), sizeof(float), (size_t)width * 3, file) == (size_t)width * 3;
+
+		ok = fclose(file) == 0 && ok;
+		return ok;
+	}
+};
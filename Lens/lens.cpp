@@ -7,9 +7,19 @@
 #include <vector>
 #include <string>
 
+#include "aperture.h"
 #include "fft.h"
+#include "cpu_fft.h"
+#include "starburst.h"
+#include "starburst_cache.h"
+#include "dispersion.h"
+#include "light_sources.h"
 #include "resource.h"
 #include "ray_trace.h"
+#include "lens_pack.h"
+#include "lens_zoom.h"
+#include "profiler.h"
+#include "flare_context.h"
 
 //#define DRAW2D
 #define DRAWLENSFLARE
@@ -20,16 +30,6 @@ using namespace std;
 // ---------------------------------------------------------------------------------------------------------
 // Structs 
 // ---------------------------------------------------------------------------------------------------------
-struct PatentFormat {
-	float r;
-	float d;
-	float n;
-	bool  f;
-	float w;
-	float h;
-	float c;
-};
-
 struct GlobalData {
 	float time;
 	float spread;
@@ -41,6 +41,7 @@ struct GlobalData {
 	XMFLOAT2 backbuffer_size;
 	XMFLOAT4 direction;
 	XMFLOAT4 aperture_opening;
+	XMFLOAT4 flare_data;  // num_ghosts, light colour
 };
 
 struct PSInput {
@@ -117,6 +118,8 @@ struct UI {
 	float coating_quality = 1.25;
 	int ghost_bounce_1 = 3;
 	int ghost_bounce_2 = 1;
+	float zoom = 0.f;   // wide 0 to tele 1
+	float focus = 0.f;  // infinity 0 to closest 1
 	XMFLOAT3 direction = { 0.f, 0.f, -1.f };
 
 	bool left_mouse_down = false;
@@ -126,6 +129,8 @@ struct UI {
 	bool editing_no_blades = false;
 	bool editing_spread = false;
 	bool editing_coating_quality = false;
+	bool editing_zoom = false;
+	bool editing_focus = false;
 	bool overlay_wireframe = false;
 	bool aperture_needs_updating = true;
 	bool draw2d = true;
@@ -141,52 +146,62 @@ struct LensDescription {
 	const float Bf = 39.683f;
 	const int nikon_aperture_id = 14;
 
+	// Where the variable gaps are used and how zoom and focus move them. The tele end and the
+	// focus travel are illustrative, they keep the groups apart over the whole range
+	vector<LensGap> nikon_gaps = {
+		{ "d6",  {  5 }, d6,  14.000f, 2.5f },
+		{ "d10", {  9 }, d10,  2.500f, 0.f },
+		{ "d14", { 13 }, d14,  6.000f, 0.f },
+		{ "d20", { 20 }, d20,  5.000f, 0.f },
+		{ "Bf",  { 27 }, Bf,  62.000f, 0.f },
+	};
+
 	vector<PatentFormat> nikon_28_75mm = {
-		{    72.747f,  2.300f, 1.60300f, false, 0.2f, 29.0f, 530 },
-		{    37.000f, 13.000f, 1.00000f, false, 0.2f, 29.0f, 600 },
+		{    72.747f,  2.300f, 1.60300f, false, 0.2f, 29.0f, 530, 65.44f },
+		{    37.000f, 13.000f, 1.00000f, false, 0.2f, 29.0f, 600, 0.f },
 
-		{  -172.809f,  2.100f, 1.58913f, false, 2.7f, 26.2f, 570 },
-		{    39.894f,  1.000f, 1.00000f, false, 2.7f, 26.2f, 660 },
+		{  -172.809f,  2.100f, 1.58913f, false, 2.7f, 26.2f, 570, 61.14f },
+		{    39.894f,  1.000f, 1.00000f, false, 2.7f, 26.2f, 660, 0.f },
 
-		{    49.820f,  4.400f, 1.86074f, false, 0.5f, 20.0f, 330 },
-		{    74.750f,      d6, 1.00000f, false, 0.5f, 20.0f, 544 },
+		{    49.820f,  4.400f, 1.86074f, false, 0.5f, 20.0f, 330, 23.06f },
+		{    74.750f,      d6, 1.00000f, false, 0.5f, 20.0f, 544, 0.f },
 
-		{    63.402f,  1.600f, 1.86074f, false, 0.5f, 16.1f, 740 },
-		{    37.530f,  8.600f, 1.51680f, false, 0.5f, 16.1f, 411 },
+		{    63.402f,  1.600f, 1.86074f, false, 0.5f, 16.1f, 740, 23.06f },
+		{    37.530f,  8.600f, 1.51680f, false, 0.5f, 16.1f, 411, 64.17f },
 
-		{   -75.887f,  1.600f, 1.80458f, false, 0.5f, 16.0f, 580 },
-		{   -97.792f,     d10, 1.00000f, false, 0.5f, 16.5f, 730 },
+		{   -75.887f,  1.600f, 1.80458f, false, 0.5f, 16.0f, 580, 25.42f },
+		{   -97.792f,     d10, 1.00000f, false, 0.5f, 16.5f, 730, 0.f },
 
-		{    96.034f,  3.600f, 1.62041f, false, 0.5f, 18.0f, 700 },
-		{   261.743f,  0.100f, 1.00000f, false, 0.5f, 18.0f, 440 },
+		{    96.034f,  3.600f, 1.62041f, false, 0.5f, 18.0f, 700, 60.32f },
+		{   261.743f,  0.100f, 1.00000f, false, 0.5f, 18.0f, 440, 0.f },
 
-		{    54.262f,  6.000f, 1.69680f, false, 0.5f, 18.0f, 800 },
-		{ -5995.277f,     d14, 1.00000f, false, 0.5f, 18.0f, 300 },
+		{    54.262f,  6.000f, 1.69680f, false, 0.5f, 18.0f, 800, 55.53f },
+		{ -5995.277f,     d14, 1.00000f, false, 0.5f, 18.0f, 300, 0.f },
 
-		{       0.0f,     dAp, 1.00000f, true,  18.f, UI.aperture_opening, 440 },
+		{       0.0f,     dAp, 1.00000f, true,  18.f, UI.aperture_opening, 440, 0.f },
 
-		{   -74.414f,  2.200f, 1.90265f, false, 0.5f, 13.0f, 500 },
+		{   -74.414f,  2.200f, 1.90265f, false, 0.5f, 13.0f, 500, 35.70f },
 
-		{   -62.929f,  1.450f, 1.51680f, false, 0.1f, 13.0f, 770 },
-		{   121.380f,  2.500f, 1.00000f, false, 4.0f, 13.1f, 820 },
+		{   -62.929f,  1.450f, 1.51680f, false, 0.1f, 13.0f, 770, 64.17f },
+		{   121.380f,  2.500f, 1.00000f, false, 4.0f, 13.1f, 820, 0.f },
 
-		{   -85.723f,  1.400f, 1.49782f, false, 4.0f, 13.0f, 200 },
+		{   -85.723f,  1.400f, 1.49782f, false, 4.0f, 13.0f, 200, 82.56f },
 
-		{    31.093f,  2.600f, 1.80458f, false, 4.0f, 13.1f, 540 },
-		{    84.758f,     d20, 1.00000f, false, 0.5f, 13.0f, 580 },
+		{    31.093f,  2.600f, 1.80458f, false, 4.0f, 13.1f, 540, 25.42f },
+		{    84.758f,     d20, 1.00000f, false, 0.5f, 13.0f, 580, 0.f },
 
-		{   459.690f,  1.400f, 1.86074f, false, 1.0f, 15.0f, 533 },
+		{   459.690f,  1.400f, 1.86074f, false, 1.0f, 15.0f, 533, 23.06f },
 
-		{    40.240f,  7.300f, 1.49782f, false, 1.0f, 15.0f, 666 },
-		{   -49.771f,  0.100f, 1.00000f, false, 1.0f, 15.2f, 500 },
+		{    40.240f,  7.300f, 1.49782f, false, 1.0f, 15.0f, 666, 82.56f },
+		{   -49.771f,  0.100f, 1.00000f, false, 1.0f, 15.2f, 500, 0.f },
 
-		{    62.369f,  7.000f, 1.67025f, false, 1.0f, 16.0f, 487 },
-		{   -76.454f,  5.200f, 1.00000f, false, 1.0f, 16.0f, 671 },
+		{    62.369f,  7.000f, 1.67025f, false, 1.0f, 16.0f, 487, 57.53f },
+		{   -76.454f,  5.200f, 1.00000f, false, 1.0f, 16.0f, 671, 0.f },
 
-		{   -32.524f,  2.000f, 1.80454f, false, 0.5f, 17.0f, 487 },
-		{   -50.194f,      Bf, 1.00000f, false, 0.5f, 17.0f, 732 },
+		{   -32.524f,  2.000f, 1.80454f, false, 0.5f, 17.0f, 487, 39.59f },
+		{   -50.194f,      Bf, 1.00000f, false, 0.5f, 17.0f, 732, 0.f },
 
-		{        0.f,     5.f, 1.00000f,  true, 10.f,  10.f, 500 }
+		{        0.f,     5.f, 1.00000f,  true, 10.f,  10.f, 500, 0.f }
 	};
 
 	// Angenieux Lens
@@ -222,14 +237,17 @@ struct LensDescription {
 
 	vector<LensInterface> lens_interface;
 	vector<GhostData> ghosts;
+	vector<float> ior_table;  // (left, right) index of every interface for every spectral sample
 
 	vector<PatentFormat> lens_components = nikon_28_75mm;
+	vector<LensGap> gaps = nikon_gaps;
 	int aperture_id = nikon_aperture_id;
-	int num_of_ghosts = 352; // 27!/2*(27-2)!
 
 	//vector<PatentFormat> lens_components = angenieux;
+	//vector<LensGap> gaps;
 	//int aperture_id = angenieux_aperture_id;
-	//int num_of_ghosts = 92; // 14!/2*(14-2)!
+
+	int num_of_ghosts = 0; // every pair of reflecting interfaces, counted by ParseLensComponents
 
 	int num_of_lens_components = (int)lens_components.size();
 	int num_of_intersections_1 = num_of_lens_components + 1;
@@ -259,6 +277,73 @@ struct Application {
 	float time = 0.f;
 	float time_delta = 0.1f;
 	float global_scale = 0.009;
+
+	// Clip rays at the blade polygon in the trace instead of only masking them with the aperture
+	// texture in the pixel shader. lens.hlsl clips them like rays beyond an interface's height,
+	// the CPU flare drops their triangles
+	bool analytic_aperture = true;
+
+	// Trace the ghosts at num_spectral_samples wavelengths with the glasses' dispersion, each
+	// with its own ghost patch, instead of three wavelengths sharing one
+	bool dispersion = false;
+	int num_spectral_samples = 8;
+	SpectralSamples spectral;
+
+	// Aperture the GPU spectrum was last transformed from
+	ApertureKey spectrum_key = {};
+	bool has_spectrum = false;
+
+	// Aperture of the exact starburst in starburst_filtered. While the opening is dragged that
+	// starburst is rotated to the current opening instead of recomputed (UpdateAperture), an
+	// approximation that also turns the dust, flagged by starburst_approximate until it settles
+	ApertureKey starburst_key = {};
+	bool has_starburst = false;
+	bool starburst_approximate = false;
+
+	// Starbursts are cached by aperture (starburst_cache.h). An empty directory keeps them in
+	// memory only, a shared one lets later sessions map them back. The (blades, opening) pairs
+	// are rendered into the cache at startup
+	string starburst_cache_directory = "";
+	vector<XMFLOAT2> starburst_prewarm;
+	uint64_t dust_hash = 0;
+
+	// Generate the aperture (aperture.h) and the starburst (starburst.h) on the CPU and upload
+	// them instead of running PSAperture and the FFT / starburst shaders
+	bool cpu_aperture = false;
+	bool cpu_starburst = false;
+	vector<float> dust;  // r channel of the dust texture, what PSAperture samples
+
+	// Lights the flare is drawn for (light_sources.h), SetFlareLights after changing them. When
+	// empty the mouse controlled light is drawn with light_temperature, planned again only when
+	// it moves. A PFM flare_plate fills them with its bright sources at startup. Lights are
+	// planned into at most max_flare_traces traced directions, all traced in one dispatch and
+	// drawn in one draw
+	string flare_plate = "";
+	int max_flare_lights = 1024;
+	int max_flare_traces = 8;
+	float light_temperature = 6000.f;
+	vector<SceneLight> scene_lights;
+	vector<SceneLight> mouse_light = vector<SceneLight>(1);
+	bool mouse_light_planned = false;
+	FlarePlanner flare_planner;
+	vector<FlareTrace> flare_traces;
+	vector<FlareLight> flare_lights;
+
+	// Lens to draw from a compiled lens pack (lens_pack.h) instead of Lens.lens_components. A
+	// pack that does not open yet is compiled from the lens_prescriptions text files first
+	string lens_pack = "";
+	string lens_name = "";
+	vector<string> lens_prescriptions;
+	LensPack pack;
+
+	// P starts a capture of the profiler (profiler.h) and stops it again, writing the Chrome
+	// trace to profile_output.json and the summary to profile_output.txt
+	string profile_output = "lens_profile";
+
+	// T traces the lens and lights on the CPU recording where and why every ray ends, and
+	// writes the ray_stats.h report ranking the ghosts to ray_report_output
+	string ray_report_output = "lens_rays.txt";
+
 } App;
 
 struct Win {
@@ -302,6 +387,7 @@ struct Textures {
 	ID3D11Texture2D*           aperture = nullptr;
 	ID3D11Texture2D*           starburst = nullptr;
 	ID3D11Texture2D*           starburst_filtered = nullptr;
+	ID3D11Texture2D*           starburst_staging = nullptr;
 	ID3D11Texture2D*           aperture_depthbuffer = nullptr;
 	ID3D11Texture2D*           depthbuffer = nullptr;
 
@@ -411,11 +497,24 @@ struct Textures {
 		CreateTexture((int)App.starburst_resolution, (int)App.starburst_resolution, DXGI_FORMAT_R16G16B16A16_FLOAT, starburst, starburst_sr_view, starburst_rt_view);
 		CreateTexture((int)App.starburst_resolution, (int)App.starburst_resolution, DXGI_FORMAT_R16G16B16A16_FLOAT, starburst_filtered, starburst_filtered_sr_view, starburst_filtered_rt_view);
 
+		// CPU copy of starburst_filtered for the starburst cache
+		D3D11_TEXTURE2D_DESC staging_desc;
+		starburst_filtered->GetDesc(&staging_desc);
+		staging_desc.Usage = D3D11_USAGE_STAGING;
+		staging_desc.BindFlags = 0;
+		staging_desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+		Win.d3d_device->CreateTexture2D(&staging_desc, nullptr, &starburst_staging);
+
 		// Load the dust texture from the application
 		HBITMAP bitmap = LoadBitmap(Win.g_hInst, MAKEINTRESOURCE(IDB_BITMAP1));
 		int size = int(App.dust_resolution * App.dust_resolution * 4);
 		void* bitmap_data = malloc(size);
 		GetBitmapBits(bitmap, size, bitmap_data);
+		App.dust_hash = HashBytes(bitmap_data, size);
+
+		App.dust.resize(size / 4);
+		for (size_t i = 0; i < App.dust.size(); ++i)
+			App.dust[i] = ((unsigned char*)bitmap_data)[i * 4] / 255.f;
 
 		D3D11_SUBRESOURCE_DATA resource_data;
 		resource_data.pSysMem = bitmap_data;
@@ -446,6 +545,7 @@ struct Shaders {
 	ID3D11ComputeShader* cs_fft_row = nullptr;
 	ID3D11ComputeShader* cs_fft_col = nullptr;
 	ID3D11ComputeShader* cs_fft_copy = nullptr;
+	ID3D11ComputeShader* cs_fft_pack = nullptr;
 
 	ID3D11PixelShader*   ps_aperture;
 
@@ -481,12 +581,18 @@ struct Shaders {
 		string num_groups_string = to_string(App.num_groups);
 		string num_threads_string = to_string(App.num_threads);
 		string patch_tesselation_string = to_string(App.patch_tesselation);
+		string aperture_test_string = to_string((int)App.analytic_aperture);
+		string num_wavelengths_string = to_string(App.spectral.wavelengths.size());
+		string dispersion_string = to_string((int)App.dispersion);
 
 		D3D_SHADER_MACRO lens_defines[] = {
 			"AP_IDX", aperture_id_string.c_str(),
 			"NUM_GROUPS", num_groups_string.c_str(),
 			"NUM_THREADS", num_threads_string.c_str(),
-			"PATCH_TESSELATION", patch_tesselation_string.c_str(), 0, 0 };
+			"PATCH_TESSELATION", patch_tesselation_string.c_str(),
+			"APERTURE_TEST", aperture_test_string.c_str(),
+			"NUM_WAVELENGTHS", num_wavelengths_string.c_str(),
+			"DISPERSION", dispersion_string.c_str(), 0, 0 };
 		CompileShaderFromFile(L"lens.hlsl", "VS", "vs_5_0", &blob, lens_defines);
 		Win.d3d_device->CreateVertexShader(blob->GetBufferPointer(), blob->GetBufferSize(), nullptr, &vs_lens_flare);
 		Win.d3d_device->CreateInputLayout(layout, numElements, blob->GetBufferPointer(), blob->GetBufferSize(), &Win.d3d_vertex_layout_3d);
@@ -496,12 +602,12 @@ struct Shaders {
 		Win.d3d_device->CreatePixelShader(blob->GetBufferPointer(), blob->GetBufferSize(), nullptr, &ps_lens_flare);
 		blob->Release();	
 
-		D3D_SHADER_MACRO debug_flags[] = { lens_defines[0], lens_defines[1], lens_defines[2], lens_defines[3], "DEBUG_VALUES", "", 0, 0 };
+		D3D_SHADER_MACRO debug_flags[] = { lens_defines[0], lens_defines[1], lens_defines[2], lens_defines[3], lens_defines[4], lens_defines[5], lens_defines[6], "DEBUG_VALUES", "", 0, 0 };
 		CompileShaderFromFile(L"lens.hlsl", "PS", "ps_5_0", &blob, debug_flags);
 		Win.d3d_device->CreatePixelShader(blob->GetBufferPointer(), blob->GetBufferSize(), nullptr, &ps_lens_flare_debug);
 		blob->Release();
 
-		D3D_SHADER_MACRO wireframe_debug_flags[] = { lens_defines[0], lens_defines[1], lens_defines[2], lens_defines[3], "DEBUG_WIREFRAME", "", 0, 0 };
+		D3D_SHADER_MACRO wireframe_debug_flags[] = { lens_defines[0], lens_defines[1], lens_defines[2], lens_defines[3], lens_defines[4], lens_defines[5], lens_defines[6], "DEBUG_WIREFRAME", "", 0, 0 };
 		CompileShaderFromFile(L"lens.hlsl", "PS", "ps_5_0", &blob, wireframe_debug_flags);
 		Win.d3d_device->CreatePixelShader(blob->GetBufferPointer(), blob->GetBufferSize(), nullptr, &ps_lens_flare_wireframe);
 		blob->Release();
@@ -545,6 +651,8 @@ struct Shaders {
 		D3D_SHADER_MACRO fft_defines_row[] = {
 			"LENGTH", resolution_string.c_str(),
 			"BUTTERFLY_COUNT", butterfly_string.c_str(),
+			"FFT_TYPE", "float",
+			"PACKED_INPUT", "",
 			"ROWPASS", "", 0, 0 };
 		CompileShaderFromFile(L"fft.hlsl", "ButterflySLM", "cs_5_0", &blob, fft_defines_row);
 		Win.d3d_device->CreateComputeShader(blob->GetBufferPointer(), blob->GetBufferSize(), nullptr, &cs_fft_row);
@@ -553,11 +661,17 @@ struct Shaders {
 		D3D_SHADER_MACRO fft_defines_col[] = {
 			"LENGTH", resolution_string.c_str(),
 			"BUTTERFLY_COUNT", butterfly_string.c_str(),
+			"FFT_TYPE", "float",
+			"PACKED_INPUT", "",
 			"ROWCOL", "", 0, 0 };
 		CompileShaderFromFile(L"fft.hlsl", "ButterflySLM", "cs_5_0", &blob, fft_defines_col);
 		Win.d3d_device->CreateComputeShader(blob->GetBufferPointer(), blob->GetBufferSize(), nullptr, &cs_fft_col);
 		blob->Release();
 
+		CompileShaderFromFile(L"fft.hlsl", "PackRealPairCS", "cs_5_0", &blob, fft_defines_col);
+		Win.d3d_device->CreateComputeShader(blob->GetBufferPointer(), blob->GetBufferSize(), nullptr, &cs_fft_pack);
+		blob->Release();
+
 		CompileShaderFromFile(L"copy.hlsl", "CopyTextureCS", "cs_5_0", &blob);
 		Win.d3d_device->CreateComputeShader(blob->GetBufferPointer(), blob->GetBufferSize(), nullptr, &cs_fft_copy);
 		blob->Release();
@@ -576,9 +690,19 @@ struct Buffers {
 	ID3D11Buffer* intersection_points2 = nullptr;
 	ID3D11Buffer* intersection_points3 = nullptr;
 	ID3D11Buffer* lens_interface = nullptr;
+	ID3D11Buffer* flare_lights = nullptr;
+	ID3D11Buffer* flare_traces = nullptr;
+	ID3D11Buffer* spectral_samples = nullptr;
+	ID3D11Buffer* interface_ior = nullptr;
+	ID3D11Buffer* starburst_palette = nullptr;
 
 	ID3D11UnorderedAccessView* ghostdata_view;
 	ID3D11UnorderedAccessView* lensInterface_view;
+	ID3D11ShaderResourceView* flare_lights_view;
+	ID3D11ShaderResourceView* flare_traces_view;
+	ID3D11ShaderResourceView* spectral_samples_view;
+	ID3D11ShaderResourceView* interface_ior_view;
+	ID3D11ShaderResourceView* starburst_palette_view;
 
 	void CreateBuffer(ID3D11Buffer** buffer, UINT size, UINT struct_size, D3D11_BIND_FLAG bind_flag,
 		D3D11_RESOURCE_MISC_FLAG misc_flag, void* init_data_ptr) {
@@ -631,6 +755,30 @@ struct Buffers {
 
 		CreateUAView(ghostdata, &ghostdata_view, Lens.num_of_ghosts);
 		CreateUAView(lens_interface, &lensInterface_view, (UINT)Lens.lens_interface.size());
+
+		CreateBuffer(&flare_lights, App.max_flare_lights, sizeof(FlareLight), D3D11_BIND_SHADER_RESOURCE, D3D11_RESOURCE_MISC_BUFFER_STRUCTURED, 0);
+		CreateSRView(flare_lights, &flare_lights_view, App.max_flare_lights);
+		CreateBuffer(&flare_traces, App.max_flare_traces, sizeof(FlareTrace), D3D11_BIND_SHADER_RESOURCE, D3D11_RESOURCE_MISC_BUFFER_STRUCTURED, 0);
+		CreateSRView(flare_traces, &flare_traces_view, App.max_flare_traces);
+
+		// wavelength and rgb per sample, and the ior table, for lens.hlsl
+		UINT num_wavelengths = (UINT)App.spectral.wavelengths.size();
+		vector<XMFLOAT4> samples(num_wavelengths);
+		for (UINT w = 0; w < num_wavelengths; ++w)
+			samples[w] = XMFLOAT4(App.spectral.wavelengths[w], App.spectral.rgb[w * 3 + 0], App.spectral.rgb[w * 3 + 1], App.spectral.rgb[w * 3 + 2]);
+		CreateBuffer(&spectral_samples, num_wavelengths, sizeof(XMFLOAT4), D3D11_BIND_SHADER_RESOURCE, D3D11_RESOURCE_MISC_BUFFER_STRUCTURED, &samples[0]);
+		CreateBuffer(&interface_ior, (UINT)Lens.ior_table.size() / 2, sizeof(XMFLOAT2), D3D11_BIND_SHADER_RESOURCE, D3D11_RESOURCE_MISC_BUFFER_STRUCTURED, &Lens.ior_table[0]);
+		CreateSRView(spectral_samples, &spectral_samples_view, num_wavelengths);
+		CreateSRView(interface_ior, &interface_ior_view, (UINT)Lens.ior_table.size() / 2);
+
+		// Both starburst palettes, one after the other
+		vector<XMFLOAT4> palette;
+		for (int i = 0; i < SpectralColor.num_starburst_steps; ++i)
+			palette.push_back(XMFLOAT4(SpectralColor.starburst_palette[i * 3 + 0], SpectralColor.starburst_palette[i * 3 + 1], SpectralColor.starburst_palette[i * 3 + 2], 0.f));
+		for (int i = 0; i < SpectralColor.num_filter_steps; ++i)
+			palette.push_back(XMFLOAT4(SpectralColor.filter_palette[i * 3 + 0], SpectralColor.filter_palette[i * 3 + 1], SpectralColor.filter_palette[i * 3 + 2], 0.f));
+		CreateBuffer(&starburst_palette, (UINT)palette.size(), sizeof(XMFLOAT4), D3D11_BIND_SHADER_RESOURCE, D3D11_RESOURCE_MISC_BUFFER_STRUCTURED, &palette[0]);
+		CreateSRView(starburst_palette, &starburst_palette_view, (UINT)palette.size());
 	}
 } Buffers;
 
@@ -774,6 +922,11 @@ struct GPUQueries {
 	ID3D11Query* lensflare_compute_end;
 	ID3D11Query* lensflare_draw_start;
 	ID3D11Query* lensflare_draw_end;
+	ID3D11Query* tonemap_start;
+	ID3D11Query* tonemap_end;
+
+	// Profiler clock when frame_start was issued, where the GPU spans are placed
+	int64_t cpu_frame_start = 0;
 
 	void InitQueries() {
 		D3D11_QUERY_DESC time_stamp = { D3D11_QUERY_TIMESTAMP, 0 };
@@ -790,6 +943,8 @@ struct GPUQueries {
 		Win.d3d_device->CreateQuery(&time_stamp, &lensflare_compute_end);
 		Win.d3d_device->CreateQuery(&time_stamp, &lensflare_draw_start);
 		Win.d3d_device->CreateQuery(&time_stamp, &lensflare_draw_end);
+		Win.d3d_device->CreateQuery(&time_stamp, &tonemap_start);
+		Win.d3d_device->CreateQuery(&time_stamp, &tonemap_end);
 	}
 
 	static void PrintGPUTimes(GPUQueries& queries) {
@@ -801,6 +956,7 @@ struct GPUQueries {
 		Win.d3d_context->GetData(queries.disjoint, &disjoint_data, sizeof(disjoint_data), 0);
 
 		UINT64 frame_start, frame_end, aperture_start, aperture_end, starburst_start, starburst_end, compute_start, compute_end, draw_start, draw_end = 0;
+		UINT64 tonemap_start = 0, tonemap_end = 0;
 		Win.d3d_context->GetData(queries.frame_start, &frame_start, sizeof(UINT64), 0);
 		Win.d3d_context->GetData(queries.frame_end, &frame_end, sizeof(UINT64), 0);
 		Win.d3d_context->GetData(queries.aperture_start, &aperture_start, sizeof(UINT64), 0);
@@ -811,6 +967,8 @@ struct GPUQueries {
 		Win.d3d_context->GetData(queries.lensflare_compute_end, &compute_end, sizeof(UINT64), 0);
 		Win.d3d_context->GetData(queries.lensflare_draw_start, &draw_start, sizeof(UINT64), 0);
 		Win.d3d_context->GetData(queries.lensflare_draw_end, &draw_end, sizeof(UINT64), 0);
+		Win.d3d_context->GetData(queries.tonemap_start, &tonemap_start, sizeof(UINT64), 0);
+		Win.d3d_context->GetData(queries.tonemap_end, &tonemap_end, sizeof(UINT64), 0);
 
 		float denum = float(disjoint_data.Frequency) / 1000.f;
 		float ms_frame = float(frame_end - frame_start) / denum;
@@ -822,6 +980,21 @@ struct GPUQueries {
 		PerformanceData updated_performance_data = { ms_frame, ms_compute, ms_draw, ms_aperture + ms_startburst };
 		Win.d3d_context->UpdateSubresource(Buffers.performance_data, 0, nullptr, &updated_performance_data, 0, 0);
 
+		// The same spans on the profiler's GPU track, the aperture and starburst only when they
+		// were drawn this frame
+		if (Profiler.enabled && !disjoint_data.Disjoint) {
+			ProfileLog& gpu = Profiler.Track("GPU");
+			auto at = [&](UINT64 t) { return queries.cpu_frame_start + (int64_t)((double)(t - frame_start) * 1e9 / (double)disjoint_data.Frequency); };
+			int32_t frame = Profiler.AddSpan(gpu, "frame", at(frame_start), at(frame_end));
+			if (aperture_start >= frame_start && aperture_end <= frame_end)
+				Profiler.AddSpan(gpu, "aperture", at(aperture_start), at(aperture_end), frame);
+			if (starburst_start >= frame_start && starburst_end <= frame_end)
+				Profiler.AddSpan(gpu, "starburst", at(starburst_start), at(starburst_end), frame);
+			Profiler.AddSpan(gpu, "lens flare trace", at(compute_start), at(compute_end), frame);
+			Profiler.AddSpan(gpu, "lens flare raster", at(draw_start), at(draw_end), frame);
+			Profiler.AddSpan(gpu, "tonemap", at(tonemap_start), at(tonemap_end), frame);
+		}
+
 	}
 
 } GPUQueries;
@@ -841,6 +1014,7 @@ struct Shapes {
 
 	struct RayBundle {
 		int subdiv;
+		int num_traces;  // traces of every ghost cs_vertices has room for
 		ID3D11Buffer* indices;
 		ID3D11Buffer* cs_vertices;
 		ID3D11Buffer* cs_group_count_info;
@@ -973,11 +1147,12 @@ struct Shapes {
 
 		RayBundle bundle_data;
 		bundle_data.subdiv = subdiv;
+		bundle_data.num_traces = 1;
 
 		int num_of_indices = (subdiv - 1) * (subdiv - 1) * num_patches * 6;
 		int num_of_vertices = (subdiv * subdiv) * num_patches;
 		void* vertex_data = malloc(sizeof(PSInput) * num_of_vertices);
-		CSIndirectData group_count_info = { (unsigned)Lens.num_of_ghosts * App.num_groups, (unsigned)App.num_groups, 3 };
+		CSIndirectData group_count_info = { (unsigned)Lens.num_of_ghosts * App.num_groups, (unsigned)App.num_groups, (unsigned)App.spectral.wavelengths.size() };
 
 		Buffers.CreateBuffer(&bundle_data.indices, num_of_indices, sizeof(unsigned int), D3D11_BIND_INDEX_BUFFER, Buffers.DEFAULT_MISC_FLAG, &indices[0]);
 		Buffers.CreateBuffer(&bundle_data.cs_vertices, num_of_vertices, sizeof(PSInput), Buffers.D3D11_BIND_SR_OR_UA_FLAG, D3D11_RESOURCE_MISC_BUFFER_STRUCTURED, vertex_data);
@@ -996,7 +1171,29 @@ struct Shapes {
 	void InitShapes() {
 		unit_square = CreateUnitSquare();
 		unit_circle = CreateUnitCircle();
-		ray_bundle = CreateRayBundle(App.patch_tesselation, Lens.num_of_ghosts);
+		ray_bundle = CreateRayBundle(App.patch_tesselation, Lens.num_of_ghosts * SpectralPatches());
+	}
+
+	// Ghost patches of one trace for each ghost, one per wavelength with dispersion
+	int SpectralPatches() {
+		return App.dispersion ? (int)App.spectral.wavelengths.size() : 1;
+	}
+
+	// Traces are stored one after the other, each with the vertices of every ghost. The bundle
+	// only grows, one trace is the usual single light case
+	void ReserveRayBundleTraces(int num_traces) {
+		if (num_traces <= ray_bundle.num_traces)
+			return;
+
+		ray_bundle.vertices_resource_view->Release();
+		ray_bundle.ua_vertices_resource_view->Release();
+		ray_bundle.cs_vertices->Release();
+
+		UINT num_of_vertices = ray_bundle.subdiv * ray_bundle.subdiv * Lens.num_of_ghosts * SpectralPatches() * num_traces;
+		Buffers.CreateBuffer(&ray_bundle.cs_vertices, num_of_vertices, sizeof(PSInput), Buffers.D3D11_BIND_SR_OR_UA_FLAG, D3D11_RESOURCE_MISC_BUFFER_STRUCTURED, nullptr);
+		Buffers.CreateSRView(ray_bundle.cs_vertices, &ray_bundle.vertices_resource_view, num_of_vertices);
+		Buffers.CreateUAView(ray_bundle.cs_vertices, &ray_bundle.ua_vertices_resource_view, num_of_vertices);
+		ray_bundle.num_traces = num_traces;
 	}
 } Shapes;
 
@@ -1010,46 +1207,84 @@ void UpdateLensComponents() {
 	Win.d3d_context->UpdateSubresource(Buffers.lens_interface, 0, &box, &aperture_component, 0, 0);
 }
 
-void ParseLensComponents() {
-	// Parse the lens components into the LensInterface the ray_trace routine expects
-	Lens.lens_interface.resize(Lens.num_of_lens_components);
-	for (int i = Lens.num_of_lens_components - 1; i >= 0; --i) {
-		PatentFormat& entry = Lens.lens_components[i];
-		Lens.total_lens_distance += entry.d;
-
-		float left_ior = i == 0 ? 1.f : Lens.lens_components[i - 1].n;
-		float right_ior = entry.n;
-
-		if (right_ior != 1.f) {
-			Lens.min_ior = min(Lens.min_ior, right_ior);
-			Lens.max_ior = max(Lens.max_ior, right_ior);
-		}
+bool LoadLensPack(LensView& view) {
+	if (App.lens_pack.empty() || App.lens_name.empty())
+		return false;
 
-		vec3 center = { 0.f, 0.f, Lens.total_lens_distance - entry.r };
-		vec3 n = { left_ior, 1.f, right_ior };
+	if (!App.pack.Open(App.lens_pack)) {
+		vector<LensPrescription> prescriptions(App.lens_prescriptions.size());
+		for (size_t i = 0; i < prescriptions.size(); ++i)
+			if (!prescriptions[i].Load(App.lens_prescriptions[i]))
+				return false;
 
-		LensInterface component = { center, entry.r, n, entry.h, entry.c, (float)entry.f, Lens.total_lens_distance, entry.w };
-		Lens.lens_interface[i] = component;
+		if (!LensPack::Compile(prescriptions, App.lens_pack) || !App.pack.Open(App.lens_pack))
+			return false;
 	}
 
-	// Enumerate all possible ghosts of the lens system
-	int bounce1 = 2;
-	int bounce2 = 1;
-	int ghost_index = 0;
-	Lens.ghosts.resize(Lens.num_of_ghosts);
-	while (true) {
-		if (bounce1 >= (int)(Lens.lens_interface.size() - 1)) {
-			bounce2++;
-			bounce1 = bounce2 + 1;
-		}
+	return App.pack.Find(App.lens_name, view);
+}
 
-		if (bounce2 >= (int)(Lens.lens_interface.size() - 1)) {
-			break;
-		}
+// Moves the gaps to UI.zoom and UI.focus, uploading only the interfaces that moved
+void UpdateLensGaps() {
+	PROFILE_SCOPE("lens gaps");
+	LensChange change = MoveLensGaps(Lens.gaps, UI.zoom, UI.focus, Lens.lens_components, Lens.lens_interface);
+	if (change.num_moved == 0)
+		return;
+
+	Lens.total_lens_distance += change.shift;
+	D3D11_BOX box = { 0, 0, 0, change.num_moved * sizeof(LensInterface), 1, 1 };
+	Win.d3d_context->UpdateSubresource(Buffers.lens_interface, 0, &box, Lens.lens_interface.data(), 0, 0);
+	PROFILE_COUNT("bytes uploaded", change.num_moved * sizeof(LensInterface));
+}
 
-		Lens.ghosts[ghost_index] = XMFLOAT4((float)bounce1, (float)bounce2, 0, 0);
-		bounce1++;
-		ghost_index++;
+void ParseLensComponents() {
+	PROFILE_SCOPE("lens parse");
+
+	// Parse the lens components into the LensInterface the ray_trace routine expects, or take
+	// them and the ghosts as compiled into the lens pack
+	LensView view;
+	if (LoadLensPack(view)) {
+		const LensPackEntry& lens = *view.entry;
+		Lens.lens_components.assign(view.components, view.components + lens.num_components);
+		Lens.gaps = view.Gaps();
+		Lens.lens_interface.assign(view.interfaces, view.interfaces + lens.num_components);
+		Lens.ghosts.assign((const GhostData*)view.ghosts, (const GhostData*)view.ghosts + lens.num_ghosts);
+		Lens.aperture_id = lens.aperture_id;
+		Lens.total_lens_distance = lens.total_lens_distance;
+		Lens.min_ior = lens.min_ior;
+		Lens.max_ior = lens.max_ior;
+	} else {
+		LensGeometry geometry;
+		geometry.Build(Lens.lens_components);
+		Lens.lens_interface = geometry.interfaces;
+		Lens.ghosts.assign((const GhostData*)geometry.ghosts.data(), (const GhostData*)geometry.ghosts.data() + geometry.NumGhosts());
+		Lens.total_lens_distance = geometry.total_lens_distance;
+		Lens.min_ior = geometry.min_ior;
+		Lens.max_ior = geometry.max_ior;
+	}
+
+	Lens.lens_interface[Lens.aperture_id].sa = UI.aperture_opening;
+	Lens.num_of_ghosts = (int)Lens.ghosts.size();
+	Lens.num_of_lens_components = (int)Lens.lens_components.size();
+	Lens.num_of_intersections_1 = Lens.num_of_lens_components + 1;
+	Lens.num_of_intersections_2 = Lens.num_of_lens_components + 1;
+	Lens.num_of_intersections_3 = Lens.num_of_lens_components + 1;
+
+	// Indices depend on the spectral samples so they are built here rather than in the pack
+	App.spectral.Init(App.num_spectral_samples, App.dispersion);
+	int num_wavelengths = (int)App.spectral.wavelengths.size();
+	Lens.ior_table.resize(Lens.num_of_lens_components * num_wavelengths * 2);
+
+	for (int i = 0; i < Lens.num_of_lens_components; ++i) {
+		float left_ior = Lens.lens_interface[i].n.x;
+		float right_ior = Lens.lens_interface[i].n.z;
+		float left_abbe = i == 0 ? 0.f : Lens.lens_components[i - 1].v;
+		for (int w = 0; w < num_wavelengths; ++w) {
+			float wavelength = App.spectral.wavelengths[w];
+			float* ior = &Lens.ior_table[(i * num_wavelengths + w) * 2];
+			ior[0] = App.dispersion ? Dispersion::RefractiveIndex(left_ior, left_abbe, wavelength) : left_ior;
+			ior[1] = App.dispersion ? Dispersion::RefractiveIndex(right_ior, Lens.lens_components[i].v, wavelength) : right_ior;
+		}
 	}
 }
 
@@ -1351,8 +1586,48 @@ void DrawIntersections(ID3D11DeviceContext* context, ID3D11Buffer* buffer, vecto
 	context->Draw((int)intersections.size(), 0);
 }
 
+// Plans the lights into traces, uploads both and sizes the ray march dispatch for them
+void SetFlareLights(const vector<SceneLight>& lights) {
+	PROFILE_SCOPE("plan lights");
+	App.flare_planner.max_lights = App.max_flare_lights;
+	App.flare_planner.max_traced_directions = App.max_flare_traces;
+	App.flare_planner.Plan(lights, App.flare_traces, App.flare_lights);
+
+	Shapes.ReserveRayBundleTraces((int)App.flare_traces.size());
+
+	if (!App.flare_lights.empty()) {
+		D3D11_BOX lights_box = { 0, 0, 0, (UINT)(App.flare_lights.size() * sizeof(FlareLight)), 1, 1 };
+		D3D11_BOX traces_box = { 0, 0, 0, (UINT)(App.flare_traces.size() * sizeof(FlareTrace)), 1, 1 };
+		Win.d3d_context->UpdateSubresource(Buffers.flare_lights, 0, &lights_box, App.flare_lights.data(), 0, 0);
+		Win.d3d_context->UpdateSubresource(Buffers.flare_traces, 0, &traces_box, App.flare_traces.data(), 0, 0);
+		PROFILE_COUNT("bytes uploaded", lights_box.right + traces_box.right);
+	}
+
+	// Every (ghost, trace) pair in one dispatch: z is trace * NUM_WAVELENGTHS + wavelength
+	unsigned num_wavelengths = (unsigned)App.spectral.wavelengths.size();
+	CSIndirectData group_count_info = { (unsigned)Lens.num_of_ghosts * App.num_groups, (unsigned)App.num_groups, num_wavelengths * (unsigned)App.flare_traces.size() };
+	Win.d3d_context->UpdateSubresource(Shapes.ray_bundle.cs_group_count_info, 0, nullptr, &group_count_info, 0, 0);
+}
+
+// Scene lights from the bright sources of App.flare_plate
+void InitFlareLights() {
+	HDRImage plate;
+	if (App.flare_plate.empty() || !plate.LoadPFM(App.flare_plate))
+		return;
+
+	LightSourceExtraction extraction;
+	vector<LightSource> sources;
+	extraction.Extract(plate, sources);
+	extraction.Cluster(sources);
+
+	App.scene_lights.clear();
+	App.flare_planner.PlateLights(sources, plate.width, plate.height, App.scene_lights);
+	if (!App.scene_lights.empty())
+		SetFlareLights(App.scene_lights);
+}
+
 void UpdateGlobals() {
-	App.time += App.time_delta;
+	PROFILE_SCOPE("update globals");
 	
 	#if defined(DRAWLENSFLARE)
 		vec3 dir = normalize(vec3(-UI.x_dir, UI.y_dir, -1.f));
@@ -1366,6 +1641,14 @@ void UpdateGlobals() {
 
 	UI.direction = XMFLOAT3(dir.x, dir.y, dir.z);
 
+	SceneLight mouse_light = { { dir.x, dir.y, dir.z }, { 1.f, 1.f, 1.f }, App.light_temperature };
+	if (App.scene_lights.empty() && (!App.mouse_light_planned || !mouse_light.Same(App.mouse_light[0]))) {
+		App.mouse_light[0] = mouse_light;
+		App.mouse_light_planned = true;
+		SetFlareLights(App.mouse_light);
+	}
+
+	const float* light_color = SpectralColor.Blackbody(App.light_temperature);
 	GlobalData updated_globaldata = {
 		App.time,
 		UI.rays_spread,
@@ -1377,7 +1660,8 @@ void UpdateGlobals() {
 
 		XMFLOAT2(App.backbuffer_width, App.backbuffer_height),
 		XMFLOAT4(UI.direction.x, UI.direction.y, UI.direction.z, App.aperture_resolution),
-		XMFLOAT4(UI.aperture_opening, UI.number_of_blades, App.starburst_resolution, 0.f)
+		XMFLOAT4(UI.aperture_opening, UI.number_of_blades, App.starburst_resolution, App.has_starburst ? UI.aperture_opening - App.starburst_key.opening : 0.f),
+		XMFLOAT4((float)Lens.num_of_ghosts, light_color[0], light_color[1], light_color[2])
 	};
 
 	Win.d3d_context->UpdateSubresource(Buffers.globaldata, 0, nullptr, &updated_globaldata, 0, 0);
@@ -1405,14 +1689,18 @@ void DrawAperture() {
 void DrawStarBurst() {
 	Win.d3d_context->End(GPUQueries.starburst_start);
 
-	float clear_color[] = { 0,0,0,0 };
-	
-	// Setup input
-	FFT.CopyTextureNoStretch(Win.d3d_context, Textures.aperture_sr_view, FFT.mTextureUAV[FFT.FFTTexture_Real0], (int)App.aperture_resolution, Shaders.cs_fft_copy);
-	Win.d3d_context->ClearRenderTargetView(FFT.mRenderTargetViews[FFT.FFTTexture_Imaginary0], clear_color);
+	// The spectrum stays while the aperture does, e.g. when only the starburst resolution changed
+	ApertureKey key = { UI.number_of_blades, UI.aperture_opening };
+	if (!App.has_spectrum || !key.Same(App.spectrum_key)) {
+		// Setup input: aperture + i * dust, both real so one complex transform covers the two of them
+		FFT.PackRealPair(Win.d3d_context, Textures.aperture_sr_view, (int)App.aperture_resolution, Shaders.cs_fft_pack);
+
+		FFT.RunDispatchSLM(Win.d3d_context, 0, Shaders.cs_fft_row, (int)App.aperture_resolution);
+		FFT.RunDispatchSLM(Win.d3d_context, 1, Shaders.cs_fft_col, (int)App.aperture_resolution);
 
-	FFT.RunDispatchSLM(Win.d3d_context, 0, Shaders.cs_fft_row, (int)App.aperture_resolution);
-	FFT.RunDispatchSLM(Win.d3d_context, 1, Shaders.cs_fft_col, (int)App.aperture_resolution);
+		App.spectrum_key = key;
+		App.has_spectrum = true;
+	}
 
 	D3D11_VIEWPORT vp;
 	vp.Width = (FLOAT)App.starburst_resolution;
@@ -1425,6 +1713,7 @@ void DrawStarBurst() {
 
 	Win.d3d_context->PSSetShader(Shaders.ps_starburst_from_fft, nullptr, 0);
 	Win.d3d_context->PSSetShaderResources(1, 2, FFT.mTextureSRV);
+	Win.d3d_context->PSSetShaderResources(3, 1, &Buffers.starburst_palette_view);
 	Win.d3d_context->PSSetSamplers(0, 1, &Textures.linear_wrap_sampler);
 	Win.d3d_context->PSSetConstantBuffers(1, 1, &Buffers.globaldata);
 	DrawFullscreenQuad(Win.d3d_context, Shapes.unit_square, ColorTheme.fill1, Textures.starburst_rt_view, Textures.starburst_depth_buffer_view);
@@ -1436,6 +1725,7 @@ void DrawStarBurst() {
 	Win.d3d_context->PSSetConstantBuffers(1, 1, &Buffers.globaldata);
 	DrawFullscreenQuad(Win.d3d_context, Shapes.unit_square, ColorTheme.fill1, Textures.starburst_filtered_rt_view, Textures.starburst_depth_buffer_view);
 	Win.d3d_context->PSSetShaderResources(1, 1, Textures.null_sr_view);
+	Win.d3d_context->PSSetShaderResources(3, 1, Textures.null_sr_view);
 
 	vp.Width = (FLOAT)App.backbuffer_width;
 	vp.Height = (FLOAT)App.backbuffer_height;
@@ -1445,22 +1735,242 @@ void DrawStarBurst() {
 
 }
 
+StarburstParameters CurrentStarburstParameters() {
+	// The CPU starburst always starts from the CPU aperture, see UpdateAperture
+	int cpu_stages = (App.cpu_aperture || App.cpu_starburst ? StageCPUAperture : 0) | (App.cpu_starburst ? StageCPUStarburst : 0);
+	StarburstParameters parameters = { UI.number_of_blades, UI.aperture_opening, App.dust_hash, (int)App.aperture_resolution, (int)App.starburst_resolution, cpu_stages };
+	return parameters;
+}
+
+// Uploads a cached starburst into starburst_filtered, false if there is none
+bool LoadStarburst(const StarburstParameters& parameters) {
+	int resolution = (int)App.starburst_resolution;
+	shared_ptr<const CachedImage> image = StarburstCache.Find(parameters.Key(AssetStarburst));
+	if (!image || image->width != resolution || image->height != resolution || image->channels != 4)
+		return false;
+
+	vector<uint16_t> rescaled;
+	const uint16_t* pixels = image->pixels;
+	if (image->scale != 1.f) {
+		rescaled.resize(image->NumValues());
+		for (size_t i = 0; i < rescaled.size(); ++i)
+			rescaled[i] = FloatToHalf(HalfToFloat(pixels[i]) * image->scale);
+		pixels = rescaled.data();
+	}
+
+	Win.d3d_context->UpdateSubresource(Textures.starburst_filtered, 0, nullptr, pixels, resolution * 4 * sizeof(uint16_t), 0);
+	return true;
+}
+
+// Reads starburst_filtered back and caches it. Stalls on the GPU, so only settled apertures are stored
+void StoreStarburst(const StarburstParameters& parameters) {
+	Win.d3d_context->CopyResource(Textures.starburst_staging, Textures.starburst_filtered);
+
+	D3D11_MAPPED_SUBRESOURCE mapped;
+	if (FAILED(Win.d3d_context->Map(Textures.starburst_staging, 0, D3D11_MAP_READ, 0, &mapped)))
+		return;
+
+	int resolution = (int)App.starburst_resolution;
+	StarburstCache.StoreHalf(parameters.Key(AssetStarburst), resolution, resolution, 4, mapped.pData, mapped.RowPitch);
+	Win.d3d_context->Unmap(Textures.starburst_staging, 0);
+}
+
+struct CPUStages {
+	ApertureGenerator aperture_generator;
+	StarburstPipeline starburst;
+	vector<float> aperture, dust, mask;
+	vector<float> rgb;
+	vector<uint16_t> rgba;
+} CPUStages;
+
+// CPU equivalent of DrawAperture, also leaves the aperture and dust channels in CPUStages
+void DrawApertureCPU(const StarburstParameters& parameters) {
+	PROFILE_SCOPE("aperture (cpu)");
+	Win.d3d_context->End(GPUQueries.aperture_start);
+
+	int resolution = (int)App.aperture_resolution;
+	size_t num_pixels = (size_t)resolution * resolution;
+	vector<float>& aperture = CPUStages.aperture;
+	vector<float>& dust = CPUStages.dust;
+	vector<float>& mask = CPUStages.mask;
+
+	vector<float> rgba(num_pixels * 4);
+	shared_ptr<const CachedImage> image = StarburstCache.Find(parameters.Key(AssetApertureMask));
+	if (image && image->width == resolution && image->height == resolution && image->channels == 4) {
+		image->ToFloat(rgba.data());
+		aperture.resize(num_pixels);
+		dust.resize(num_pixels);
+		mask.resize(num_pixels);
+		for (size_t i = 0; i < num_pixels; ++i) {
+			aperture[i] = rgba[i * 4 + 0];
+			dust[i] = rgba[i * 4 + 1];
+			mask[i] = rgba[i * 4 + 2];
+		}
+	} else {
+		CPUStages.aperture_generator.Generate(parameters.number_of_blades, parameters.aperture_opening, resolution,
+			App.dust.data(), (int)App.dust_resolution, aperture, dust, mask);
+
+		for (size_t i = 0; i < num_pixels; ++i) {
+			rgba[i * 4 + 0] = aperture[i];
+			rgba[i * 4 + 1] = dust[i];
+			rgba[i * 4 + 2] = mask[i];
+			rgba[i * 4 + 3] = 1.f;
+		}
+		image = StarburstCache.Store(parameters.Key(AssetApertureMask), resolution, resolution, 4, rgba.data());
+	}
+
+	// Aperture values stay well inside the half range, the cached halfs are unscaled
+	Win.d3d_context->UpdateSubresource(Textures.aperture, 0, nullptr, image->pixels, resolution * 4 * sizeof(uint16_t), 0);
+
+	Win.d3d_context->End(GPUQueries.aperture_end);
+}
+
+// CPU equivalent of DrawStarBurst, from the aperture DrawApertureCPU left in CPUStages. The
+// spectrum is cached with the aperture it was transformed from
+void DrawStarBurstCPU(const StarburstParameters& parameters, bool store) {
+	PROFILE_SCOPE("starburst (cpu)");
+	Win.d3d_context->End(GPUQueries.starburst_start);
+
+	int size = (int)App.aperture_resolution;
+	int resolution = (int)App.starburst_resolution;
+	StarburstPipeline& pipeline = CPUStages.starburst;
+
+	ApertureKey key = { parameters.number_of_blades, parameters.aperture_opening };
+	if (pipeline.NeedsSpectrum(key)) {
+		RealPairSpectrum& spectrum = pipeline.spectrum;
+		uint64_t spectrum_key = parameters.Key(AssetSpectrum);
+		shared_ptr<const CachedImage> image = StarburstCache.Find(spectrum_key);
+
+		if (image && image->width == size / 2 + 1 && image->height == size && image->channels == 4) {
+			vector<float> values(image->NumValues());
+			image->ToFloat(values.data());
+			spectrum.Resize(size, size);
+			for (size_t i = 0; i < spectrum.a_re.size(); ++i) {
+				spectrum.a_re[i] = values[i * 4 + 0];
+				spectrum.a_im[i] = values[i * 4 + 1];
+				spectrum.b_re[i] = values[i * 4 + 2];
+				spectrum.b_im[i] = values[i * 4 + 3];
+			}
+			pipeline.UseSpectrum(key);
+		} else {
+			pipeline.SetSpectrum(key, CPUStages.aperture.data(), CPUStages.dust.data(), size);
+
+			vector<float> values(spectrum.a_re.size() * 4);
+			for (size_t i = 0; i < spectrum.a_re.size(); ++i) {
+				values[i * 4 + 0] = spectrum.a_re[i];
+				values[i * 4 + 1] = spectrum.a_im[i];
+				values[i * 4 + 2] = spectrum.b_re[i];
+				values[i * 4 + 3] = spectrum.b_im[i];
+			}
+			StarburstCache.Store(spectrum_key, spectrum.half_width, spectrum.height, 4, values.data());
+		}
+	}
+
+	vector<float>& rgb = CPUStages.rgb;
+	vector<uint16_t>& rgba = CPUStages.rgba;
+	pipeline.Render(resolution, rgb);
+
+	size_t num_pixels = (size_t)resolution * resolution;
+	rgba.resize(num_pixels * 4);
+	for (size_t i = 0; i < num_pixels; ++i) {
+		rgba[i * 4 + 0] = FloatToHalf(rgb[i * 3 + 0]);
+		rgba[i * 4 + 1] = FloatToHalf(rgb[i * 3 + 1]);
+		rgba[i * 4 + 2] = FloatToHalf(rgb[i * 3 + 2]);
+		rgba[i * 4 + 3] = FloatToHalf(1.f);
+	}
+
+	size_t pitch = resolution * 4 * sizeof(uint16_t);
+	Win.d3d_context->UpdateSubresource(Textures.starburst_filtered, 0, nullptr, rgba.data(), (UINT)pitch, 0);
+	if (store)
+		StarburstCache.StoreHalf(parameters.Key(AssetStarburst), resolution, resolution, 4, rgba.data(), pitch);
+
+	Win.d3d_context->End(GPUQueries.starburst_end);
+}
+
+// Aperture and starburst for the UI aperture, the starburst from the cache when it is there.
+// While the aperture is being edited (not settled) and the blade count stays, the starburst
+// passes are skipped: VSStarburst rotates the last exact starburst to the new opening. The
+// exact one is made, and stored, once the aperture settles. Only exact starbursts are cached
+void UpdateAperture(bool settled) {
+	PROFILE_SCOPE("aperture");
+	StarburstParameters parameters = CurrentStarburstParameters();
+	ApertureKey key = { parameters.number_of_blades, parameters.aperture_opening };
+
+	if (App.cpu_aperture || App.cpu_starburst)
+		DrawApertureCPU(parameters);
+	else
+		DrawAperture();
+
+	if (!LoadStarburst(parameters)) {
+		if (!settled && App.has_starburst && key.SameShape(App.starburst_key)) {
+			PROFILE_COUNT("approximate starbursts", 1);
+			App.starburst_approximate = true;
+			UpdateGlobals();
+			return;
+		}
+
+		if (App.cpu_starburst) {
+			DrawStarBurstCPU(parameters, settled);
+		} else {
+			DrawStarBurst();
+			if (settled)
+				StoreStarburst(parameters);
+		}
+	}
+
+	App.starburst_key = key;
+	App.has_starburst = true;
+	App.starburst_approximate = false;
+	UpdateGlobals();
+}
+
+void PrewarmStarbursts() {
+	vector<StarburstParameters> list;
+	for (const XMFLOAT2& aperture : App.starburst_prewarm) {
+		StarburstParameters parameters = CurrentStarburstParameters();
+		parameters.number_of_blades = aperture.x;
+		parameters.aperture_opening = aperture.y;
+		list.push_back(parameters);
+	}
+
+	float number_of_blades = UI.number_of_blades;
+	float aperture_opening = UI.aperture_opening;
+
+	StarburstCache.Prewarm(list, [](const StarburstParameters& parameters) {
+		UI.number_of_blades = parameters.number_of_blades;
+		UI.aperture_opening = parameters.aperture_opening;
+		UpdateGlobals();
+		UpdateAperture(true);
+	});
+
+	UI.number_of_blades = number_of_blades;
+	UI.aperture_opening = aperture_opening;
+	UI.aperture_needs_updating = true;
+}
+
 // ---------------------------------------------------------------------------------------------------------
 // Render
 // ---------------------------------------------------------------------------------------------------------
 void Render() {
+	PROFILE_SCOPE("frame");
 
 	Win.d3d_context->Begin(GPUQueries.disjoint);
 	Win.d3d_context->End(GPUQueries.frame_start);
+	GPUQueries.cpu_frame_start = Profiler.Now();
 
+	App.time += App.time_delta;
 	UpdateGlobals();
 
 	if (UI.aperture_needs_updating) {
-		DrawAperture();
-		DrawStarBurst();
+		UpdateAperture(!UI.editing_aperture && !UI.editing_no_blades);
 		UI.aperture_needs_updating = false;
 	}
 
+	Win.d3d_context->CSSetShaderResources(4, 1, &Buffers.flare_traces_view);
+	Win.d3d_context->CSSetShaderResources(5, 1, &Buffers.spectral_samples_view);
+	Win.d3d_context->CSSetShaderResources(6, 1, &Buffers.interface_ior_view);
+	Win.d3d_context->VSSetShaderResources(3, 1, &Buffers.flare_lights_view);
+
 	#if defined(DRAWLENSFLARE)
 		// Setup pipeline
 		Win.d3d_context->IASetInputLayout(Win.d3d_vertex_layout_3d);
@@ -1487,7 +1997,7 @@ void Render() {
 		Win.d3d_context->CSSetShader(Shaders.cs_lens_flare, nullptr, 0);
 		Win.d3d_context->CSSetConstantBuffers(1, 1, &Buffers.globaldata);
 
-		// Ray march
+		// Ray march every ghost for every traced direction
 		Win.d3d_context->End(GPUQueries.lensflare_compute_start);
 		Win.d3d_context->CSSetUnorderedAccessViews(0, 1, &Shapes.ray_bundle.ua_vertices_resource_view, nullptr);
 		Win.d3d_context->CSSetUnorderedAccessViews(1, 1, &Buffers.lensInterface_view, nullptr);
@@ -1497,10 +2007,10 @@ void Render() {
 		Win.d3d_context->CSSetUnorderedAccessViews(2, 1, Textures.null_ua_view, nullptr);
 		Win.d3d_context->End(GPUQueries.lensflare_compute_end);
 
-		// Draw Ghosts
+		// Draw every ghost for every light, rotated from the trace it shares
 		Win.d3d_context->End(GPUQueries.lensflare_draw_start);
 		Win.d3d_context->VSSetShaderResources(0, 1, &Shapes.ray_bundle.vertices_resource_view);
-		Win.d3d_context->DrawIndexedInstanced(App.num_vertices_per_bundle * 3 * 2, Lens.num_of_ghosts, 0, 0, 0);
+		Win.d3d_context->DrawIndexedInstanced(App.num_vertices_per_bundle * 3 * 2, Lens.num_of_ghosts * Shapes.SpectralPatches() * (UINT)App.flare_lights.size(), 0, 0, 0);
 		Win.d3d_context->VSSetShaderResources(0, 1, Textures.null_sr_view);
 		Win.d3d_context->End(GPUQueries.lensflare_draw_end);
 
@@ -1521,6 +2031,7 @@ void Render() {
 		Win.d3d_context->Draw(6, 0);
 
 		// Tonemap
+		Win.d3d_context->End(GPUQueries.tonemap_start);
 		Win.d3d_context->RSSetState(States.rs_cull);
 		Win.d3d_context->IASetInputLayout(Win.d3d_vertex_layout_2d);
 		Win.d3d_context->OMSetRenderTargets(1, &Textures.backbuffer_rt_view, Textures.depthstencil_view);
@@ -1536,6 +2047,7 @@ void Render() {
 		DrawFullscreenQuad(Win.d3d_context, Shapes.unit_square, ColorTheme.fill1, Textures.backbuffer_rt_view, Textures.depthstencil_view);
 
 		Win.d3d_context->PSSetShaderResources(1, 1, Textures.null_sr_view);
+		Win.d3d_context->End(GPUQueries.tonemap_end);
 
 	#else
 		if(!UI.draw2d) {
@@ -1565,7 +2077,7 @@ void Render() {
 			Win.d3d_context->PSSetShaderResources(1, 1, &Textures.aperture_sr_view);
 			
 			// Dispatch
-			Win.d3d_context->Dispatch(App.num_groups, App.num_groups, 3);
+			Win.d3d_context->Dispatch(App.num_groups, App.num_groups, (UINT)App.spectral.wavelengths.size());
 			Win.d3d_context->CSSetUnorderedAccessViews(0, 1, Textures.null_ua_view, nullptr);
 			Win.d3d_context->CSSetUnorderedAccessViews(2, 1, Textures.null_ua_view, nullptr);
 
@@ -1602,6 +2114,7 @@ void Render() {
 			vector<vector<vec3>> intersections3(App.num_of_rays);
 
 			vec3 dir(UI.direction.x, UI.direction.y, UI.direction.z);
+			ApertureShape aperture = { UI.number_of_blades, UI.aperture_opening };
 			for (int i = 0; i < App.num_of_rays; ++i) {
 				float pos = Lerp(-1.f, 1.f, (float)i / (float)(App.num_of_rays - 1)) * UI.rays_spread;
 
@@ -1612,7 +2125,7 @@ void Render() {
 				vec3 a2 = i1.pos - dir;
 				Ray r = { a2, dir };
 
-				Trace(r, 1.f, Lens.lens_interface, intersections1[i], intersections2[i], intersections3[i], int2{ UI.ghost_bounce_1, UI.ghost_bounce_2 });
+				Trace(r, 1.f, Lens.lens_interface, intersections1[i], intersections2[i], intersections3[i], int2{ UI.ghost_bounce_1, UI.ghost_bounce_2 }, App.analytic_aperture ? &aperture : nullptr, Lens.aperture_id);
 			}
 
 			// Draw all rays
@@ -1646,13 +2159,71 @@ void Render() {
 	// Win.d3d_context->PSSetShader(Shaders.ps_tonemapper, nullptr, 0);
 	// Win.d3d_context->PSSetShaderResources(1, 1, &Textures.dust_sr_view);
 
-	Win.d3d_swapchain->Present(0, 0);
+	{
+		PROFILE_SCOPE("present");
+		Win.d3d_swapchain->Present(0, 0);
+	}
 
 	Win.d3d_context->End(GPUQueries.frame_end);
 	Win.d3d_context->End(GPUQueries.disjoint);
 	GPUQueries::PrintGPUTimes(GPUQueries);
 }
 
+void ToggleProfileCapture() {
+	if (!Profiler.enabled) {
+		Profiler.Clear();
+		Profiler.NameThread("main");
+		Profiler.enabled = true;
+		return;
+	}
+
+	Profiler.enabled = false;
+	Profiler.WriteChromeTrace(App.profile_output + ".json");
+
+	string summary = Profiler.Summary();
+	FILE* file = fopen((App.profile_output + ".txt").c_str(), "wb");
+	if (file) {
+		fwrite(summary.data(), 1, summary.size(), file);
+		fclose(file);
+	}
+	OutputDebugStringA(summary.c_str());
+}
+
+void WriteRayReport() {
+	FlareContext context;
+	context.SetLens(Lens.lens_components, Lens.aperture_id, Lens.gaps);
+	context.settings.patch_tesselation = App.patch_tesselation;
+	context.settings.rays_spread = UI.rays_spread;
+	context.settings.coating_quality = UI.coating_quality;
+	context.settings.aperture_opening = UI.aperture_opening;
+	context.settings.number_of_blades = UI.number_of_blades;
+	context.settings.analytic_aperture = App.analytic_aperture;
+	context.settings.dispersion = App.dispersion;
+	context.settings.num_spectral_samples = App.num_spectral_samples;
+	context.settings.zoom = UI.zoom;
+	context.settings.focus = UI.focus;
+	context.settings.max_flare_lights = App.max_flare_lights;
+	context.settings.max_flare_traces = App.max_flare_traces;
+
+	if (App.scene_lights.empty()) {
+		SceneLight mouse_light = { { UI.direction.x, UI.direction.y, UI.direction.z }, { 1.f, 1.f, 1.f }, App.light_temperature };
+		context.SetLights(&mouse_light, 1);
+	} else {
+		context.SetLights(App.scene_lights);
+	}
+
+	RayStats stats;
+	context.CollectRayStats(stats);
+	string report = stats.Report();
+
+	FILE* file = fopen(App.ray_report_output.c_str(), "wb");
+	if (file) {
+		fwrite(report.data(), 1, report.size(), file);
+		fclose(file);
+	}
+	OutputDebugStringA(report.c_str());
+}
+
 
 
 
@@ -1677,6 +2248,10 @@ HRESULT InitResources() {
 	Shapes.InitShapes();
 	GPUQueries.InitQueries();
 	FFT.InitFFTTetxtures(Win.d3d_device, (int)App.aperture_resolution);
+	InitFlareLights();
+
+	StarburstCache.directory = App.starburst_cache_directory;
+	PrewarmStarbursts();
 
 	return S_OK;
 }
@@ -1709,6 +2284,18 @@ int WINAPI wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
 			if (!UI.key_down && msg.wParam == 87)
 				UI.editing_spread = true;
 
+			if (!UI.key_down && msg.wParam == 90)
+				UI.editing_zoom = true;
+
+			if (!UI.key_down && msg.wParam == 70)
+				UI.editing_focus = true;
+
+			if (!UI.key_down && msg.wParam == 80)
+				ToggleProfileCapture();
+
+			if (!UI.key_down && msg.wParam == 84)
+				WriteRayReport();
+
 			if (!UI.key_down && msg.wParam == 32)
 				UI.draw2d = !UI.draw2d;
 
@@ -1731,11 +2318,17 @@ int WINAPI wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
 		}
 
 		if (msg.message == WM_KEYUP) {
+			// Redraw the aperture it settled on so it gets cached
+			if (UI.editing_aperture || UI.editing_no_blades)
+				UI.aperture_needs_updating = true;
+
 			UI.key_down = false;
 			UI.editing_aperture = false;
 			UI.editing_no_blades = false;
 			UI.editing_spread = false;
 			UI.editing_coating_quality = false;
+			UI.editing_zoom = false;
+			UI.editing_focus = false;
 		}
 
 		if (msg.message == WM_LBUTTONDOWN) {
@@ -1776,6 +2369,13 @@ int WINAPI wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
 				UI.coating_quality = 0.5f + ny;
 			}
 
+			if (UI.editing_zoom || UI.editing_focus) {
+				float t = min(max(ny * 0.5f + 0.5f, 0.f), 1.f);
+				UI.zoom = UI.editing_zoom ? t : UI.zoom;
+				UI.focus = UI.editing_focus ? t : UI.focus;
+				UpdateLensGaps();
+			}
+
 			if (UI.editing_aperture || UI.editing_no_blades)
 				UI.aperture_needs_updating = true;
 		}
@@ -24,6 +24,9 @@ struct LensInterface {
 	float flat;
 	float pos;
 	float w;
+	float conic;
+	float3 aspheric_padding;
+	float4 aspheric;  // r^4, r^6, r^8 and r^10 terms of the sag
 };
 
 struct Ray {	
@@ -38,10 +41,39 @@ struct GhostData{
 	float2 padding;
 };
 
+// Ghosts only depend on a light's angle to the optical axis, so lights of similar angle share
+// a trace and are drawn rotated by their azimuth. The CS traces every (ghost, trace) pair of
+// the frame in one dispatch, the VS draws every (ghost, light) pair in one draw
+struct FlareTrace {
+	float3 direction;
+	float rotated;
+};
+
+struct FlareLight {
+	float2 rotation;
+	float trace;
+	float padding;
+	float4 intensity;
+};
+
 StructuredBuffer<PSInput> vertices_buffer : register(t0);
 RWStructuredBuffer<PSInput> uav_buffer : register(u0);
 RWStructuredBuffer<LensInterface> lens_interface : register(u1);
 RWStructuredBuffer<GhostData> ghostdata_buffer : register(u2);
+StructuredBuffer<FlareLight> flare_lights : register(t3);
+StructuredBuffer<FlareTrace> flare_traces : register(t4);
+
+// NUM_WAVELENGTHS samples (dispersion.h). Each interface has the index of the medium on its
+// left and on its right for every sample. With DISPERSION the samples take different paths
+// and each one has its own patch per ghost, tinted by its rgb. Without it the three samples
+// share one patch and each fills one channel of its reflectance
+struct SpectralSample {
+	float wavelength;
+	float3 rgb;
+};
+
+StructuredBuffer<SpectralSample> spectral_samples : register(t5);
+StructuredBuffer<float2> interface_ior : register(t6);
 
 Intersection TestFlat(Ray r, LensInterface F) {
 	Intersection i;
@@ -82,6 +114,56 @@ Intersection TestSphere(Ray r, LensInterface F) {
 	return i;
 }
 
+// Same fixed Newton steps from the base sphere as the CPU testASPHERE (ray_trace.h)
+#define ASPHERE_STEPS 3
+
+bool IsAspheric(LensInterface F) {
+	return F.conic != 0 || any(F.aspheric != 0);
+}
+
+void AsphereSag(LensInterface F, float u, out float sag, out float slope) {
+	float c = 1.f / F.radius;
+	float q = sqrt(max(1.f - (1.f + F.conic) * c * c * u, 1e-6f));
+	float4 a = F.aspheric;
+	sag = c * u / (1.f + q) + u * u * (a.x + u * (a.y + u * (a.z + u * a.w)));
+	slope = c / (2.f * q) + u * (2.f * a.x + u * (3.f * a.y + u * (4.f * a.z + u * 5.f * a.w)));
+}
+
+Intersection TestAsphere(Ray r, LensInterface F) {
+	Intersection i;
+
+	float3 D = r.pos - F.center;
+	float B = dot(D, r.dir);
+	float B2_C = B*B - (dot(D, D) - F.radius * F.radius);
+	float sgn = (F.radius * r.dir.z) > 0 ? 1.f : -1.f;
+	float t = B2_C >= 0 ? sqrt(max(B2_C, 0)) * sgn - B : (F.pos - r.pos.z) / r.dir.z;
+
+	float sag, slope;
+	[unroll]
+	for (int k = 0; k < ASPHERE_STEPS; ++k) {
+		float3 p = r.dir * t + r.pos;
+		AsphereSag(F, dot(p.xy, p.xy), sag, slope);
+		float f = p.z - F.pos + sag;
+		float df = r.dir.z + 2.f * slope * dot(p.xy, r.dir.xy);
+		t -= f / df;
+	}
+
+	i.pos = r.dir * t + r.pos;
+	float u = dot(i.pos.xy, i.pos.xy);
+	AsphereSag(F, u, sag, slope);
+	float c = 1.f / F.radius;
+	i.norm = normalize(float3(2.f * slope * i.pos.xy, 1.f));
+
+	if (dot(i.norm, r.dir) > 0)
+		i.norm = -i.norm;
+
+	i.theta = acos(clamp(dot(-r.dir, i.norm), -1, 1));
+	i.hit = (1.f + F.conic) * c * c * u <= 1.f && abs(i.pos.z - F.pos + sag) < 1e-3f;
+	i.inverted = t < 0;
+
+	return i;
+}
+
 float FresnelAR(float theta0, float lambda, float d1, float n0, float n1, float n2) {
 	float theta1 = asin(sin(theta0) *n0 / n1);
 	float theta2 = asin(sin(theta0) *n0 / n2);
@@ -108,7 +190,7 @@ float FresnelAR(float theta0, float lambda, float d1, float n0, float n1, float
 	return (out_s2+out_p2) / 2 ;
 }
 
-Ray Trace(Ray r, float lambda, int2 bounce_pair) {
+Ray Trace(Ray r, float lambda, int2 bounce_pair, bool rotated, int spectral_index) {
 	int LEN = bounce_pair.x + (bounce_pair.x - bounce_pair.y) + (num_interfaces - bounce_pair.y) - 1;
 	int PHASE = 0;
 	int DELTA = 1;
@@ -125,6 +207,8 @@ Ray Trace(Ray r, float lambda, int2 bounce_pair) {
 		Intersection i;
 		if(F.flat)
 			i = TestFlat(r, lens_interface[T]);
+		else if(IsAspheric(F))
+			i = TestAsphere(r, lens_interface[T]);
 		else 
 			i = TestSphere(r, lens_interface[T]);
 
@@ -138,9 +222,22 @@ Ray Trace(Ray r, float lambda, int2 bounce_pair) {
 		// record texture coord . or max. rel . radius
 		if (!F.flat)
 			r.tex.z = max(r.tex.z, length(i.pos.xy) / F.sa);
-		else if(T==AP_IDX) // iris aperture plane
+		else if(T==AP_IDX) { // iris aperture plane
 			r.tex.xy = i.pos.xy / lens_interface[AP_IDX].sa; // update ray light_dir and position
 
+			#if APERTURE_TEST
+				// Blocked rays are clipped like rays beyond an interface's height: they keep going
+				// to the sensor and tex.z reaches 1 at the fully occluded edge, so the pixel shader
+				// cuts their triangles where the interpolated value crosses it. A rotated light
+				// sees the blades at another angle, so it takes the lower bound of the blade
+				// distance at every angle, |p| cos(PI / blades) minus the 0.025 blade curvature
+				float blade_distance = rotated ?
+					length(r.tex.xy) * cos(PI / int(number_of_blades)) - 0.025f :
+					ApertureBladeDistance(r.tex.xy);
+				r.tex.z = max(r.tex.z, blade_distance / APERTURE_CUTOFF);
+			#endif
+		}
+
 		r.dir = normalize(i.pos- r.pos);
 
 		if (i.inverted) r.dir *= -1.f; // correct an ← inverted ray
@@ -152,8 +249,9 @@ Ray Trace(Ray r, float lambda, int2 bounce_pair) {
 			continue;
 
 		// do reflection / refraction for spher . surfaces
-		float n0 = r.dir.z < 0.f ? F.n.x : F.n.z;
-		float n2 = r.dir.z < 0.f ? F.n.z : F.n.x;
+		float2 ior = interface_ior[T * NUM_WAVELENGTHS + spectral_index];
+		float n0 = r.dir.z < 0.f ? ior.x : ior.y;
+		float n2 = r.dir.z < 0.f ? ior.y : ior.x;
 
 		if (!bReflect) { // refraction
 			r.dir = refract(r.dir,i.norm,n0/n2);
@@ -261,17 +359,19 @@ float GetArea(int2 pos, int offset) {
 	return isnan(area) ? 0.f : area;
 }
 
-PSInput GetTraceResult(float2 ndc, float wavelength, int2 bounces){
+PSInput GetTraceResult(float2 ndc, int spectral_index, int2 bounces, FlareTrace trace){
+	float wavelength = spectral_samples[spectral_index].wavelength * NANO_METER;
+
 	float3 starting_pos = float3(ndc * spread, 1000.f);
 	starting_pos.xy = Rotate(starting_pos.xy, 2.f);
 
 	// Project all starting points in the entry lens
 	Ray c = { starting_pos, float3(0, 0, -1.f), float4(0,0,0,0) };
 	Intersection i = TestSphere(c, lens_interface[0]);
-	starting_pos = i.pos - light_dir.xyz;
+	starting_pos = i.pos - trace.direction;
 
-	Ray r = { starting_pos, light_dir.xyz, float4(0,0,0,1) };
-	Ray g = Trace(r, wavelength, bounces);
+	Ray r = { starting_pos, trace.direction, float4(0,0,0,1) };
+	Ray g = Trace(r, wavelength, bounces, trace.rotated > 0.f, spectral_index);
 
 	PSInput result;
 	result.pos = float4(g.pos.xyz, 1.f);
@@ -288,17 +388,22 @@ PSInput GetTraceResult(float2 ndc, float wavelength, int2 bounces){
 void CS(int3 gid : SV_GroupID, uint3 gtid : SV_GroupThreadID, uint gi : SV_GroupIndex) {
 
 	int ghostid = gid.x / NUM_GROUPS;
-	int data_offset = ghostid * PATCH_TESSELATION * PATCH_TESSELATION;
+	int traceid = gid.z / NUM_WAVELENGTHS;
+	int channel = gid.z % NUM_WAVELENGTHS;
+
+	#if DISPERSION
+		int patch_index = (traceid * NUM_WAVELENGTHS + channel) * int(num_ghosts) + ghostid;
+	#else
+		int patch_index = traceid * int(num_ghosts) + ghostid;
+	#endif
+	int data_offset = patch_index * PATCH_TESSELATION * PATCH_TESSELATION;
 	
 	int2 pos = gtid.xy + (gid.xy % NUM_GROUPS) * NUM_THREADS;
 	float2 uv = pos / float(PATCH_TESSELATION - 1);
 	float2 ndc = (uv - 0.5f) * 2.f;
 
-	float color_spectrum[3] = {650.f, 510.f, 475.f};
-	float wavelength = color_spectrum[gid.z] * NANO_METER;
-
 	int2 bounces = int2(ghostdata_buffer[ghostid].bounce1, ghostdata_buffer[ghostid].bounce2);
-	PSInput result = GetTraceResult(ndc, wavelength, bounces);
+	PSInput result = GetTraceResult(ndc, channel, bounces, flare_traces[traceid]);
 	
 	uint offset = PosToOffset(pos) + data_offset;
 	uav_buffer[offset].reflectance.a = 0;
@@ -309,12 +414,16 @@ void CS(int3 gid : SV_GroupID, uint3 gtid : SV_GroupThreadID, uint gi : SV_Group
 	uav_buffer[offset].color = result.color;
 	uav_buffer[offset].coordinates = result.coordinates;
 
-	if(gid.z == 0)
-		uav_buffer[offset].reflectance.r = result.reflectance.a;
-	else if(gid.z == 1)
-		uav_buffer[offset].reflectance.g = result.reflectance.a;
-	else if(gid.z == 2)
-		uav_buffer[offset].reflectance.b = result.reflectance.a;
+	#if DISPERSION
+		uav_buffer[offset].reflectance = float4(spectral_samples[channel].rgb * result.reflectance.a, result.reflectance.a);
+	#else
+		if(channel == 0)
+			uav_buffer[offset].reflectance.r = result.reflectance.a;
+		else if(channel == 1)
+			uav_buffer[offset].reflectance.g = result.reflectance.a;
+		else if(channel == 2)
+			uav_buffer[offset].reflectance.b = result.reflectance.a;
+	#endif
 
 	uav_buffer[offset].color.w = GetArea(pos, data_offset);
 
@@ -323,7 +432,24 @@ void CS(int3 gid : SV_GroupID, uint3 gtid : SV_GroupThreadID, uint gi : SV_Group
 // Vertex Shader
 // ----------------------------------------------------------------------------------
 PSInput VS(uint id : SV_VertexID, uint instance_id : SV_InstanceID) {
-	PSInput vertex  = vertices_buffer[id + instance_id * PATCH_TESSELATION * PATCH_TESSELATION];
+	uint ghost = instance_id % uint(num_ghosts);
+
+	#if DISPERSION
+		uint channel = (instance_id / uint(num_ghosts)) % NUM_WAVELENGTHS;
+		FlareLight light = flare_lights[instance_id / (uint(num_ghosts) * NUM_WAVELENGTHS)];
+		uint patch_index = (uint(light.trace) * NUM_WAVELENGTHS + channel) * uint(num_ghosts) + ghost;
+	#else
+		FlareLight light = flare_lights[instance_id / uint(num_ghosts)];
+		uint patch_index = uint(light.trace) * uint(num_ghosts) + ghost;
+	#endif
+
+	PSInput vertex  = vertices_buffer[id + patch_index * PATCH_TESSELATION * PATCH_TESSELATION];
+
+	// Rotating the light about the optical axis rotates the ghost and its aperture coordinates
+	float2x2 rotation = float2x2(light.rotation.x, -light.rotation.y, light.rotation.y, light.rotation.x);
+	vertex.pos.xy = mul(rotation, vertex.pos.xy);
+	vertex.coordinates.zw = mul(rotation, vertex.coordinates.zw);
+	vertex.reflectance.rgb *= light.intensity.rgb;
 	
 	float ratio = backbuffer_size.x / backbuffer_size.y;
 	float scale = 1.f / plate_size;
@@ -371,7 +497,7 @@ float4 PS(in PSInput input) : SV_Target {
 		return float4(alpha, alpha, alpha ,1);
 	#endif
 
-	float3 v = alpha * input.reflectance.xyz * TemperatureToColor(INCOMING_LIGHT_TEMP);
+	float3 v = alpha * input.reflectance.xyz;
 	
 	return float4(v, 1.f);
 }
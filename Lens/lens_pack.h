@@ -0,0 +1,447 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// Lens prescriptions as text and lens packs. A prescription lists the surfaces front to
+// back, one per line, in the patent columns of PatentFormat:
+//
+//   name nikon_28_75mm
+//   gap d6 53.142                              named distance, usable in the d column
+//   zoom d6 53.142 14.0                        its value at the wide and the tele end
+//   focus d6 2.5                               and what focusing closest adds to it
+//   #  r        d      n        flat  w    h     c    v
+//      72.747   2.300  1.60300  0     0.2  29.0  530  65.44
+//   aperture 0  2.800  1.00000  1     18   7     440
+//   asphere -0.8 1.2e-6 -3.4e-9 0 0            conic, r^4 .. r^10 terms of the surface above
+//
+// '#' starts a comment, v (the Abbe number) may be left out and the surface after the
+// aperture keyword is the iris. A lens pack is the compiled form of any number of
+// prescriptions: the parsed interfaces, the ghost list and the gaps, laid out so a mapped
+// pack is used in place.
+//--------------------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ray_trace.h"
+#include "starburst_cache.h"
+
+using namespace std;
+
+struct PatentFormat {
+	float r;
+	float d;
+	float n;
+	bool  f;
+	float w;
+	float h;
+	float c;
+	float v;  // Abbe number of the glass, 0 (or left out) for no dispersion, see dispersion.h
+	float k;  // conic constant and even terms of an aspheric surface, see testASPHERE
+	float a[4];
+};
+
+// A distance the prescription names instead of giving, the ones zoom and focus move. At zoom
+// 0 it is wide, at zoom 1 tele, and focusing from infinity (0) to closest (1) adds focus_travel
+struct LensGap {
+	string name;
+	vector<int> surfaces;  // components whose d is this gap
+	float wide;
+	float tele;
+	float focus_travel;
+
+	float Distance(float zoom, float focus) const {
+		return wide + (tele - wide) * zoom + focus_travel * focus;
+	}
+};
+
+struct LensPrescription {
+	string name;
+	vector<PatentFormat> components;
+	vector<LensGap> gaps;
+	int aperture_id = -1;
+
+	LensGap* FindGap(const string& gap_name) {
+		for (LensGap& gap : gaps)
+			if (gap.name == gap_name)
+				return &gap;
+		return nullptr;
+	}
+
+	bool Load(const string& path, string* error = nullptr) {
+		ifstream file(path);
+		if (!file) {
+			if (error)
+				*error = "cannot open " + path;
+			return false;
+		}
+		stringstream text;
+		text << file.rdbuf();
+		return Parse(text.str(), error);
+	}
+
+	bool Parse(const string& text, string* error = nullptr) {
+		components.clear();
+		gaps.clear();
+		aperture_id = -1;
+
+		istringstream lines(text);
+		string line;
+		for (int line_number = 1; getline(lines, line); ++line_number) {
+			line = line.substr(0, line.find('#'));
+			istringstream tokens(line);
+			vector<string> words;
+			for (string word; tokens >> word;)
+				words.push_back(word);
+			if (words.empty())
+				continue;
+
+			auto fail = [&](const string& message) {
+				if (error)
+					*error = name + ":" + to_string(line_number) + ": " + message;
+				return false;
+			};
+
+			if (words[0] == "name") {
+				if (words.size() != 2)
+					return fail("expected: name <lens>");
+				name = words[1];
+				continue;
+			}
+
+			float numbers[2] = { 0.f, 0.f };
+			auto parse = [&](size_t first, size_t count) {
+				for (size_t i = 0; i < count; ++i) {
+					char* end = nullptr;
+					numbers[i] = strtof(words[first + i].c_str(), &end);
+					if (*end != 0)
+						return false;
+				}
+				return true;
+			};
+
+			if (words[0] == "gap") {
+				if (words.size() != 3 || FindGap(words[1]) || !parse(2, 1))
+					return fail("expected: gap <new name> <distance>");
+				LensGap gap = { words[1], {}, numbers[0], numbers[0], 0.f };
+				gaps.push_back(gap);
+				continue;
+			}
+
+			if (words[0] == "zoom") {
+				LensGap* gap = words.size() == 4 ? FindGap(words[1]) : nullptr;
+				if (!gap || !parse(2, 2))
+					return fail("expected: zoom <gap> <wide> <tele>");
+				gap->wide = numbers[0];
+				gap->tele = numbers[1];
+				continue;
+			}
+
+			if (words[0] == "asphere") {
+				if (words.size() != 6 || components.empty())
+					return fail("expected, after a surface: asphere <conic> <a4> <a6> <a8> <a10>");
+				PatentFormat& surface = components.back();
+				float* terms[5] = { &surface.k, &surface.a[0], &surface.a[1], &surface.a[2], &surface.a[3] };
+				for (int i = 0; i < 5; ++i) {
+					char* end = nullptr;
+					*terms[i] = strtof(words[i + 1].c_str(), &end);
+					if (*end != 0)
+						return fail("not a number: " + words[i + 1]);
+				}
+				continue;
+			}
+
+			if (words[0] == "focus") {
+				LensGap* gap = words.size() == 3 ? FindGap(words[1]) : nullptr;
+				if (!gap || !parse(2, 1))
+					return fail("expected: focus <gap> <travel>");
+				gap->focus_travel = numbers[0];
+				continue;
+			}
+
+			bool aperture = words[0] == "aperture";
+			if (aperture)
+				words.erase(words.begin());
+			if (words.size() != 7 && words.size() != 8)
+				return fail("expected: [aperture] r d n flat w h c [v]");
+
+			float values[8] = { 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f };
+			for (size_t i = 0; i < words.size(); ++i) {
+				LensGap* gap = i == 1 ? FindGap(words[i]) : nullptr;
+				char* end = nullptr;
+				if (gap) {
+					values[i] = gap->wide;
+					gap->surfaces.push_back((int)components.size());
+				} else if (values[i] = strtof(words[i].c_str(), &end), *end != 0) {
+					return fail("not a number: " + words[i]);
+				}
+			}
+
+			if (aperture)
+				aperture_id = (int)components.size();
+			PatentFormat surface = { values[0], values[1], values[2], values[3] != 0.f, values[4], values[5], values[6], values[7], 0.f, { 0.f, 0.f, 0.f, 0.f } };
+			components.push_back(surface);
+		}
+
+		if (components.size() < 3 || aperture_id < 0) {
+			if (error)
+				*error = name + ": needs at least three surfaces and an aperture";
+			return false;
+		}
+		return true;
+	}
+};
+
+// Everything derived from a prescription: the LensInterface array the tracers take and the
+// ghosts (every pair of reflecting interfaces)
+struct LensGeometry {
+	vector<LensInterface> interfaces;
+	vector<float> ghosts;  // bounce1, bounce2, 0, 0 per ghost, as GhostData
+	float total_lens_distance = 0.f;
+	float min_ior = 1000.f;
+	float max_ior = -1000.f;
+
+	int NumGhosts() const {
+		return (int)ghosts.size() / 4;
+	}
+
+	void Build(const vector<PatentFormat>& components) {
+		int num_interfaces = (int)components.size();
+		interfaces.resize(num_interfaces);
+		total_lens_distance = 0.f;
+		min_ior = 1000.f;
+		max_ior = -1000.f;
+
+		for (int i = num_interfaces - 1; i >= 0; --i) {
+			const PatentFormat& entry = components[i];
+			total_lens_distance += entry.d;
+
+			float left_ior = i == 0 ? 1.f : components[i - 1].n;
+			float right_ior = entry.n;
+
+			if (right_ior != 1.f) {
+				min_ior = min(min_ior, right_ior);
+				max_ior = max(max_ior, right_ior);
+			}
+
+			vec3 center = { 0.f, 0.f, total_lens_distance - entry.r };
+			vec3 n = { left_ior, 1.f, right_ior };
+
+			LensInterface component = {
+				center, entry.r, n, entry.h, entry.c, (float)entry.f, total_lens_distance, entry.w,
+				entry.k, { 0.f, 0.f, 0.f }, vec4(entry.a[0], entry.a[1], entry.a[2], entry.a[3])
+			};
+			interfaces[i] = component;
+		}
+
+		// Enumerate all possible ghosts of the lens system
+		ghosts.clear();
+		for (int bounce2 = 1; bounce2 < num_interfaces - 1; ++bounce2) {
+			for (int bounce1 = bounce2 + 1; bounce1 < num_interfaces - 1; ++bounce1) {
+				float ghost[4] = { (float)bounce1, (float)bounce2, 0.f, 0.f };
+				ghosts.insert(ghosts.end(), ghost, ghost + 4);
+			}
+		}
+	}
+};
+
+#define LENS_PACK_VERSION 4
+
+struct LensPackHeader {
+	char magic[8];            // "LENSPACK"
+	uint32_t version;
+	uint32_t num_lenses;
+	uint32_t component_size;  // sizeof(PatentFormat) and sizeof(LensInterface) of the writer
+	uint32_t interface_size;
+};
+
+// One surface a gap sets the distance of
+struct LensPackGap {
+	char name[16];
+	int32_t surface;
+	float wide;
+	float tele;
+	float focus_travel;
+};
+
+// Offsets are from the start of the pack, every array starts 16 byte aligned
+struct LensPackEntry {
+	char name[64];
+	int32_t aperture_id;
+	uint32_t num_components;
+	uint32_t num_ghosts;
+	uint32_t num_gaps;
+	float total_lens_distance;
+	float min_ior;
+	float max_ior;
+	uint64_t gaps;
+	uint64_t components;
+	uint64_t interfaces;
+	uint64_t ghosts;
+};
+
+// One lens of a mapped pack, pointers into the mapping
+struct LensView {
+	const LensPackEntry* entry = nullptr;
+	const PatentFormat* components = nullptr;
+	const LensInterface* interfaces = nullptr;
+	const float* ghosts = nullptr;
+	const LensPackGap* gaps = nullptr;
+
+	vector<LensGap> Gaps() const {
+		vector<LensGap> result;
+		for (uint32_t i = 0; i < entry->num_gaps; ++i) {
+			const LensPackGap& g = gaps[i];
+			string gap_name(g.name, strnlen(g.name, sizeof(g.name)));
+			if (result.empty() || result.back().name != gap_name) {
+				LensGap gap = { gap_name, {}, g.wide, g.tele, g.focus_travel };
+				result.push_back(gap);
+			}
+			result.back().surfaces.push_back(g.surface);
+		}
+		return result;
+	}
+};
+
+struct LensPack {
+	MappedFile file;
+	const LensPackHeader* header = nullptr;
+	const LensPackEntry* entries = nullptr;
+
+	bool Open(const string& path) {
+		header = nullptr;
+		entries = nullptr;
+		if (!file.Open(path) || file.size < sizeof(LensPackHeader))
+			return false;
+
+		const LensPackHeader* h = (const LensPackHeader*)file.data;
+		if (memcmp(h->magic, "LENSPACK", 8) != 0 || h->version != LENS_PACK_VERSION ||
+			h->component_size != sizeof(PatentFormat) || h->interface_size != sizeof(LensInterface) ||
+			h->num_lenses > (file.size - sizeof(LensPackHeader)) / sizeof(LensPackEntry))
+			return false;
+
+		header = h;
+		entries = (const LensPackEntry*)(h + 1);
+		return true;
+	}
+
+	// Checks the lens' arrays lie inside the pack and its ghosts, gaps and aperture stop
+	// inside the lens, so a damaged pack fails here rather than in the tracers
+	bool Find(const string& name, LensView& view, string* error = nullptr) const {
+		auto fail = [&](const string& message) {
+			if (error)
+				*error = message;
+			return false;
+		};
+		if (!header)
+			return fail("no lens pack open");
+
+		const char* base = (const char*)file.data;
+		for (uint32_t i = 0; i < header->num_lenses; ++i) {
+			const LensPackEntry& e = entries[i];
+			if (strncmp(e.name, name.c_str(), sizeof(e.name)) != 0)
+				continue;
+
+			// Written 16 byte aligned, and count elements of size bytes must end inside the pack
+			auto fits = [&](uint64_t offset, uint64_t count, size_t size) {
+				return offset % 16 == 0 && offset <= file.size && count <= (file.size - offset) / size;
+			};
+			uint64_t n = e.num_components;
+			uint64_t num_ghosts = n < 3 ? 0 : (n - 2) * (n - 3) / 2;
+			if (n < 3 || e.num_ghosts != num_ghosts || e.aperture_id < 0 || (uint64_t)e.aperture_id >= n)
+				return fail("lens " + name + " has bad counts");
+			if (!fits(e.components, n, sizeof(PatentFormat)) || !fits(e.interfaces, n, sizeof(LensInterface)) ||
+				!fits(e.ghosts, num_ghosts * 4, sizeof(float)) || !fits(e.gaps, e.num_gaps, sizeof(LensPackGap)))
+				return fail("lens " + name + " extends past the end of the pack");
+
+			const float* ghosts = (const float*)(base + e.ghosts);
+			for (uint64_t g = 0; g < num_ghosts; ++g) {
+				float bounce1 = ghosts[g * 4], bounce2 = ghosts[g * 4 + 1];
+				if (!(bounce2 >= 1.f && bounce1 > bounce2 && bounce1 < (float)(n - 1)) || bounce1 != floorf(bounce1) || bounce2 != floorf(bounce2))
+					return fail("lens " + name + " has a ghost outside the lens");
+			}
+			const LensPackGap* gaps = (const LensPackGap*)(base + e.gaps);
+			for (uint32_t g = 0; g < e.num_gaps; ++g)
+				if (gaps[g].surface < 0 || (uint64_t)gaps[g].surface >= n)
+					return fail("lens " + name + " has a gap outside the lens");
+
+			view.entry = &e;
+			view.components = (const PatentFormat*)(base + e.components);
+			view.interfaces = (const LensInterface*)(base + e.interfaces);
+			view.ghosts = (const float*)(base + e.ghosts);
+			view.gaps = gaps;
+			return true;
+		}
+		return fail("no lens " + name + " in the pack");
+	}
+
+	// Writes the pack next to path and renames it over, so readers never map a partial pack
+	static bool Compile(const vector<LensPrescription>& lenses, const string& path) {
+		LensPackHeader header = { { 'L', 'E', 'N', 'S', 'P', 'A', 'C', 'K' }, LENS_PACK_VERSION, (uint32_t)lenses.size(), sizeof(PatentFormat), sizeof(LensInterface) };
+		vector<LensPackEntry> entries(lenses.size());
+		vector<char> data;
+
+		auto append = [&](const void* bytes, size_t size) {
+			size_t base = sizeof(LensPackHeader) + entries.size() * sizeof(LensPackEntry);
+			data.resize(((base + data.size() + 15) & ~(size_t)15) - base);
+			uint64_t offset = base + data.size();
+			data.insert(data.end(), (const char*)bytes, (const char*)bytes + size);
+			return offset;
+		};
+
+		for (size_t i = 0; i < lenses.size(); ++i) {
+			const LensPrescription& lens = lenses[i];
+			LensGeometry geometry;
+			geometry.Build(lens.components);
+
+			vector<LensPackGap> gaps;
+			for (const LensGap& gap : lens.gaps) {
+				for (int surface : gap.surfaces) {
+					LensPackGap g = { {}, surface, gap.wide, gap.tele, gap.focus_travel };
+					strncpy(g.name, gap.name.c_str(), sizeof(g.name) - 1);
+					gaps.push_back(g);
+				}
+			}
+
+			LensPackEntry& e = entries[i];
+			memset(&e, 0, sizeof(e));
+			strncpy(e.name, lens.name.c_str(), sizeof(e.name) - 1);
+			e.aperture_id = lens.aperture_id;
+			e.num_components = (uint32_t)lens.components.size();
+			e.num_ghosts = (uint32_t)geometry.NumGhosts();
+			e.num_gaps = (uint32_t)gaps.size();
+			e.total_lens_distance = geometry.total_lens_distance;
+			e.min_ior = geometry.min_ior;
+			e.max_ior = geometry.max_ior;
+			e.components = append(lens.components.data(), lens.components.size() * sizeof(PatentFormat));
+			e.interfaces = append(geometry.interfaces.data(), geometry.interfaces.size() * sizeof(LensInterface));
+			e.ghosts = append(geometry.ghosts.data(), geometry.ghosts.size() * sizeof(float));
+			e.gaps = append(gaps.data(), gaps.size() * sizeof(LensPackGap));
+		}
+
+		string temp_path = path + ".tmp";
+		FILE* file = fopen(temp_path.c_str(), "wb");
+		if (!file)
+			return false;
+
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+		ok = ok && fwrite(entries.data(), sizeof(LensPackEntry), entries.size(), file) == entries.size();
+		ok = ok && fwrite(data.data(), 1, data.size(), file) == data.size();
+		ok = fclose(file) == 0 && ok;
+
+		#if defined(_WIN32)
+		ok = ok && MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+		#else
+		ok = ok && rename(temp_path.c_str(), path.c_str()) == 0;
+		#endif
+		if (!ok)
+			remove(temp_path.c_str());
+		return ok;
+	}
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// Zoom and focus. Both only change the lens' gaps (lens_pack.h), and an interface's pos and
+// center are the sum of the distances behind it, so a changed gap moves every interface in
+// front of it by the same amount and none behind it. MoveLensGaps applies that shift to the
+// interfaces in front of the last changed gap instead of rebuilding the lens, leaving the
+// ghost list and the index tables alone, and reports which interfaces moved. Every ghost
+// travels from the first interface to the sensor and so through every gap, so traces of all
+// of them are redone after a change.
+//--------------------------------------------------------------------------------------
+
+#include <vector>
+
+#include "lens_pack.h"
+
+using namespace std;
+
+struct LensChange {
+	int num_moved = 0;          // interfaces [0, num_moved) moved
+	float shift = 0.f;          // change of the total lens length
+};
+
+inline LensChange MoveLensGaps(
+	const vector<LensGap>& gaps,
+	float zoom,
+	float focus,
+	vector<PatentFormat>& components,
+	vector<LensInterface>& interfaces
+) {
+	LensChange change;
+	vector<float> delta(components.size(), 0.f);
+
+	for (const LensGap& gap : gaps) {
+		float distance = gap.Distance(zoom, focus);
+		for (int surface : gap.surfaces) {
+			if (components[surface].d == distance)
+				continue;
+			delta[surface] = distance - components[surface].d;
+			components[surface].d = distance;
+			change.num_moved = max(change.num_moved, surface + 1);
+		}
+	}
+
+	for (int i = change.num_moved - 1; i >= 0; --i) {
+		change.shift += delta[i];
+		interfaces[i].pos += change.shift;
+		interfaces[i].center.z += change.shift;
+	}
+
+	return change;
+}
@@ -0,0 +1,312 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// Lights taken from an HDR plate instead of the single mouse controlled light: pixels above
+// a threshold are grouped into connected components (8-neighbours), each gives a source at
+// its luminance weighted centroid, and sources closer than a radius are clustered.
+//
+// Ghosts of a rotationally symmetric lens only depend on a light's angle to the optical axis,
+// its azimuth just rotates them about the axis. FlarePlanner groups any set of scene lights
+// (plate sources, suns, lamps) by off-axis angle so each group is traced once along its mean
+// angle and drawn rotated for every light in it. The number of traced directions is capped,
+// so scenes with hundreds of lights cost a bounded number of traces.
+//--------------------------------------------------------------------------------------
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "hdr_image.h"
+#include "spectral_color.h"
+
+using namespace std;
+
+struct LightSource {
+	float x, y;       // luminance weighted centroid, in pixels
+	float energy;     // summed luminance
+	float rgb[3];     // summed radiance
+	int num_pixels;
+};
+
+struct LightSourceExtraction {
+	float threshold = 10.f;      // luminance a pixel needs to be part of a source
+	float cluster_radius = 8.f;  // pixels, sources closer than this are merged
+
+	vector<int> labels;
+	vector<int> parent;
+
+	static float Luminance(const float* rgb) {
+		return rgb[0] * 0.2126f + rgb[1] * 0.7152f + rgb[2] * 0.0722f;
+	}
+
+	int Root(int label) {
+		while (parent[label] != label) {
+			parent[label] = parent[parent[label]];
+			label = parent[label];
+		}
+		return label;
+	}
+
+	void Union(int a, int b) {
+		a = Root(a);
+		b = Root(b);
+		if (a != b)
+			parent[max(a, b)] = min(a, b);
+	}
+
+	void Extract(const HDRImage& image, vector<LightSource>& sources) {
+		int width = image.width;
+		int height = image.height;
+		labels.assign((size_t)width * height, -1);
+		parent.clear();
+
+		// First pass: provisional labels from the already visited neighbours
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				if (Luminance(image.Pixel(x, y)) <= threshold)
+					continue;
+
+				int label = -1;
+				const int neighbours[4][2] = { { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 } };
+				for (const auto& n : neighbours) {
+					int nx = x + n[0], ny = y + n[1];
+					if (nx < 0 || ny < 0 || nx >= width)
+						continue;
+					int other = labels[(size_t)ny * width + nx];
+					if (other < 0)
+						continue;
+					if (label < 0)
+						label = other;
+					else
+						Union(label, other);
+				}
+
+				if (label < 0) {
+					label = (int)parent.size();
+					parent.push_back(label);
+				}
+				labels[(size_t)y * width + x] = label;
+			}
+		}
+
+		// Second pass: accumulate per component
+		vector<int> source_index(parent.size(), -1);
+		sources.clear();
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				int label = labels[(size_t)y * width + x];
+				if (label < 0)
+					continue;
+
+				int root = Root(label);
+				if (source_index[root] < 0) {
+					source_index[root] = (int)sources.size();
+					LightSource source = { 0.f, 0.f, 0.f, { 0.f, 0.f, 0.f }, 0 };
+					sources.push_back(source);
+				}
+
+				LightSource& s = sources[source_index[root]];
+				const float* p = image.Pixel(x, y);
+				float luminance = Luminance(p);
+				s.x += (x + 0.5f) * luminance;
+				s.y += (y + 0.5f) * luminance;
+				s.energy += luminance;
+				for (int c = 0; c < 3; ++c)
+					s.rgb[c] += p[c];
+				s.num_pixels++;
+			}
+		}
+
+		for (LightSource& s : sources) {
+			s.x /= s.energy;
+			s.y /= s.energy;
+		}
+	}
+
+	// Brightest first, every source joins the first cluster within cluster_radius
+	void Cluster(vector<LightSource>& sources) const {
+		sort(sources.begin(), sources.end(), [](const LightSource& a, const LightSource& b) { return a.energy > b.energy; });
+
+		vector<LightSource> clusters;
+		float r2 = cluster_radius * cluster_radius;
+		for (const LightSource& s : sources) {
+			LightSource* target = nullptr;
+			for (LightSource& c : clusters) {
+				float dx = c.x - s.x, dy = c.y - s.y;
+				if (dx * dx + dy * dy < r2) {
+					target = &c;
+					break;
+				}
+			}
+
+			if (!target) {
+				clusters.push_back(s);
+				continue;
+			}
+
+			float energy = target->energy + s.energy;
+			target->x = (target->x * target->energy + s.x * s.energy) / energy;
+			target->y = (target->y * target->energy + s.y * s.energy) / energy;
+			target->energy = energy;
+			for (int c = 0; c < 3; ++c)
+				target->rgb[c] += s.rgb[c];
+			target->num_pixels += s.num_pixels;
+		}
+
+		sources.swap(clusters);
+	}
+};
+
+// A light the flare is drawn for. direction is the one the light travels in, (0, 0, -1) on the
+// optical axis like light_dir. A temperature of 0 leaves rgb untinted
+struct SceneLight {
+	float direction[3];
+	float rgb[3];
+	float temperature;
+
+	bool Same(const SceneLight& light) const {
+		return memcmp(direction, light.direction, sizeof(direction)) == 0 && memcmp(rgb, light.rgb, sizeof(rgb)) == 0 &&
+			temperature == light.temperature;
+	}
+};
+
+// Same layout as FlareTrace in lens.hlsl: one traced direction, rotated when its lights are
+// drawn as rotated copies of it rather than along their own direction
+struct FlareTrace {
+	float direction[3];
+	float rotated;
+};
+
+// Same layout as FlareLight in lens.hlsl
+struct FlareLight {
+	float rotation[2];   // cos and sin of the azimuth the trace is rotated by
+	float trace;         // flare_traces index
+	float padding;
+	float intensity[4];  // rgb tinted by the light's temperature
+};
+
+struct FlarePlanner {
+	float direction_scale = 0.2f;        // plate ndc to direction, same as the mouse light in wWinMain
+	float angle_tolerance = 0.002f;      // radians of off-axis angle lights may differ by and share a trace
+	int max_traced_directions = 8;
+	int max_lights = 1024;               // faintest lights beyond this are dropped
+	float intensity_scale = 0.001f;      // ghost intensity per unit of summed source radiance
+
+	struct Entry {
+		float off_axis;
+		float azimuth;
+		const SceneLight* light;
+	};
+
+	// Runs of entries sharing a trace
+	struct Run {
+		int first, last;
+	};
+
+	// Kept between calls so planning the lights of every frame allocates nothing
+	vector<SceneLight> sorted;
+	vector<Entry> entries;
+	vector<Run> runs;
+
+	// Plate sources as untinted scene lights
+	void PlateLights(const vector<LightSource>& sources, int width, int height, vector<SceneLight>& lights) const {
+		for (const LightSource& s : sources) {
+			// Same mapping as UpdateGlobals: dir = normalize(-nx * scale, ny * scale, -1)
+			float x = -(s.x / width * 2.f - 1.f) * direction_scale;
+			float y = (s.y / height * 2.f - 1.f) * direction_scale;
+			float l = 1.f / sqrtf(x * x + y * y + 1.f);
+			SceneLight light = { { x * l, y * l, -l }, { s.rgb[0] * intensity_scale, s.rgb[1] * intensity_scale, s.rgb[2] * intensity_scale }, 0.f };
+			lights.push_back(light);
+		}
+	}
+
+	static FlareLight Light(const SceneLight& s, float cos_azimuth, float sin_azimuth, float trace) {
+		const float white[3] = { 1.f, 1.f, 1.f };
+		const float* tint = s.temperature > 0.f ? SpectralColor.Blackbody(s.temperature) : white;
+		FlareLight light = { { cos_azimuth, sin_azimuth }, trace, 0.f, { s.rgb[0] * tint[0], s.rgb[1] * tint[1], s.rgb[2] * tint[2], 1.f } };
+		return light;
+	}
+
+	static float Energy(const SceneLight& light) {
+		return light.rgb[0] + light.rgb[1] + light.rgb[2];
+	}
+
+	// Groups the lights by off-axis angle into at most max_traced_directions traces. A trace
+	// with a single light is traced along that light's own direction and not rotated
+	void Plan(const SceneLight* scene, int count, vector<FlareTrace>& traces, vector<FlareLight>& lights) {
+		traces.clear();
+		lights.clear();
+
+		sorted.assign(scene, scene + count);
+		sort(sorted.begin(), sorted.end(), [](const SceneLight& a, const SceneLight& b) { return Energy(a) > Energy(b); });
+		if ((int)sorted.size() > max_lights)
+			sorted.resize(max_lights);
+
+		entries.clear();
+		for (const SceneLight& light : sorted) {
+			const float* d = light.direction;
+			Entry e = { atan2f(sqrtf(d[0] * d[0] + d[1] * d[1]), -d[2]), atan2f(d[1], d[0]), &light };
+			entries.push_back(e);
+		}
+		sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.off_axis < b.off_axis; });
+
+		// Runs of lights within the tolerance, then the closest neighbouring runs are merged
+		// until the trace budget is met
+		runs.clear();
+		for (int i = 0; i < (int)entries.size(); ++i) {
+			if (runs.empty() || entries[i].off_axis - entries[runs.back().first].off_axis > angle_tolerance) {
+				Run run = { i, i };
+				runs.push_back(run);
+			} else {
+				runs.back().last = i;
+			}
+		}
+
+		while ((int)runs.size() > max(1, max_traced_directions)) {
+			int best = 0;
+			float best_span = 1e30f;
+			for (int i = 0; i + 1 < (int)runs.size(); ++i) {
+				float span = entries[runs[i + 1].last].off_axis - entries[runs[i].first].off_axis;
+				if (span < best_span) {
+					best_span = span;
+					best = i;
+				}
+			}
+			runs[best].last = runs[best + 1].last;
+			runs.erase(runs.begin() + best + 1);
+		}
+
+		for (const Run& run : runs) {
+			float trace_index = (float)traces.size();
+
+			if (run.first == run.last) {
+				const SceneLight& s = *entries[run.first].light;
+				FlareTrace trace = { { s.direction[0], s.direction[1], s.direction[2] }, 0.f };
+				traces.push_back(trace);
+
+				lights.push_back(Light(s, 1.f, 0.f, trace_index));
+				continue;
+			}
+
+			double weighted = 0.0, energy = 0.0;
+			for (int i = run.first; i <= run.last; ++i) {
+				weighted += entries[i].off_axis * Energy(*entries[i].light);
+				energy += Energy(*entries[i].light);
+			}
+
+			float off_axis = (float)(energy > 0.0 ? weighted / energy : entries[run.first].off_axis);
+			FlareTrace trace = { { sinf(off_axis), 0.f, -cosf(off_axis) }, 1.f };
+			traces.push_back(trace);
+
+			for (int i = run.first; i <= run.last; ++i) {
+				const SceneLight& s = *entries[i].light;
+				lights.push_back(Light(s, cosf(entries[i].azimuth), sinf(entries[i].azimuth), trace_index));
+			}
+		}
+	}
+	void Plan(const vector<SceneLight>& scene, vector<FlareTrace>& traces, vector<FlareLight>& lights) {
+		Plan(scene.data(), (int)scene.size(), traces, lights);
+	}
+};
@@ -0,0 +1,349 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// Instrumentation for the CPU and GPU stages. PROFILE_SCOPE times the rest of its block as a
+// span nested in the spans open on the same thread. PROFILE_COUNT adds to a named counter,
+// such as rays traced or bytes uploaded. Spans measured elsewhere, like the GPU timestamp
+// queries, are added with AddSpan on a track of their own.
+//
+// Each thread writes to its own log, so recording takes no shared lock. Logs are capped, and
+// events past the cap are counted as dropped rather than growing memory. Nothing is recorded
+// or counted unless Profiler.enabled is set, and without PROFILE the macros compile to
+// nothing.
+//
+// WriteChromeTrace writes the JSON chrome://tracing and Perfetto read: one track per thread,
+// counters as counter tracks. Summary aggregates the spans by their path of nested names
+// into total, self, mean and max times.
+//--------------------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+struct ProfileEvent {
+	const char* name;  // string literal, or owned by Profiler.names
+	int64_t begin;     // ns since the profiler's epoch
+	int64_t end;
+	int32_t parent;    // index of the enclosing span in the same log, -1 at the top
+};
+
+struct ProfileCounterSample {
+	int32_t counter;
+	int64_t time;
+	int64_t value;     // running total after the sample
+};
+
+struct ProfileLog {
+	string name;
+	mutex log_mutex;   // only contended while exporting
+	vector<ProfileEvent> events;
+	vector<int32_t> open;
+	vector<ProfileCounterSample> samples;
+	int64_t dropped = 0;
+};
+
+struct ProfileCounter {
+	const char* name;
+	int32_t index;
+	atomic<int64_t> value;
+};
+
+struct Profiler {
+	atomic<bool> enabled{ false };
+	size_t max_events_per_thread = size_t(1) << 20;
+
+	chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+
+	mutex registry_mutex;
+	vector<unique_ptr<ProfileLog>> logs;
+	vector<unique_ptr<ProfileCounter>> counters;
+	map<string, unique_ptr<string>> names;  // names of spans that are not literals
+
+	int64_t Now() const {
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+	}
+
+	ProfileLog& ThreadLog() {
+		static thread_local ProfileLog* log = nullptr;
+		if (!log) {
+			lock_guard<mutex> lock(registry_mutex);
+			logs.emplace_back(new ProfileLog());
+			log = logs.back().get();
+			log->name = "thread " + to_string(logs.size() - 1);
+		}
+		return *log;
+	}
+
+	void NameThread(const string& name) {
+		ProfileLog& log = ThreadLog();
+		lock_guard<mutex> lock(log.log_mutex);
+		log.name = name;
+	}
+
+	// A log of its own for spans not measured on a CPU thread, e.g. "GPU"
+	ProfileLog& Track(const string& name) {
+		lock_guard<mutex> lock(registry_mutex);
+		for (unique_ptr<ProfileLog>& log : logs)
+			if (log->name == name)
+				return *log;
+		logs.emplace_back(new ProfileLog());
+		logs.back()->name = name;
+		return *logs.back();
+	}
+
+	// A stable copy of a name built at run time
+	const char* Name(const string& name) {
+		lock_guard<mutex> lock(registry_mutex);
+		unique_ptr<string>& stored = names[name];
+		if (!stored)
+			stored.reset(new string(name));
+		return stored->c_str();
+	}
+
+	ProfileCounter& Counter(const char* name) {
+		lock_guard<mutex> lock(registry_mutex);
+		for (unique_ptr<ProfileCounter>& counter : counters)
+			if (!strcmp(counter->name, name))
+				return *counter;
+		counters.emplace_back(new ProfileCounter());
+		ProfileCounter& counter = *counters.back();
+		counter.name = name;
+		counter.index = (int32_t)counters.size() - 1;
+		counter.value = 0;
+		return counter;
+	}
+
+	// Returns the event's index, -1 when not recording
+	int32_t Begin(const char* name) {
+		if (!enabled)
+			return -1;
+
+		ProfileLog& log = ThreadLog();
+		lock_guard<mutex> lock(log.log_mutex);
+		if (log.events.size() >= max_events_per_thread) {
+			log.dropped++;
+			return -1;
+		}
+
+		ProfileEvent event = { name, Now(), -1, log.open.empty() ? -1 : log.open.back() };
+		log.events.push_back(event);
+		log.open.push_back((int32_t)log.events.size() - 1);
+		return log.open.back();
+	}
+
+	void End(int32_t index) {
+		if (index < 0)
+			return;
+
+		ProfileLog& log = ThreadLog();
+		lock_guard<mutex> lock(log.log_mutex);
+		if (index < (int32_t)log.events.size())
+			log.events[index].end = Now();
+		if (!log.open.empty() && log.open.back() == index)
+			log.open.pop_back();
+	}
+
+	void Count(ProfileCounter& counter, int64_t amount) {
+		if (!enabled)
+			return;
+
+		int64_t value = counter.value.fetch_add(amount, memory_order_relaxed) + amount;
+
+		ProfileLog& log = ThreadLog();
+		lock_guard<mutex> lock(log.log_mutex);
+		if (log.samples.size() >= max_events_per_thread) {
+			log.dropped++;
+			return;
+		}
+		ProfileCounterSample sample = { counter.index, Now(), value };
+		log.samples.push_back(sample);
+	}
+
+	// A finished span with times in ns on the profiler's clock. Returns its index, the parent
+	// of spans nested in it
+	int32_t AddSpan(ProfileLog& track, const char* name, int64_t begin, int64_t end, int32_t parent = -1) {
+		if (!enabled)
+			return -1;
+
+		lock_guard<mutex> lock(track.log_mutex);
+		if (track.events.size() >= max_events_per_thread) {
+			track.dropped++;
+			return -1;
+		}
+		ProfileEvent event = { name, begin, end, parent };
+		track.events.push_back(event);
+		return (int32_t)track.events.size() - 1;
+	}
+
+	// Forgets the recorded spans and samples and zeroes the counters. Meant for between frames,
+	// spans open across it are lost
+	void Clear() {
+		lock_guard<mutex> lock(registry_mutex);
+		for (unique_ptr<ProfileLog>& log : logs) {
+			lock_guard<mutex> log_lock(log->log_mutex);
+			log->events.clear();
+			log->open.clear();
+			log->samples.clear();
+			log->dropped = 0;
+		}
+		for (unique_ptr<ProfileCounter>& counter : counters)
+			counter->value = 0;
+	}
+
+	static void WriteJSONString(FILE* file, const char* s) {
+		fputc('"', file);
+		for (; *s; ++s) {
+			if (*s == '"' || *s == '\\')
+				fputc('\\', file);
+			if ((unsigned char)*s >= 0x20)
+				fputc(*s, file);
+		}
+		fputc('"', file);
+	}
+
+	bool WriteChromeTrace(const string& path) {
+		FILE* file = fopen(path.c_str(), "wb");
+		if (!file)
+			return false;
+
+		lock_guard<mutex> lock(registry_mutex);
+		fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		bool first = true;
+		auto separator = [&]() {
+			if (!first)
+				fprintf(file, ",\n");
+			first = false;
+		};
+
+		for (size_t t = 0; t < logs.size(); ++t) {
+			ProfileLog& log = *logs[t];
+			lock_guard<mutex> log_lock(log.log_mutex);
+
+			separator();
+			fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", (int)t);
+			WriteJSONString(file, log.name.c_str());
+			fprintf(file, "}}");
+
+			int64_t now = Now();
+			for (const ProfileEvent& event : log.events) {
+				int64_t end = event.end < 0 ? now : event.end;
+				separator();
+				fprintf(file, "{\"name\":");
+				WriteJSONString(file, event.name);
+				fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", (int)t, event.begin / 1000.0, (end - event.begin) / 1000.0);
+			}
+
+			for (const ProfileCounterSample& sample : log.samples) {
+				separator();
+				fprintf(file, "{\"name\":");
+				WriteJSONString(file, counters[sample.counter]->name);
+				fprintf(file, ",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"value\":%lld}}", (int)t, sample.time / 1000.0, (long long)sample.value);
+			}
+		}
+
+		fprintf(file, "\n]}\n");
+		return fclose(file) == 0;
+	}
+
+	// Spans aggregated by path over every thread, longest total first, then the counters
+	string Summary() {
+		struct Total {
+			int64_t count = 0;
+			int64_t total = 0;
+			int64_t self = 0;
+			int64_t longest = 0;
+		};
+		map<string, Total> totals;
+		int64_t dropped = 0;
+
+		lock_guard<mutex> lock(registry_mutex);
+		for (unique_ptr<ProfileLog>& log : logs) {
+			lock_guard<mutex> log_lock(log->log_mutex);
+			dropped += log->dropped;
+
+			vector<string> paths(log->events.size());
+			vector<int64_t> children(log->events.size(), 0);
+			for (size_t i = 0; i < log->events.size(); ++i) {
+				const ProfileEvent& event = log->events[i];
+				paths[i] = event.parent >= 0 ? paths[event.parent] + " / " + event.name : log->name + ": " + event.name;
+				if (event.end >= 0 && event.parent >= 0)
+					children[event.parent] += event.end - event.begin;
+			}
+
+			for (size_t i = 0; i < log->events.size(); ++i) {
+				const ProfileEvent& event = log->events[i];
+				if (event.end < 0)
+					continue;
+				int64_t duration = event.end - event.begin;
+				Total& total = totals[paths[i]];
+				total.count++;
+				total.total += duration;
+				total.self += duration - children[i];
+				total.longest = max(total.longest, duration);
+			}
+		}
+
+		vector<pair<string, Total>> sorted(totals.begin(), totals.end());
+		sort(sorted.begin(), sorted.end(), [](const pair<string, Total>& a, const pair<string, Total>& b) { return a.second.total > b.second.total; });
+
+		string text;
+		char line[512];
+		snprintf(line, sizeof(line), "%10s %10s %10s %10s %8s  %s\n", "total ms", "self ms", "mean ms", "max ms", "count", "span");
+		text += line;
+		for (const pair<string, Total>& entry : sorted) {
+			const Total& t = entry.second;
+			snprintf(line, sizeof(line), "%10.3f %10.3f %10.3f %10.3f %8lld  %s\n",
+				t.total * 1e-6, t.self * 1e-6, t.total * 1e-6 / t.count, t.longest * 1e-6, (long long)t.count, entry.first.c_str());
+			text += line;
+		}
+
+		text += "\n";
+		for (unique_ptr<ProfileCounter>& counter : counters) {
+			snprintf(line, sizeof(line), "%20lld  %s\n", (long long)counter->value.load(), counter->name);
+			text += line;
+		}
+		if (dropped > 0) {
+			snprintf(line, sizeof(line), "%20lld  events dropped past max_events_per_thread\n", (long long)dropped);
+			text += line;
+		}
+		return text;
+	}
+} Profiler;
+
+struct ProfileScope {
+	int32_t index;
+
+	explicit ProfileScope(const char* name) : index(Profiler.Begin(name)) {}
+	~ProfileScope() {
+		Profiler.End(index);
+	}
+
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+
+#if defined(PROFILE)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#define PROFILE_COUNT(name, amount) do { \
+		static ProfileCounter& PROFILE_CONCAT(profile_counter_, __LINE__) = Profiler.Counter(name); \
+		Profiler.Count(PROFILE_CONCAT(profile_counter_, __LINE__), (int64_t)(amount)); \
+	} while (0)
+#else
+#define PROFILE_SCOPE(name) do {} while (0)
+#define PROFILE_COUNT(name, amount) do {} while (0)
+#endif
@@ -0,0 +1,171 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// Where and why the traced rays of every ghost end. FlareContext::CollectRayStats traces the
+// current lights once more with SpectralTracer recording a RayEnd per ray, and adds them here
+// per ghost and per interface. Rays that reach the sensor add their reflectance to the
+// ghost's energy.
+//
+// Report ranks the ghosts by energy per traced ray, the ghosts that cost the most rays for
+// the least light first. Each row shows the share of all lost rays and of all energy the
+// ghost accounts for, how much energy culling everything up to that row would lose, and
+// where most of its rays are lost. The interfaces follow with the rays each one ends and why.
+// This is where culling, pupil bounds and tessellation are best spent.
+//--------------------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ray_trace.h"
+
+using namespace std;
+
+inline const char* RayFateName(int fate) {
+	static const char* names[NUM_RAY_FATES] = { "survived", "clipped", "blocked", "missed", "total reflection" };
+	return fate >= 0 && fate < NUM_RAY_FATES ? names[fate] : "?";
+}
+
+struct GhostRayStats {
+	int bounce1 = 0, bounce2 = 0;
+	int64_t rays = 0;
+	int64_t fates[NUM_RAY_FATES] = {};
+	vector<int64_t> ends;         // [interface * NUM_RAY_FATES + fate] of the rays lost
+	double energy = 0.0;          // reflectance summed over the rays that survived
+	double clipped_energy = 0.0;  // over the rays clipped by a height
+
+	void Reset(int num_interfaces) {
+		rays = 0;
+		fill(fates, fates + NUM_RAY_FATES, 0);
+		ends.assign(num_interfaces * NUM_RAY_FATES, 0);
+		energy = clipped_energy = 0.0;
+	}
+
+	void Add(const RayEnd& end, float intensity) {
+		rays++;
+		fates[end.fate]++;
+		if (end.fate == RAY_SURVIVED)
+			energy += intensity;
+		else if (end.interface >= 0)
+			ends[end.interface * NUM_RAY_FATES + end.fate]++;
+		if (end.fate == RAY_CLIPPED)
+			clipped_energy += intensity;
+	}
+
+	int64_t Lost() const {
+		return rays - fates[RAY_SURVIVED];
+	}
+};
+
+struct RayStats {
+	int num_interfaces = 0;
+	vector<GhostRayStats> ghosts;
+	mutex stats_mutex;
+
+	// ghost_bounces as FlareContext::ghosts, bounce1, bounce2, 0, 0 per ghost
+	void Reset(const vector<float>& ghost_bounces, int interfaces) {
+		num_interfaces = interfaces;
+		ghosts.resize(ghost_bounces.size() / 4);
+		for (size_t g = 0; g < ghosts.size(); ++g) {
+			ghosts[g].bounce1 = (int)ghost_bounces[g * 4];
+			ghosts[g].bounce2 = (int)ghost_bounces[g * 4 + 1];
+			ghosts[g].Reset(interfaces);
+		}
+	}
+
+	// Adds what one worker gathered for a ghost
+	void Merge(int ghost, const GhostRayStats& local) {
+		lock_guard<mutex> lock(stats_mutex);
+		GhostRayStats& g = ghosts[ghost];
+		g.rays += local.rays;
+		for (int f = 0; f < NUM_RAY_FATES; ++f)
+			g.fates[f] += local.fates[f];
+		for (size_t i = 0; i < g.ends.size(); ++i)
+			g.ends[i] += local.ends[i];
+		g.energy += local.energy;
+		g.clipped_energy += local.clipped_energy;
+	}
+
+	string Report(int max_ghosts = 40) const {
+		int64_t rays = 0, lost = 0;
+		int64_t fates[NUM_RAY_FATES] = {};
+		double energy = 0.0;
+		vector<int64_t> interface_ends(num_interfaces * NUM_RAY_FATES, 0);
+		for (const GhostRayStats& g : ghosts) {
+			rays += g.rays;
+			lost += g.Lost();
+			energy += g.energy;
+			for (int f = 0; f < NUM_RAY_FATES; ++f)
+				fates[f] += g.fates[f];
+			for (size_t i = 0; i < interface_ends.size(); ++i)
+				interface_ends[i] += g.ends[i];
+		}
+
+		string text;
+		char line[256];
+		auto percent = [](double a, double b) { return b > 0.0 ? 100.0 * a / b : 0.0; };
+
+		snprintf(line, sizeof(line), "%lld rays over %d ghosts, energy %.6g\n", (long long)rays, (int)ghosts.size(), energy);
+		text += line;
+		for (int f = 0; f < NUM_RAY_FATES; ++f) {
+			snprintf(line, sizeof(line), "%12lld %6.2f%%  %s\n", (long long)fates[f], percent((double)fates[f], (double)rays), RayFateName(f));
+			text += line;
+		}
+
+		// Least energy per traced ray first
+		vector<int> order(ghosts.size());
+		for (size_t g = 0; g < order.size(); ++g)
+			order[g] = (int)g;
+		sort(order.begin(), order.end(), [&](int a, int b) {
+			double ea = ghosts[a].rays ? ghosts[a].energy / ghosts[a].rays : 0.0;
+			double eb = ghosts[b].rays ? ghosts[b].energy / ghosts[b].rays : 0.0;
+			return ea != eb ? ea < eb : ghosts[a].Lost() > ghosts[b].Lost();
+		});
+
+		snprintf(line, sizeof(line), "\n%5s %7s %9s %9s %9s %11s %12s  %s\n", "rank", "ghost", "alive %", "lost %", "energy %", "culled %", "energy/ray", "most lost at");
+		text += line;
+		double culled = 0.0;
+		for (size_t r = 0; r < order.size(); ++r) {
+			const GhostRayStats& g = ghosts[order[r]];
+			culled += g.energy;
+			if ((int)r >= max_ghosts)
+				continue;
+
+			int worst = -1;
+			for (int i = 0; i < (int)g.ends.size(); ++i)
+				if (g.ends[i] > 0 && (worst < 0 || g.ends[i] > g.ends[worst]))
+					worst = i;
+			char where[64] = "-";
+			if (worst >= 0)
+				snprintf(where, sizeof(where), "%s at %d (%.0f%%)", RayFateName(worst % NUM_RAY_FATES), worst / NUM_RAY_FATES, percent((double)g.ends[worst], (double)g.rays));
+
+			char name[16];
+			snprintf(name, sizeof(name), "%d/%d", g.bounce1, g.bounce2);
+			snprintf(line, sizeof(line), "%5d %7s %9.2f %9.2f %9.4f %11.4f %12.4g  %s\n", (int)r + 1, name,
+				percent((double)g.fates[RAY_SURVIVED], (double)g.rays), percent((double)g.Lost(), (double)lost),
+				percent(g.energy, energy), percent(culled, energy), g.rays ? g.energy / g.rays : 0.0, where);
+			text += line;
+		}
+		if ((int)order.size() > max_ghosts) {
+			snprintf(line, sizeof(line), "%5s %d more\n", "...", (int)order.size() - max_ghosts);
+			text += line;
+		}
+
+		snprintf(line, sizeof(line), "\n%9s %12s %12s %12s %12s %9s\n", "interface", "clipped", "blocked", "missed", "reflected", "lost %");
+		text += line;
+		for (int i = 0; i < num_interfaces; ++i) {
+			const int64_t* e = &interface_ends[i * NUM_RAY_FATES];
+			int64_t total = e[RAY_CLIPPED] + e[RAY_BLOCKED] + e[RAY_MISSED] + e[RAY_TOTAL_REFLECTION];
+			if (total == 0)
+				continue;
+			snprintf(line, sizeof(line), "%9d %12lld %12lld %12lld %12lld %9.2f\n", i, (long long)e[RAY_CLIPPED], (long long)e[RAY_BLOCKED],
+				(long long)e[RAY_MISSED], (long long)e[RAY_TOTAL_REFLECTION], percent((double)total, (double)lost));
+			text += line;
+		}
+		return text;
+	}
+};
@@ -51,6 +51,11 @@ struct LensInterface {
 	float pos;
 	float w;
 
+	// Aspheric surfaces add a conic constant and the r^4, r^6, r^8 and r^10 terms to the sag
+	// of the sphere, all 0 for a sphere. See testASPHERE
+	float conic;
+	float aspheric_padding[3];
+	vec4 aspheric;
 };
 
 struct Ray {
@@ -58,6 +63,26 @@ struct Ray {
 	vec4 tex;
 };
 
+struct ApertureShape {
+	float num_of_blades;
+	float opening;
+};
+
+// Why a traced ray ended, reported by Trace and SpectralTracer when asked (see ray_stats.h)
+enum RayFate {
+	RAY_SURVIVED,          // reached the sensor
+	RAY_CLIPPED,           // crossed an interface above its height
+	RAY_BLOCKED,           // stopped by the aperture blades
+	RAY_MISSED,            // missed an interface
+	RAY_TOTAL_REFLECTION,  // totally reflected where it should have refracted
+	NUM_RAY_FATES
+};
+
+struct RayEnd {
+	int fate;       // RayFate
+	int interface;  // where it ended, -1 for a ray that survived
+};
+
 struct Intersection {
 	Intersection() {};
 	vec3 pos;
@@ -93,6 +118,39 @@ float length_xy(vec3& v) {
 	return sqrt(v.x * v.x + v.y * v.y);
 }
 
+float saturate(float v) {
+	return min(max(v, 0.f), 1.f);
+}
+
+float smax(float a, float b, float k) {
+	float diff = a - b;
+	float h = saturate(0.5f + 0.5f * diff / k);
+	return b + h * (diff + k * (1.0f - h));
+}
+
+// Same rounded blade polygon as PSAperture, rays at or beyond APERTURE_CUTOFF are fully occluded
+#define APERTURE_RADIUS 0.7f
+#define APERTURE_FADE 0.1f
+#define APERTURE_CUTOFF (APERTURE_RADIUS + APERTURE_FADE)
+
+float ApertureBladeDistance(float x, float y, const ApertureShape& aperture) {
+	int num_of_blades = (int)aperture.num_of_blades;
+
+	float a = (atan2(x, y) + aperture.opening) / (2.f * PI) + 3.f / 4.f;
+	float o = a * num_of_blades + 0.5f;
+	o -= floorf(o);
+	float w2 = 0.025f + (0.001f - 0.025f) * saturate((num_of_blades - 4) / 10.f);
+	float s2 = sinf(o * 2.f * PI) * w2;
+
+	float signed_distance = 0.f;
+	for (int i = 0; i < num_of_blades; ++i) {
+		float angle = aperture.opening + (i / float(num_of_blades)) * 2.f * PI;
+		signed_distance = smax(signed_distance, cosf(angle) * x + sinf(angle) * y, 0.1f);
+	}
+
+	return signed_distance + s2;
+}
+
 Intersection testFLAT(Ray r, LensInterface F) {
 	Intersection i;
 	i.pos = r.pos + r.dir * ((F.center.z - r.pos.z) / r.dir.z);
@@ -103,6 +161,10 @@ Intersection testFLAT(Ray r, LensInterface F) {
 	return i;
 }
 
+bool IsAspheric(const LensInterface& F) {
+	return F.conic != 0.f || F.aspheric.x != 0.f || F.aspheric.y != 0.f || F.aspheric.z != 0.f || F.aspheric.a != 0.f;
+}
+
 Intersection testSPHERE(Ray r, LensInterface F) {
 	Intersection i;
 	vec3 D = r.pos - F.center;
@@ -125,6 +187,53 @@ Intersection testSPHERE(Ray r, LensInterface F) {
 	return i;
 }
 
+// Newton steps from the base sphere's hit, enough for the polynomial terms of real lenses
+#define ASPHERE_STEPS 3
+
+// Sag of an aspheric interface at u = x^2 + y^2 and its derivative in u. The surface is
+// z = pos - sag, with c = 1 / radius the conic part is c u / (1 + q), q = sqrt(1 - (1 + k) c^2 u),
+// whose derivative is c / 2q
+void AsphereSag(const LensInterface& F, float u, float& sag, float& slope) {
+	float c = 1.f / F.radius;
+	float q = sqrtf(max(1.f - (1.f + F.conic) * c * c * u, 1e-6f));
+	const vec4& a = F.aspheric;
+	sag = c * u / (1.f + q) + u * u * (a.x + u * (a.y + u * (a.z + u * a.a)));
+	slope = c / (2.f * q) + u * (2.f * a.x + u * (3.f * a.y + u * (4.f * a.z + u * 5.f * a.a)));
+}
+
+// Starts from where the ray meets the base sphere, or the vertex plane when it misses it, and
+// takes a fixed number of Newton steps on f(t) = z(t) - pos + sag(x(t)^2 + y(t)^2). No branches
+// on the ray, the normal is the surface gradient (2x sag', 2y sag', 1)
+Intersection testASPHERE(Ray r, LensInterface F) {
+	Intersection i;
+	vec3 D = r.pos - F.center;
+	float B = dot(D, r.dir);
+	float B2_C = B * B - (dot(D, D) - F.radius * F.radius);
+	float sgn = (F.radius * r.dir.z) > 0 ? 1.f : -1.f;
+	float t = B2_C >= 0.f ? sqrtf(B2_C) * sgn - B : (F.pos - r.pos.z) / r.dir.z;
+
+	float sag, slope;
+	for (int k = 0; k < ASPHERE_STEPS; ++k) {
+		vec3 p = r.dir * t + r.pos;
+		AsphereSag(F, p.x * p.x + p.y * p.y, sag, slope);
+		float f = p.z - F.pos + sag;
+		float df = r.dir.z + 2.f * slope * (p.x * r.dir.x + p.y * r.dir.y);
+		t -= f / df;
+	}
+
+	i.pos = r.dir * t + r.pos;
+	float u = i.pos.x * i.pos.x + i.pos.y * i.pos.y;
+	AsphereSag(F, u, sag, slope);
+	float c = 1.f / F.radius;
+	i.norm = normalize(vec3(2.f * slope * i.pos.x, 2.f * slope * i.pos.y, 1.f));
+	if (dot(i.norm, r.dir) > 0) i.norm = -i.norm;
+	i.theta = acos(min(max(dot(-r.dir, i.norm), -1.f), 1.f));
+	i.hit = (1.f + F.conic) * c * c * u <= 1.f && fabsf(i.pos.z - F.pos + sag) < 1e-3f;
+	i.inverted = t < 0;
+
+	return i;
+}
+
 float FresnelAR(
 	float theta0, 
 	float lambda,
@@ -159,11 +268,14 @@ float FresnelAR(
 Ray Trace(
 	Ray r,
 	float lambda,
-	std::vector<LensInterface>& INTERFACE,
+	const std::vector<LensInterface>& INTERFACE,
 	std::vector<vec3>& intersections1,
 	std::vector<vec3>& intersections2,
 	std::vector<vec3>& intersections3,
-	int2 STR
+	int2 STR,
+	const ApertureShape* aperture = nullptr,
+	int aperture_index = AP_IDX,
+	RayEnd* end = nullptr
 ) {
 
 	intersections1.clear();
@@ -178,8 +290,9 @@ Ray Trace(
 	int DELTA = 1;
 	int T = 1;
 	int k;
+	RayEnd fate = { RAY_SURVIVED, -1 };
 	for (k = 0; k < LEN; k++, T += DELTA) {
-		LensInterface F = INTERFACE[T];
+		const LensInterface& F = INTERFACE[T];
 
 		bool bReflect = (T == STR[PHASE]) ? true : false;
 		if (bReflect) {
@@ -187,9 +300,9 @@ Ray Trace(
 			PHASE++;
 		}
 		
-		Intersection i = F.flat ? testFLAT(r, F) : testSPHERE(r, F);
+		Intersection i = F.flat ? testFLAT(r, F) : IsAspheric(F) ? testASPHERE(r, F) : testSPHERE(r, F);
 		
-		if (!i.hit) break;
+		if (!i.hit) { fate = { RAY_MISSED, T }; break; }
 
 		if (PHASE == 0) {
 			intersections1.push_back(i.pos);
@@ -202,13 +315,16 @@ Ray Trace(
 			intersections3.push_back(i.pos);
 		}
 
-		if (abs(i.pos.y) > F.sa) break;
+		if (abs(i.pos.y) > F.sa) { fate = { RAY_CLIPPED, T }; break; }
 
 		if (!F.flat)
 			r.tex.z = max(r.tex.z, length_xy(i.pos) / F.sa);
-		else if (T == AP_IDX) {
-			r.tex.x = i.pos.x / INTERFACE[AP_IDX].sa;
-			r.tex.y = i.pos.y / INTERFACE[AP_IDX].sa;
+		else if (T == aperture_index) {
+			r.tex.x = i.pos.x / INTERFACE[aperture_index].sa;
+			r.tex.y = i.pos.y / INTERFACE[aperture_index].sa;
+
+			// Blocked by the aperture blades
+			if (aperture && ApertureBladeDistance(r.tex.x, r.tex.y, *aperture) >= APERTURE_CUTOFF) { fate = { RAY_BLOCKED, T }; break; }
 		};
 
 		r.dir = normalize(i.pos-r.pos);
@@ -224,7 +340,7 @@ Ray Trace(
 		
 		if (!bReflect) {
 			r.dir = refract(r.dir , i.norm , n0 / n2);
-			if (r.dir == 0) break;
+			if (r.dir == 0) { fate = { RAY_TOTAL_REFLECTION, T }; break; }
 		}
 		else {
 			r.dir = reflect(r.dir , i.norm);
@@ -234,6 +350,7 @@ Ray Trace(
 	}
 
 	if (k<LEN) r.tex.a = 0;
+	if (end) *end = fate;
 
 	return r;
 }
\ No newline at end of file
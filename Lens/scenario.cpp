@@ -0,0 +1,276 @@
+//--------------------------------------------------------------------------------------
+// Headless runner of scenario files (scenario.h), a console program next to the viewer:
+//
+//   Scenario <file> [--repeat n] [--update-golden] [--allow-missing-golden] [--output directory] [--json path]
+//
+// Renders every frame of the scenario with the CPU flare renderer (flare_context.h) and
+// times its stages: planning the lights, the trace, the raster and the tonemap. Reports the
+// p50, p95 and p99 of each over all frames and repeats, and the peak memory of the process.
+// Frames are compared to the golden PFMs of the scenario within its tolerance, or written
+// as the new golden images with --update-golden. --output writes every frame as a PFM to
+// look at. A frame without a golden image fails like a frame that differs, unless
+// --allow-missing-golden skips it. The exit code is 0 when every frame checked matched, 2 when
+// one did not and 1 on errors.
+//--------------------------------------------------------------------------------------
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#include <direct.h>
+#else
+#include <sys/resource.h>
+#include <sys/stat.h>
+#endif
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "flare_context.h"
+#include "hdr_image.h"
+#include "scenario.h"
+
+using namespace std;
+
+// Largest working set the process had so far
+static size_t PeakMemory() {
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize;
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+static void MakeDirectories(const string& path) {
+	for (size_t i = 1; i <= path.size(); ++i) {
+		if (i < path.size() && path[i] != '/' && path[i] != '\\')
+			continue;
+	#if defined(_WIN32)
+		_mkdir(path.substr(0, i).c_str());
+	#else
+		mkdir(path.substr(0, i).c_str(), 0755);
+	#endif
+	}
+}
+
+struct StageTimes {
+	const char* name;
+	vector<double> ms;
+
+	// Nearest rank
+	double Percentile(double p) const {
+		if (ms.empty())
+			return 0.0;
+		vector<double> sorted = ms;
+		sort(sorted.begin(), sorted.end());
+		size_t rank = (size_t)ceil(p / 100.0 * sorted.size());
+		return sorted[min(sorted.size(), max((size_t)1, rank)) - 1];
+	}
+
+	double Mean() const {
+		double sum = 0.0;
+		for (double t : ms)
+			sum += t;
+		return ms.empty() ? 0.0 : sum / ms.size();
+	}
+};
+
+struct FrameCheck {
+	int frame;
+	bool found;
+	ImageDifference difference;
+	bool pass;
+};
+
+enum { STAGE_LIGHTS, STAGE_TRACE, STAGE_RASTER, STAGE_TONEMAP, STAGE_FRAME, NUM_STAGES };
+
+static bool LoadLens(const Scenario& scenario, FlareContext& context, LensPack& pack, string& error) {
+	if (!scenario.lens_name.empty()) {
+		LensView view;
+		if (!pack.Open(scenario.Path(scenario.lens))) {
+			error = "cannot open lens pack " + scenario.Path(scenario.lens);
+			return false;
+		}
+		if (!pack.Find(scenario.lens_name, view, &error) || !context.SetLens(view)) {
+			error = scenario.lens + ": " + (error.empty() ? "no aperture stop" : error);
+			return false;
+		}
+		return true;
+	}
+
+	LensPrescription prescription;
+	if (!prescription.Load(scenario.Path(scenario.lens), &error))
+		return false;
+	if (!context.SetLens(prescription)) {
+		error = scenario.lens + ": no aperture stop";
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	string path, output, json;
+	int repeat = 1;
+	bool update_golden = false;
+	bool allow_missing_golden = false;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		auto value = [&]() -> const char* { return i + 1 < argc ? argv[++i] : ""; };
+		if (arg == "--repeat")
+			repeat = max(1, atoi(value()));
+		else if (arg == "--update-golden")
+			update_golden = true;
+		else if (arg == "--allow-missing-golden")
+			allow_missing_golden = true;
+		else if (arg == "--output")
+			output = value();
+		else if (arg == "--json")
+			json = value();
+		else if (path.empty() && arg[0] != '-')
+			path = arg;
+		else
+			path.clear(), i = argc;
+	}
+	if (path.empty()) {
+		fprintf(stderr, "usage: Scenario <file> [--repeat n] [--update-golden] [--allow-missing-golden] [--output directory] [--json path]\n");
+		return 1;
+	}
+
+	Scenario scenario;
+	string error;
+	FlareContext context;
+	LensPack pack;
+	if (!scenario.Load(path, &error) || !LoadLens(scenario, context, pack, error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+
+	if (update_golden && scenario.golden.empty()) {
+		fprintf(stderr, "%s: no golden directory to update\n", path.c_str());
+		return 1;
+	}
+	if (update_golden)
+		MakeDirectories(scenario.Path(scenario.golden));
+	if (!output.empty())
+		MakeDirectories(output);
+
+	StageTimes stages[NUM_STAGES] = { { "lights", {} }, { "trace", {} }, { "raster", {} }, { "tonemap", {} }, { "frame", {} } };
+	vector<FrameCheck> checks;
+	vector<SceneLight> scene;
+	HDRImage image, reference;
+	image.Resize(scenario.width, scenario.height);
+	vector<uint8_t> rgba;
+
+	auto now = []() { return chrono::steady_clock::now(); };
+	auto ms = [](chrono::steady_clock::time_point a, chrono::steady_clock::time_point b) { return chrono::duration<double, milli>(b - a).count(); };
+
+	for (int pass = 0; pass < repeat; ++pass) {
+		for (int frame = 0; frame < scenario.frames; ++frame) {
+			auto start = now();
+			scenario.Frame(frame, context.settings, scene);
+			context.SetLights(scene);
+			auto planned = now();
+			context.Update();
+			auto traced = now();
+			context.Render(FlareTarget(image));
+			auto rasterized = now();
+			image.ToneMap(rgba);
+			auto end = now();
+
+			stages[STAGE_LIGHTS].ms.push_back(ms(start, planned));
+			stages[STAGE_TRACE].ms.push_back(ms(planned, traced));
+			stages[STAGE_RASTER].ms.push_back(ms(traced, rasterized));
+			stages[STAGE_TONEMAP].ms.push_back(ms(rasterized, end));
+			stages[STAGE_FRAME].ms.push_back(ms(start, end));
+
+			if (pass > 0)
+				continue;
+
+			if (!output.empty()) {
+				char file[32];
+				snprintf(file, sizeof(file), "/frame_%04d.pfm", frame);
+				image.SavePFM(output + file);
+			}
+
+			if (scenario.golden.empty())
+				continue;
+
+			if (update_golden) {
+				if (!image.SavePFM(scenario.GoldenPath(frame))) {
+					fprintf(stderr, "cannot write %s\n", scenario.GoldenPath(frame).c_str());
+					return 1;
+				}
+				continue;
+			}
+
+			FrameCheck check = { frame, reference.LoadPFM(scenario.GoldenPath(frame)), {}, false };
+			if (check.found) {
+				check.difference = ImageDifference::Compare(image, reference);
+				check.pass = check.difference.Within(scenario.tolerance_rms, scenario.tolerance_max);
+			}
+			checks.push_back(check);
+		}
+	}
+
+	size_t peak = PeakMemory();
+	printf("%s: %d frames x %d, %dx%d, %s, %d ghosts\n\n", scenario.name.c_str(), scenario.frames, repeat, scenario.width, scenario.height,
+		scenario.lens_name.empty() ? scenario.lens.c_str() : scenario.lens_name.c_str(), context.NumGhosts());
+	printf("%-8s %10s %10s %10s %10s %10s\n", "stage", "p50 ms", "p95 ms", "p99 ms", "mean ms", "max ms");
+	for (const StageTimes& stage : stages)
+		printf("%-8s %10.3f %10.3f %10.3f %10.3f %10.3f\n", stage.name, stage.Percentile(50.0), stage.Percentile(95.0), stage.Percentile(99.0), stage.Mean(), stage.Percentile(100.0));
+	printf("\npeak memory %.1f MB\n", peak / (1024.0 * 1024.0));
+
+	int failed = 0, skipped = 0;
+	const FrameCheck* worst = nullptr;
+	for (const FrameCheck& check : checks) {
+		if (!check.found) {
+			skipped++;
+			continue;
+		}
+		if (!worst || check.difference.relative_rms > worst->difference.relative_rms)
+			worst = &check;
+		if (!check.pass) {
+			failed++;
+			printf("frame %d: differs, relative rms %.6f largest %.6f%s\n", check.frame, check.difference.relative_rms, check.difference.largest, check.difference.same_size ? "" : " (size)");
+		}
+	}
+	if (update_golden)
+		printf("golden images written to %s\n", scenario.Path(scenario.golden).c_str());
+	else if ((int)checks.size() > skipped)
+		printf("golden: %d of %d frames within tolerance %g rms, %g largest%s\n", (int)checks.size() - skipped - failed, (int)checks.size() - skipped, scenario.tolerance_rms, scenario.tolerance_max,
+			worst ? (", worst frame " + to_string(worst->frame)).c_str() : "");
+	if (skipped)
+		printf("golden: %d of %d frames %s, no golden image in %s (write them with --update-golden)\n", skipped, (int)checks.size(),
+			allow_missing_golden ? "skipped" : "missing", scenario.Path(scenario.golden).c_str());
+
+	if (!json.empty()) {
+		FILE* file = fopen(json.c_str(), "wb");
+		if (!file) {
+			fprintf(stderr, "cannot write %s\n", json.c_str());
+			return 1;
+		}
+		fprintf(file, "{\n\"scenario\":\"%s\",\"frames\":%d,\"repeat\":%d,\"width\":%d,\"height\":%d,\"ghosts\":%d,\n\"peak_memory_bytes\":%llu,\n\"stages\":{",
+			scenario.name.c_str(), scenario.frames, repeat, scenario.width, scenario.height, context.NumGhosts(), (unsigned long long)peak);
+		for (int s = 0; s < NUM_STAGES; ++s)
+			fprintf(file, "%s\n\"%s\":{\"p50\":%.4f,\"p95\":%.4f,\"p99\":%.4f,\"mean\":%.4f,\"max\":%.4f}", s ? "," : "", stages[s].name,
+				stages[s].Percentile(50.0), stages[s].Percentile(95.0), stages[s].Percentile(99.0), stages[s].Mean(), stages[s].Percentile(100.0));
+		fprintf(file, "},\n\"golden_skipped\":%d,\n\"golden\":[", skipped);
+		for (size_t i = 0; i < checks.size(); ++i)
+			fprintf(file, "%s\n{\"frame\":%d,\"found\":%s,\"relative_rms\":%.8f,\"largest\":%.8f,\"pass\":%s}", i ? "," : "", checks[i].frame, checks[i].found ? "true" : "false",
+				checks[i].difference.relative_rms, checks[i].difference.largest, checks[i].pass ? "true" : "false");
+		fprintf(file, "]\n}\n");
+		fclose(file);
+	}
+
+	return failed || (skipped && !allow_missing_golden) ? 2 : 0;
+}
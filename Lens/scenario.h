@@ -0,0 +1,270 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// Reproducible flare workloads. A scenario file names the lens, the image size and how the
+// lights and lens settings move over its frames, so a run does not depend on the mouse or
+// on which keys were pressed:
+//
+//   lens lenses/nikon_28_75mm.lens        prescription, or: lens <pack> <lens name>
+//   resolution 640 360
+//   frames 48
+//   light -0.5 0.2 0.8 -0.3 6000          light moving from (x, y) to (x, y), temperature
+//   aperture 7 4                          value at the first and the last frame
+//   blades 5 8
+//   coating 1.25 1.25
+//   zoom 0 1
+//   focus 0 0
+//   dispersion on                         on | off, with: samples 8
+//   tesselation 32
+//   golden golden/nikon_sweep             directory of the frames' reference PFMs
+//   tolerance 0.002 0.05                  relative rms and largest difference allowed
+//
+// Light positions are in the window's -1 to 1 coordinates, the direction the viewer gives a
+// light dragged there with the mouse. Every light line adds a light. Swept values move
+// linearly from the first to the last frame, a single value holds. Relative paths are
+// relative to the scenario file. '#' starts a comment.
+//--------------------------------------------------------------------------------------
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "flare_context.h"
+#include "hdr_image.h"
+
+using namespace std;
+
+struct ScenarioRange {
+	float first;
+	float last;
+
+	float At(float t) const {
+		return first + (last - first) * t;
+	}
+};
+
+struct ScenarioLight {
+	ScenarioRange x, y;
+	float temperature;
+};
+
+struct Scenario {
+	string name;
+	string directory;  // of the scenario file, what relative paths start from
+
+	string lens;
+	string lens_name;  // set when lens is a pack
+	int width = 640;
+	int height = 360;
+	int frames = 1;
+	vector<ScenarioLight> lights;
+	ScenarioRange aperture = { 7.f, 7.f };
+	ScenarioRange blades = { 5.f, 5.f };
+	ScenarioRange coating = { 1.25f, 1.25f };
+	ScenarioRange zoom = { 0.f, 0.f };
+	ScenarioRange focus = { 0.f, 0.f };
+	bool dispersion = false;
+	int samples = 8;
+	int tesselation = 32;
+	string golden;
+	float tolerance_rms = 0.002f;
+	float tolerance_max = 0.05f;
+
+	string Path(const string& path) const {
+		bool absolute = !path.empty() && (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'));
+		return absolute || directory.empty() ? path : directory + "/" + path;
+	}
+
+	bool Load(const string& path, string* error = nullptr) {
+		ifstream file(path.c_str(), ios::binary);
+		if (!file) {
+			if (error)
+				*error = "cannot open " + path;
+			return false;
+		}
+
+		size_t slash = path.find_last_of("/\\");
+		directory = slash == string::npos ? "" : path.substr(0, slash);
+		name = path.substr(slash == string::npos ? 0 : slash + 1);
+		name = name.substr(0, name.find('.'));
+
+		stringstream text;
+		text << file.rdbuf();
+		return Parse(text.str(), error);
+	}
+
+	bool Parse(const string& text, string* error = nullptr) {
+		lights.clear();
+
+		istringstream lines(text);
+		string line;
+		for (int line_number = 1; getline(lines, line); ++line_number) {
+			line = line.substr(0, line.find('#'));
+			istringstream tokens(line);
+			vector<string> words;
+			for (string word; tokens >> word;)
+				words.push_back(word);
+			if (words.empty())
+				continue;
+
+			auto fail = [&](const string& message) {
+				if (error)
+					*error = name + ":" + to_string(line_number) + ": " + message;
+				return false;
+			};
+
+			float numbers[5] = {};
+			auto parse = [&](size_t first, size_t count) {
+				for (size_t i = 0; i < count; ++i) {
+					char* end = nullptr;
+					numbers[i] = strtof(words[first + i].c_str(), &end);
+					if (*end != 0)
+						return false;
+				}
+				return true;
+			};
+
+			// One value holds, two sweep
+			auto range = [&](ScenarioRange& r) {
+				if ((words.size() != 2 && words.size() != 3) || !parse(1, words.size() - 1))
+					return fail("expected: " + words[0] + " <value> [<last value>]");
+				r.first = numbers[0];
+				r.last = words.size() == 3 ? numbers[1] : numbers[0];
+				return true;
+			};
+
+			const string& key = words[0];
+			if (key == "lens") {
+				if (words.size() != 2 && words.size() != 3)
+					return fail("expected: lens <prescription> or lens <pack> <lens name>");
+				lens = words[1];
+				lens_name = words.size() == 3 ? words[2] : "";
+			} else if (key == "resolution") {
+				if (words.size() != 3 || !parse(1, 2) || numbers[0] < 1.f || numbers[1] < 1.f)
+					return fail("expected: resolution <width> <height>");
+				width = (int)numbers[0];
+				height = (int)numbers[1];
+			} else if (key == "frames") {
+				if (words.size() != 2 || !parse(1, 1) || numbers[0] < 1.f)
+					return fail("expected: frames <count>");
+				frames = (int)numbers[0];
+			} else if (key == "light") {
+				if ((words.size() != 5 && words.size() != 6) || !parse(1, words.size() - 1))
+					return fail("expected: light <x> <y> <last x> <last y> [<temperature>]");
+				ScenarioLight light = { { numbers[0], numbers[2] }, { numbers[1], numbers[3] }, words.size() == 6 ? numbers[4] : 0.f };
+				lights.push_back(light);
+			} else if (key == "aperture") {
+				if (!range(aperture))
+					return false;
+			} else if (key == "blades") {
+				if (!range(blades))
+					return false;
+			} else if (key == "coating") {
+				if (!range(coating))
+					return false;
+			} else if (key == "zoom") {
+				if (!range(zoom))
+					return false;
+			} else if (key == "focus") {
+				if (!range(focus))
+					return false;
+			} else if (key == "dispersion") {
+				if (words.size() != 2 || (words[1] != "on" && words[1] != "off"))
+					return fail("expected: dispersion on | off");
+				dispersion = words[1] == "on";
+			} else if (key == "samples") {
+				if (words.size() != 2 || !parse(1, 1) || numbers[0] < 1.f)
+					return fail("expected: samples <count>");
+				samples = (int)numbers[0];
+			} else if (key == "tesselation") {
+				if (words.size() != 2 || !parse(1, 1) || numbers[0] < 2.f)
+					return fail("expected: tesselation <rays per side>");
+				tesselation = (int)numbers[0];
+			} else if (key == "golden") {
+				if (words.size() != 2)
+					return fail("expected: golden <directory>");
+				golden = words[1];
+			} else if (key == "tolerance") {
+				if (words.size() != 3 || !parse(1, 2))
+					return fail("expected: tolerance <relative rms> <largest difference>");
+				tolerance_rms = numbers[0];
+				tolerance_max = numbers[1];
+			} else {
+				return fail("unknown keyword " + key);
+			}
+		}
+
+		if (lens.empty()) {
+			if (error)
+				*error = name + ": no lens";
+			return false;
+		}
+		return true;
+	}
+
+	float Time(int frame) const {
+		return frames > 1 ? (float)frame / (float)(frames - 1) : 0.f;
+	}
+
+	// Settings and lights of a frame
+	void Frame(int frame, FlareSettings& settings, vector<SceneLight>& scene) const {
+		float t = Time(frame);
+		settings.width = width;
+		settings.height = height;
+		settings.patch_tesselation = tesselation;
+		settings.aperture_opening = aperture.At(t);
+		settings.number_of_blades = floorf(blades.At(t) + 0.5f);
+		settings.coating_quality = coating.At(t);
+		settings.zoom = zoom.At(t);
+		settings.focus = focus.At(t);
+		settings.dispersion = dispersion;
+		settings.num_spectral_samples = samples;
+
+		scene.clear();
+		for (const ScenarioLight& light : lights) {
+			// As WndProc turns the mouse position into UI.x_dir, UI.y_dir and UpdateGlobals
+			// into the light direction
+			vec3 dir = normalize(vec3(-light.x.At(t) * 0.2f, light.y.At(t) * 0.2f, -1.f));
+			SceneLight l = { { dir.x, dir.y, dir.z }, { 1.f, 1.f, 1.f }, light.temperature };
+			scene.push_back(l);
+		}
+	}
+
+	string GoldenPath(int frame) const {
+		char file[32];
+		snprintf(file, sizeof(file), "frame_%04d.pfm", frame);
+		return Path(golden) + "/" + file;
+	}
+};
+
+// Difference of an image to its reference: rms of the difference relative to the rms of the
+// reference, and the largest difference of any channel
+struct ImageDifference {
+	bool same_size;
+	double relative_rms;
+	double largest;
+
+	static ImageDifference Compare(const HDRImage& image, const HDRImage& reference) {
+		ImageDifference d = { image.width == reference.width && image.height == reference.height, 0.0, 0.0 };
+		if (!d.same_size)
+			return d;
+
+		double difference = 0.0, energy = 0.0;
+		for (size_t i = 0; i < image.rgb.size(); ++i) {
+			double e = (double)image.rgb[i] - reference.rgb[i];
+			difference += e * e;
+			energy += (double)reference.rgb[i] * reference.rgb[i];
+			d.largest = max(d.largest, fabs(e));
+		}
+		d.relative_rms = energy > 0.0 ? sqrt(difference / energy) : sqrt(difference / max((size_t)1, image.rgb.size()));
+		return d;
+	}
+
+	bool Within(float rms, float largest_allowed) const {
+		return same_size && relative_rms <= rms && largest <= largest_allowed;
+	}
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// Colour tables, built once so no colour math is left per light, vertex or pixel:
+//  - CIE 1931 2 degree colour matching functions every nanometre, from the multi-lobe fit
+//    of Wyman, Sloan and Shirley ("Simple Analytic Approximations to the CIE XYZ Color
+//    Matching Functions", 2013), converted to linear sRGB.
+//  - Blackbody colours evenly spaced in mired (1e6 / T) from 1000K to 40000K, Planck spectra
+//    integrated against the table above, brightest channel 1 like the table it replaces.
+//  - The rainbow palettes the starburst shaders step through, in the Tannenbaum colours
+//    they always used, with their blend towards white folded in.
+// Lookups are a single indexed load.
+//--------------------------------------------------------------------------------------
+
+#include <math.h>
+#include <vector>
+
+using namespace std;
+
+inline void Wl2RgbTannenbaum(float w, float rgb[3]) {
+	float r, g, b;
+
+	if (w < 350.f)
+		r = 0.5f, g = 0.f, b = 1.f;
+	else if (w < 440.f)
+		r = (440.f - w) / 90.f, g = 0.f, b = 1.f;
+	else if (w <= 490.f)
+		r = 0.f, g = (w - 440.f) / 50.f, b = 1.f;
+	else if (w < 510.f)
+		r = 0.f, g = 1.f, b = (-(w - 510.f)) / 20.f;
+	else if (w < 580.f)
+		r = (w - 510.f) / 70.f, g = 1.f, b = 0.f;
+	else if (w < 645.f)
+		r = 1.f, g = (-(w - 645.f)) / 65.f, b = 0.f;
+	else
+		r = 1.f, g = 0.f, b = 0.f;
+
+	float s;
+	if (w < 350.f)
+		s = 0.3f;
+	else if (w < 420.f)
+		s = 0.3f + (0.7f * ((w - 350.f) / 70.f));
+	else if (w <= 700.f)
+		s = 1.f;
+	else if (w <= 780.f)
+		s = 0.3f + (0.7f * ((780.f - w) / 80.f));
+	else
+		s = 0.3f;
+
+	rgb[0] = r * s;
+	rgb[1] = g * s;
+	rgb[2] = b * s;
+}
+
+struct SpectralColor {
+	static const int min_wavelength = 360;
+	static const int max_wavelength = 830;
+	static const int num_wavelengths = max_wavelength - min_wavelength + 1;
+
+	static constexpr float min_mired = 1e6f / 40000.f;
+	static constexpr float max_mired = 1e6f / 1000.f;
+	static const int num_temperatures = 1024;
+
+	// Steps of PSStarburstFromFFT and the 80 colour cycle of PSStarburstFilter
+	static const int num_starburst_steps = 257;
+	static const int num_filter_steps = 80;
+
+	vector<float> wavelength_rgb;   // linear sRGB per nanometre, D65 white at equal energy
+	vector<float> wavelength_xyz;
+	vector<float> blackbody_rgb;    // per mired step
+	vector<float> starburst_palette;
+	vector<float> filter_palette;
+
+	SpectralColor() {
+		Init();
+	}
+
+	static float Lobe(float w, float mu, float sigma1, float sigma2) {
+		float t = (w - mu) / (w < mu ? sigma1 : sigma2);
+		return expf(-0.5f * t * t);
+	}
+
+	static void CIE1931(float w, float xyz[3]) {
+		xyz[0] = 1.056f * Lobe(w, 599.8f, 37.9f, 31.0f) + 0.362f * Lobe(w, 442.0f, 16.0f, 26.7f) - 0.065f * Lobe(w, 501.1f, 20.4f, 26.2f);
+		xyz[1] = 0.821f * Lobe(w, 568.8f, 46.9f, 40.5f) + 0.286f * Lobe(w, 530.9f, 16.3f, 31.1f);
+		xyz[2] = 1.217f * Lobe(w, 437.0f, 11.8f, 36.0f) + 0.681f * Lobe(w, 459.0f, 26.0f, 13.8f);
+	}
+
+	static void XYZToLinearSRGB(const float xyz[3], float rgb[3]) {
+		rgb[0] =  3.2406f * xyz[0] - 1.5372f * xyz[1] - 0.4986f * xyz[2];
+		rgb[1] = -0.9689f * xyz[0] + 1.8758f * xyz[1] + 0.0415f * xyz[2];
+		rgb[2] =  0.0557f * xyz[0] - 0.2040f * xyz[1] + 1.0570f * xyz[2];
+	}
+
+	// Spectral radiance of a blackbody, up to a constant
+	static double Planck(double wavelength_nm, double temperature) {
+		double w = wavelength_nm * 1e-9;
+		return 1.0 / (w * w * w * w * w * (exp(1.4387769e-2 / (w * temperature)) - 1.0));
+	}
+
+	void Init() {
+		wavelength_xyz.resize(num_wavelengths * 3);
+		wavelength_rgb.resize(num_wavelengths * 3);
+		for (int i = 0; i < num_wavelengths; ++i)
+			CIE1931((float)(min_wavelength + i), &wavelength_xyz[i * 3]);
+
+		// Equal energy white: sRGB's D65 white is not equal energy, so balance the channels
+		float sum[3] = { 0.f, 0.f, 0.f };
+		for (int i = 0; i < num_wavelengths; ++i) {
+			XYZToLinearSRGB(&wavelength_xyz[i * 3], &wavelength_rgb[i * 3]);
+			for (int c = 0; c < 3; ++c)
+				sum[c] += wavelength_rgb[i * 3 + c];
+		}
+		for (int i = 0; i < num_wavelengths; ++i)
+			for (int c = 0; c < 3; ++c)
+				wavelength_rgb[i * 3 + c] *= num_wavelengths / sum[c];
+
+		blackbody_rgb.resize(num_temperatures * 3);
+		for (int t = 0; t < num_temperatures; ++t) {
+			double temperature = 1e6 / (min_mired + (max_mired - min_mired) * t / (num_temperatures - 1));
+			double xyz[3] = { 0.0, 0.0, 0.0 };
+			for (int i = 0; i < num_wavelengths; ++i) {
+				double p = Planck(min_wavelength + i, temperature);
+				for (int c = 0; c < 3; ++c)
+					xyz[c] += p * wavelength_xyz[i * 3 + c];
+			}
+
+			float fxyz[3] = { (float)xyz[0], (float)xyz[1], (float)xyz[2] };
+			float* rgb = &blackbody_rgb[t * 3];
+			XYZToLinearSRGB(fxyz, rgb);
+			float brightest = max(rgb[0], max(rgb[1], rgb[2]));
+			for (int c = 0; c < 3; ++c)
+				rgb[c] = max(rgb[c], 0.f) / brightest;
+		}
+
+		starburst_palette.resize(num_starburst_steps * 3);
+		for (int i = 0; i < num_starburst_steps; ++i) {
+			float n = (float)i / (float)(num_starburst_steps - 1);
+			float* rgb = &starburst_palette[i * 3];
+			Wl2RgbTannenbaum(380.f * (1.f - n) + 700.f * n, rgb);
+			for (int c = 0; c < 3; ++c)
+				rgb[c] = 1.f * 0.25f + rgb[c] * 0.75f;
+		}
+
+		filter_palette.resize(num_filter_steps * 3);
+		for (int i = 0; i < num_filter_steps; ++i) {
+			float* rgb = &filter_palette[i * 3];
+			Wl2RgbTannenbaum(380.f + (700.f - 380.f) * (i / (float)num_filter_steps), rgb);
+			for (int c = 0; c < 3; ++c)
+				rgb[c] = rgb[c] * 0.5f + 0.5f;
+		}
+	}
+
+	// Colour of a blackbody at temperature kelvin, brightest channel 1
+	const float* Blackbody(float temperature) const {
+		float mired = 1e6f / max(temperature, 1.f);
+		int t = (int)((mired - min_mired) / (max_mired - min_mired) * (num_temperatures - 1) + 0.5f);
+		return &blackbody_rgb[min(max(t, 0), num_temperatures - 1) * 3];
+	}
+
+	// Linear rgb of a unit of energy at a wavelength in nm
+	const float* Wavelength(float wavelength) const {
+		int i = (int)(wavelength + 0.5f) - min_wavelength;
+		return &wavelength_rgb[min(max(i, 0), num_wavelengths - 1) * 3];
+	}
+
+	// Summed rgb of the nanometre steps in [first, last)
+	void Band(float first, float last, float rgb[3]) const {
+		rgb[0] = rgb[1] = rgb[2] = 0.f;
+		for (float w = first + 0.5f; w < last; w += 1.f) {
+			const float* c = Wavelength(w);
+			for (int k = 0; k < 3; ++k)
+				rgb[k] += c[k];
+		}
+	}
+} SpectralColor;
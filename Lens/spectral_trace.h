@@ -0,0 +1,357 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// CPU version of the lens.hlsl Trace that follows one ray at many wavelengths at once, four
+// per SSE register. Every wavelength of a ghost crosses the same interfaces in the same
+// order, only the refraction indices differ, so the lanes stay in step and the sequencing,
+// the entry ray and the lens data are shared. A lane that misses an interface, is totally
+// reflected or is blocked by the blades is masked off. The two Fresnel terms of a ghost are
+// evaluated per lane. Aspheric interfaces take the same fixed Newton steps as testASPHERE on
+// all lanes.
+//
+// Given a RayEnd per wavelength, Trace also records why and where each lane ended. That
+// takes a separate instantiation of the steps, so tracing without it costs nothing extra.
+//--------------------------------------------------------------------------------------
+
+#include <emmintrin.h>
+#include <vector>
+
+#include "ray_trace.h"
+
+using namespace std;
+
+#if defined(_MSC_VER)
+#define TRACE_INLINE __forceinline
+#else
+#define TRACE_INLINE inline __attribute__((always_inline))
+#endif
+
+struct SpectralHit {
+	float x, y;        // position on the sensor
+	float u, v;        // aperture coordinates
+	float max_radius;  // largest relative height on the way, r.tex.z
+	float intensity;   // 0 when the ray is lost
+};
+
+struct SpectralTracer {
+	struct Ray4 {
+		__m128 px, py, pz;
+		__m128 dx, dy, dz;
+	};
+
+	const vector<LensInterface>* interfaces = nullptr;
+	int aperture_index = AP_IDX;
+	float coating_quality = 0.f;
+
+	int num_wavelengths = 0;
+	int num_groups = 0;
+	vector<float> lambda;  // per lane, in the units of FresnelAR
+	vector<float> ior;     // [interface][group][left, right][lane]
+
+	// ior_table is the one uploaded for lens.hlsl, (left, right) per interface and wavelength
+	void Init(const vector<LensInterface>& lens, const vector<float>& wavelengths, const vector<float>& ior_table, int aperture, float coating) {
+		interfaces = &lens;
+		aperture_index = aperture;
+		coating_quality = coating;
+		num_wavelengths = (int)wavelengths.size();
+		num_groups = (num_wavelengths + 3) / 4;
+
+		// Padding lanes repeat the last wavelength
+		lambda.resize(num_groups * 4);
+		ior.resize(lens.size() * num_groups * 8);
+		for (int lane = 0; lane < num_groups * 4; ++lane) {
+			int w = min(lane, num_wavelengths - 1);
+			lambda[lane] = wavelengths[w] * 0.0000001f;
+			for (size_t t = 0; t < lens.size(); ++t) {
+				float* group = &ior[(t * num_groups + lane / 4) * 8];
+				group[lane % 4] = ior_table[(t * num_wavelengths + w) * 2 + 0];
+				group[4 + lane % 4] = ior_table[(t * num_wavelengths + w) * 2 + 1];
+			}
+		}
+	}
+
+	static __m128 Select(__m128 mask, __m128 a, __m128 b) {
+		return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+	}
+
+	static __m128 Dot(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) {
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+	}
+
+	static void Normalize(__m128& x, __m128& y, __m128& z) {
+		__m128 l = _mm_sqrt_ps(Dot(x, y, z, x, y, z));
+		x = _mm_div_ps(x, l);
+		y = _mm_div_ps(y, l);
+		z = _mm_div_ps(z, l);
+	}
+
+	// Sag and its derivative in u = x^2 + y^2 of an aspheric interface, see AsphereSag
+	static void AsphereSag(const LensInterface& F, __m128 u, __m128& sag, __m128& slope) {
+		const __m128 one = _mm_set1_ps(1.f);
+		float c = 1.f / F.radius;
+		__m128 q = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(_mm_set1_ps((1.f + F.conic) * c * c), u)), _mm_set1_ps(1e-6f)));
+		__m128 cu = _mm_mul_ps(_mm_set1_ps(c), u);
+		__m128 poly = _mm_add_ps(_mm_set1_ps(F.aspheric.z), _mm_mul_ps(u, _mm_set1_ps(F.aspheric.a)));
+		poly = _mm_add_ps(_mm_set1_ps(F.aspheric.y), _mm_mul_ps(u, poly));
+		poly = _mm_add_ps(_mm_set1_ps(F.aspheric.x), _mm_mul_ps(u, poly));
+		sag = _mm_add_ps(_mm_div_ps(cu, _mm_add_ps(one, q)), _mm_mul_ps(_mm_mul_ps(u, u), poly));
+
+		__m128 dpoly = _mm_add_ps(_mm_set1_ps(4.f * F.aspheric.z), _mm_mul_ps(u, _mm_set1_ps(5.f * F.aspheric.a)));
+		dpoly = _mm_add_ps(_mm_set1_ps(3.f * F.aspheric.y), _mm_mul_ps(u, dpoly));
+		dpoly = _mm_add_ps(_mm_set1_ps(2.f * F.aspheric.x), _mm_mul_ps(u, dpoly));
+		slope = _mm_add_ps(_mm_div_ps(_mm_set1_ps(c * 0.5f), q), _mm_mul_ps(u, dpoly));
+	}
+
+	// Traces the ray for every wavelength, hits and ends have num_wavelengths entries
+	void Trace(const vec3& pos, const vec3& dir, int2 bounces, const ApertureShape* aperture, SpectralHit* hits, RayEnd* ends = nullptr) const {
+		for (int g = 0; g < num_groups; ++g) {
+			SpectralHit group_hits[4];
+			RayEnd group_ends[4];
+			if (ends)
+				TraceGroup<true>(g, pos, dir, bounces, aperture, group_hits, group_ends);
+			else
+				TraceGroup<false>(g, pos, dir, bounces, aperture, group_hits, nullptr);
+			for (int lane = 0; lane < 4 && g * 4 + lane < num_wavelengths; ++lane) {
+				hits[g * 4 + lane] = group_hits[lane];
+				if (ends)
+					ends[g * 4 + lane] = group_ends[lane];
+			}
+		}
+	}
+
+	// Rays of one group of lanes on their way through the lens
+	struct State {
+		Ray4 r;
+		__m128 alive;
+		__m128 max_radius;
+		__m128 u, v;
+		__m128 intensity;
+		RayEnd* ends;  // per lane, only written by the recording steps
+	};
+
+	static State Begin(const vec3& pos, const vec3& dir) {
+		const __m128 zero = _mm_setzero_ps();
+		State state = {
+			{ _mm_set1_ps(pos.x), _mm_set1_ps(pos.y), _mm_set1_ps(pos.z), _mm_set1_ps(dir.x), _mm_set1_ps(dir.y), _mm_set1_ps(dir.z) },
+			_mm_cmpeq_ps(zero, zero), zero, zero, zero, _mm_set1_ps(1.f), nullptr
+		};
+		return state;
+	}
+
+	// Ends the lanes that are alive but not kept. Recording, a lane's first end is the one kept
+	template <bool Record>
+	static TRACE_INLINE void Keep(State& state, __m128 keep, int fate, int T) {
+		if (Record) {
+			int lost = _mm_movemask_ps(_mm_andnot_ps(keep, state.alive));
+			for (int lane = 0; lane < 4; ++lane)
+				if ((lost >> lane) & 1 && state.ends[lane].fate == RAY_SURVIVED)
+					state.ends[lane] = { fate, T };
+		}
+		state.alive = _mm_and_ps(state.alive, keep);
+	}
+
+	// Crosses interface T. Heights come from the lens Init was given, the aperture opening
+	// changes at run time
+	template <bool Record = false>
+	TRACE_INLINE void Step(const LensInterface& F, int T, bool reflect, bool at_aperture, int group, const ApertureShape* aperture, State& state) const {
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.f);
+
+		// Intersection
+		__m128 ix, iy, iz, nx, ny, nz, cos_theta, inverted;
+		if (F.flat) {
+			__m128 t = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(F.center.z), state.r.pz), state.r.dz);
+			ix = _mm_add_ps(state.r.px, _mm_mul_ps(state.r.dx, t));
+			iy = _mm_add_ps(state.r.py, _mm_mul_ps(state.r.dy, t));
+			iz = _mm_add_ps(state.r.pz, _mm_mul_ps(state.r.dz, t));
+			nx = ny = zero;
+			nz = Select(_mm_cmpgt_ps(state.r.dz, zero), _mm_set1_ps(-1.f), one);
+			cos_theta = one;
+			inverted = zero;
+		} else {
+			__m128 Dx = _mm_sub_ps(state.r.px, _mm_set1_ps(F.center.x));
+			__m128 Dy = _mm_sub_ps(state.r.py, _mm_set1_ps(F.center.y));
+			__m128 Dz = _mm_sub_ps(state.r.pz, _mm_set1_ps(F.center.z));
+			__m128 B = Dot(Dx, Dy, Dz, state.r.dx, state.r.dy, state.r.dz);
+			__m128 C = _mm_sub_ps(Dot(Dx, Dy, Dz, Dx, Dy, Dz), _mm_set1_ps(F.radius * F.radius));
+			__m128 B2_C = _mm_sub_ps(_mm_mul_ps(B, B), C);
+
+			__m128 root = _mm_sqrt_ps(_mm_max_ps(B2_C, zero));
+			__m128 positive = _mm_cmpgt_ps(_mm_mul_ps(_mm_set1_ps(F.radius), state.r.dz), zero);
+			__m128 t = _mm_sub_ps(Select(positive, root, _mm_sub_ps(zero, root)), B);
+
+			if (IsAspheric(F)) {
+				// Newton from the sphere, or from the vertex plane where the sphere is missed
+				__m128 plane = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(F.pos), state.r.pz), state.r.dz);
+				__m128 sphere_hit = _mm_cmpge_ps(B2_C, zero);
+				t = Select(sphere_hit, t, plane);
+
+				__m128 sag, slope, rho2;
+				for (int step = 0; step < ASPHERE_STEPS; ++step) {
+					ix = _mm_add_ps(state.r.px, _mm_mul_ps(state.r.dx, t));
+					iy = _mm_add_ps(state.r.py, _mm_mul_ps(state.r.dy, t));
+					iz = _mm_add_ps(state.r.pz, _mm_mul_ps(state.r.dz, t));
+					rho2 = _mm_add_ps(_mm_mul_ps(ix, ix), _mm_mul_ps(iy, iy));
+					AsphereSag(F, rho2, sag, slope);
+					__m128 f = _mm_add_ps(_mm_sub_ps(iz, _mm_set1_ps(F.pos)), sag);
+					__m128 df = _mm_add_ps(state.r.dz, _mm_mul_ps(_mm_add_ps(slope, slope), _mm_add_ps(_mm_mul_ps(ix, state.r.dx), _mm_mul_ps(iy, state.r.dy))));
+					t = _mm_sub_ps(t, _mm_div_ps(f, df));
+				}
+
+				ix = _mm_add_ps(state.r.px, _mm_mul_ps(state.r.dx, t));
+				iy = _mm_add_ps(state.r.py, _mm_mul_ps(state.r.dy, t));
+				iz = _mm_add_ps(state.r.pz, _mm_mul_ps(state.r.dz, t));
+				rho2 = _mm_add_ps(_mm_mul_ps(ix, ix), _mm_mul_ps(iy, iy));
+				AsphereSag(F, rho2, sag, slope);
+
+				float c = 1.f / F.radius;
+				__m128 residual = _mm_add_ps(_mm_sub_ps(iz, _mm_set1_ps(F.pos)), sag);
+				__m128 converged = _mm_cmplt_ps(_mm_max_ps(residual, _mm_sub_ps(zero, residual)), _mm_set1_ps(1e-3f));
+				__m128 inside = _mm_cmple_ps(_mm_mul_ps(_mm_set1_ps((1.f + F.conic) * c * c), rho2), one);
+				Keep<Record>(state, _mm_and_ps(converged, inside), RAY_MISSED, T);
+
+				nx = _mm_mul_ps(_mm_add_ps(slope, slope), ix);
+				ny = _mm_mul_ps(_mm_add_ps(slope, slope), iy);
+				nz = one;
+			} else {
+				Keep<Record>(state, _mm_cmpge_ps(B2_C, zero), RAY_MISSED, T);
+				ix = _mm_add_ps(state.r.px, _mm_mul_ps(state.r.dx, t));
+				iy = _mm_add_ps(state.r.py, _mm_mul_ps(state.r.dy, t));
+				iz = _mm_add_ps(state.r.pz, _mm_mul_ps(state.r.dz, t));
+
+				nx = _mm_sub_ps(ix, _mm_set1_ps(F.center.x));
+				ny = _mm_sub_ps(iy, _mm_set1_ps(F.center.y));
+				nz = _mm_sub_ps(iz, _mm_set1_ps(F.center.z));
+			}
+			Normalize(nx, ny, nz);
+			__m128 facing = _mm_cmpgt_ps(Dot(nx, ny, nz, state.r.dx, state.r.dy, state.r.dz), zero);
+			__m128 sign = Select(facing, _mm_set1_ps(-1.f), one);
+			nx = _mm_mul_ps(nx, sign);
+			ny = _mm_mul_ps(ny, sign);
+			nz = _mm_mul_ps(nz, sign);
+			cos_theta = _mm_sub_ps(zero, Dot(state.r.dx, state.r.dy, state.r.dz, nx, ny, nz));
+			inverted = _mm_cmplt_ps(t, zero);
+		}
+
+		// Record the relative height, or the aperture coordinates
+		if (!F.flat) {
+			__m128 radius = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(ix, ix), _mm_mul_ps(iy, iy)));
+			__m128 relative = _mm_div_ps(radius, _mm_set1_ps((*interfaces)[T].sa));
+			state.max_radius = _mm_max_ps(state.max_radius, relative);
+
+			// The lane is still traced, the pixel shader is what clips it
+			if (Record) {
+				int clipped = _mm_movemask_ps(_mm_and_ps(state.alive, _mm_cmpge_ps(relative, one)));
+				for (int lane = 0; lane < 4; ++lane)
+					if ((clipped >> lane) & 1 && state.ends[lane].fate == RAY_SURVIVED)
+						state.ends[lane] = { RAY_CLIPPED, T };
+			}
+		} else if (at_aperture) {
+			__m128 inv_sa = _mm_set1_ps(1.f / (*interfaces)[aperture_index].sa);
+			state.u = _mm_mul_ps(ix, inv_sa);
+			state.v = _mm_mul_ps(iy, inv_sa);
+
+			if (aperture) {
+				alignas(16) float lu[4], lv[4], blocked[4];
+				_mm_store_ps(lu, state.u);
+				_mm_store_ps(lv, state.v);
+				for (int lane = 0; lane < 4; ++lane)
+					blocked[lane] = ApertureBladeDistance(lu[lane], lv[lane], *aperture) >= APERTURE_CUTOFF ? 0.f : 1.f;
+				Keep<Record>(state, _mm_cmpgt_ps(_mm_load_ps(blocked), zero), RAY_BLOCKED, T);
+			}
+		}
+
+		// Direction from the previous hit, flipped for an inverted intersection
+		__m128 dx = _mm_sub_ps(ix, state.r.px), dy = _mm_sub_ps(iy, state.r.py), dz = _mm_sub_ps(iz, state.r.pz);
+		Normalize(dx, dy, dz);
+		__m128 flip = Select(inverted, _mm_set1_ps(-1.f), one);
+		state.r.dx = _mm_mul_ps(dx, flip);
+		state.r.dy = _mm_mul_ps(dy, flip);
+		state.r.dz = _mm_mul_ps(dz, flip);
+		state.r.px = ix;
+		state.r.py = iy;
+		state.r.pz = iz;
+
+		if (!F.flat) {
+			const float* indices = &ior[((size_t)T * num_groups + group) * 8];
+			__m128 left = _mm_loadu_ps(indices);
+			__m128 right = _mm_loadu_ps(indices + 4);
+			__m128 forward = _mm_cmplt_ps(state.r.dz, zero);
+			__m128 n0 = Select(forward, left, right);
+			__m128 n2 = Select(forward, right, left);
+
+			__m128 N_dot_I = Dot(nx, ny, nz, state.r.dx, state.r.dy, state.r.dz);
+			if (!reflect) {
+				__m128 eta = _mm_div_ps(n0, n2);
+				__m128 k = _mm_sub_ps(one, _mm_mul_ps(_mm_mul_ps(eta, eta), _mm_sub_ps(one, _mm_mul_ps(N_dot_I, N_dot_I))));
+				Keep<Record>(state, _mm_cmpge_ps(k, zero), RAY_TOTAL_REFLECTION, T);
+
+				__m128 s = _mm_add_ps(_mm_mul_ps(eta, N_dot_I), _mm_sqrt_ps(_mm_max_ps(k, zero)));
+				state.r.dx = _mm_sub_ps(_mm_mul_ps(state.r.dx, eta), _mm_mul_ps(nx, s));
+				state.r.dy = _mm_sub_ps(_mm_mul_ps(state.r.dy, eta), _mm_mul_ps(ny, s));
+				state.r.dz = _mm_sub_ps(_mm_mul_ps(state.r.dz, eta), _mm_mul_ps(nz, s));
+			} else {
+				__m128 s = _mm_add_ps(N_dot_I, N_dot_I);
+				state.r.dx = _mm_sub_ps(state.r.dx, _mm_mul_ps(nx, s));
+				state.r.dy = _mm_sub_ps(state.r.dy, _mm_mul_ps(ny, s));
+				state.r.dz = _mm_sub_ps(state.r.dz, _mm_mul_ps(nz, s));
+
+				// AR coated reflection, same coating as lens.hlsl
+				alignas(16) float c[4], l0[4], l2[4], R[4];
+				_mm_store_ps(c, cos_theta);
+				_mm_store_ps(l0, n0);
+				_mm_store_ps(l2, n2);
+				for (int lane = 0; lane < 4; ++lane) {
+					float theta = acosf(min(max(c[lane], -1.f), 1.f));
+					float n1 = max(sqrtf(l0[lane] * l2[lane]), 1.38f + coating_quality);
+					float d1 = F.d1 * 0.0000001f;
+					R[lane] = saturate(FresnelAR(theta + 0.001f, lambda[group * 4 + lane], d1, l0[lane], n1, l2[lane]));
+				}
+				state.intensity = _mm_mul_ps(state.intensity, _mm_load_ps(R));
+			}
+		}
+	}
+
+	static void End(const State& state, SpectralHit* hits) {
+		alignas(16) float out[6][4];
+		_mm_store_ps(out[0], _mm_and_ps(state.alive, state.r.px));
+		_mm_store_ps(out[1], _mm_and_ps(state.alive, state.r.py));
+		_mm_store_ps(out[2], state.u);
+		_mm_store_ps(out[3], state.v);
+		_mm_store_ps(out[4], state.max_radius);
+		_mm_store_ps(out[5], _mm_and_ps(state.alive, state.intensity));
+		for (int lane = 0; lane < 4; ++lane) {
+			SpectralHit hit = { out[0][lane], out[1][lane], out[2][lane], out[3][lane], out[4][lane], out[5][lane] };
+			hits[lane] = hit;
+		}
+	}
+
+	template <bool Record>
+	void TraceGroup(int group, const vec3& pos, const vec3& dir, int2 bounces, const ApertureShape* aperture, SpectralHit* hits, RayEnd* ends) const {
+		const vector<LensInterface>& lens = *interfaces;
+		State state = Begin(pos, dir);
+		if (Record) {
+			state.ends = ends;
+			for (int lane = 0; lane < 4; ++lane)
+				ends[lane] = { RAY_SURVIVED, -1 };
+		}
+
+		int LEN = bounces.x + (bounces.x - bounces.y) + ((int)lens.size() - bounces.y) - 1;
+		int PHASE = 0;
+		int DELTA = 1;
+		int T = 1;
+		for (int k = 0; k < LEN; k++, T += DELTA) {
+			bool reflect = T == bounces[PHASE];
+			if (reflect) {
+				DELTA = -DELTA;
+				PHASE++;
+			}
+
+			Step<Record>(lens[T], T, reflect, T == aperture_index, group, aperture, state);
+			if (_mm_movemask_ps(state.alive) == 0)
+				break;
+		}
+
+		End(state, hits);
+	}
+};
@@ -0,0 +1,594 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// CPU version of PSStarburstFromFFT. The shader sums 257 copies of the aperture and dust
+// power spectra, each radially scaled by a wavelength dependent factor, for every output
+// pixel. A radial scale is a shift along log(radius), so here the spectra are resampled
+// once onto a log-polar grid, the 257 scaled copies become one 1D convolution per angle
+// (done with the CPU FFT) and the result is mapped back to the output image.
+//--------------------------------------------------------------------------------------
+
+#include <math.h>
+#include <map>
+#include <vector>
+
+#include "cpu_fft.h"
+#include "profiler.h"
+#include "spectral_color.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+struct StarburstSynthesis {
+	// Constants of PSStarburstFromFFT
+	const int num_steps = 256;
+	const float scale1 = 0.50f;
+	const float scale2 = -0.75f;
+	const float fft_scale = 0.00001f;
+	const float two_pi = 6.28318530718f;
+
+	// Log-polar samples per spectrum texel at the outer radius, 1 matches the spectrum resolution
+	float oversampling = 1.f;
+
+	// Log-polar grid, rebuilt when the spectrum resolution changes
+	int spectrum_resolution = 0;
+	int num_angles = 0;
+	int num_rings = 0;      // output rings
+	int first_tap = 0;      // most negative kernel offset, in rings
+	int padded_length = 0;  // convolution length, rings + kernel span
+	float log_r_min = 0.f;
+	float log_step = 0.f;
+
+	// Kernel spectra: aperture (white) and dust weighted by the r, g, b wavelength colours
+	vector<float> kernel_re[4];
+	vector<float> kernel_im[4];
+	vector<float> sample_radius;
+
+	// Convolved grid, 4 floats (aperture, dust r, dust g, dust b) per (angle, ring)
+	vector<float> grid;
+
+	float Scale1(int i) const {
+		float n = (float)i / (float)num_steps;
+		return (1.f + scale1) * (1.f - n) + n;
+	}
+
+	float Scale2(int i) const {
+		float n = (float)i / (float)num_steps;
+		return (1.f + scale2) * (1.f - n) + n;
+	}
+
+	void DustColor(int i, float rgb[3]) const {
+		const float* palette = &SpectralColor.starburst_palette[i * 3];
+		for (int c = 0; c < 3; ++c)
+			rgb[c] = palette[c];
+	}
+
+	void Init(int resolution) {
+		spectrum_resolution = resolution;
+
+		float r_max = 0.5f * sqrtf(2.f);
+		// Below 1/16 of a texel the spectrum is flat, covers the centre pixels of a 4x larger output
+		float r_min = 0.0625f / resolution;
+		log_r_min = logf(r_min);
+		log_step = 1.f / (resolution * r_max * oversampling);
+		num_rings = (int)ceilf((logf(r_max) - log_r_min) / log_step) + 2;
+		num_angles = ((int)ceilf(two_pi * r_max * resolution * oversampling) + 3) & ~3;
+
+		// Ring offsets of the scaled lookups, log(s) / log_step
+		float min_offset = 0.f, max_offset = 0.f;
+		for (int i = 0; i <= num_steps; ++i) {
+			min_offset = min(min_offset, min(logf(Scale1(i)), logf(Scale2(i))) / log_step);
+			max_offset = max(max_offset, max(logf(Scale1(i)), logf(Scale2(i))) / log_step);
+		}
+		first_tap = (int)floorf(min_offset);
+		int last_tap = (int)floorf(max_offset) + 1;
+
+		padded_length = num_rings + last_tap - first_tap;
+		while (!FFTPlan::IsSmooth(padded_length) || (padded_length % 4) != 0)
+			padded_length++;
+
+		// S(j) = sum_t K(t) LP(j + t) is a convolution with K(-t), stored circularly
+		for (int k = 0; k < 4; ++k) {
+			kernel_re[k].assign(padded_length, 0.f);
+			kernel_im[k].assign(padded_length, 0.f);
+		}
+
+		auto splat = [&](int k, float offset, float weight) {
+			int t = (int)floorf(offset);
+			float f = offset - t;
+			kernel_re[k][(padded_length - t) % padded_length] += weight * (1.f - f);
+			kernel_re[k][(padded_length - t - 1) % padded_length] += weight * f;
+		};
+
+		// The power spectrum drops by many orders of magnitude away from DC, which the float FFT
+		// would smear over the whole row. The rows hold r^2 * P instead, so the kernel weights are
+		// divided by s^2 and the result by r^2
+		for (int i = 0; i <= num_steps; ++i) {
+			float rgb[3];
+			DustColor(i, rgb);
+			float s1 = Scale1(i), s2 = Scale2(i);
+			splat(0, logf(s1) / log_step, 1.f / (s1 * s1));
+			for (int c = 0; c < 3; ++c)
+				splat(1 + c, logf(s2) / log_step, rgb[c] / (s2 * s2));
+		}
+
+		sample_radius.resize(padded_length);
+		for (int j = 0; j < padded_length; ++j)
+			sample_radius[j] = RingRadius(j + first_tap);
+
+		// 1 / padded_length of the inverse transforms folded into the kernels
+		const FFTPlan& plan = FFTPlans.Get(padded_length);
+		vector<float> work(plan.WorkSize());
+		for (int k = 0; k < 4; ++k) {
+			for (float& v : kernel_re[k])
+				v /= padded_length;
+			plan.Forward(kernel_re[k].data(), kernel_im[k].data(), work.data());
+		}
+	}
+
+	// Bilinear lookup of the complex spectra at uv (DC at the origin, wrapping like the sampler),
+	// then the squared magnitude. Returns 0 outside of [-0.5, 0.5] like Clamped() does
+	static void SamplePower(const RealPairSpectrum& spectrum, float u, float v, float& aperture, float& dust) {
+		aperture = dust = 0.f;
+		if (u < -0.5f || u > 0.5f || v < -0.5f || v > 0.5f)
+			return;
+
+		float x = u * spectrum.width;
+		float y = v * spectrum.height;
+		float fx = floorf(x), fy = floorf(y);
+		float tx = x - fx, ty = y - fy;
+		int x0 = ((int)fx % spectrum.width + spectrum.width) % spectrum.width;
+		int y0 = ((int)fy % spectrum.height + spectrum.height) % spectrum.height;
+		int x1 = (x0 + 1) % spectrum.width;
+		int y1 = (y0 + 1) % spectrum.height;
+
+		float a[4] = { 0.f, 0.f, 0.f, 0.f };
+		int xs[4] = { x0, x1, x0, x1 };
+		int ys[4] = { y0, y0, y1, y1 };
+		float ws[4] = { (1.f - tx) * (1.f - ty), tx * (1.f - ty), (1.f - tx) * ty, tx * ty };
+		for (int i = 0; i < 4; ++i) {
+			float ar, ai, br, bi;
+			spectrum.Get(xs[i], ys[i], ar, ai, br, bi);
+			a[0] += ar * ws[i];
+			a[1] += ai * ws[i];
+			a[2] += br * ws[i];
+			a[3] += bi * ws[i];
+		}
+
+		aperture = a[0] * a[0] + a[1] * a[1];
+		dust = a[2] * a[2] + a[3] * a[3];
+	}
+
+	// Fills grid with the wavelength integrated aperture and dust terms
+	void Transform(const RealPairSpectrum& spectrum) {
+		if (spectrum.width != spectrum_resolution)
+			Init(spectrum.width);
+
+		const FFTPlan& plan = FFTPlans.Get(padded_length);
+		grid.resize((size_t)num_angles * num_rings * 4);
+
+		Workers.ParallelFor(num_angles, 8, [&](int begin, int end) {
+			float* zr = FFTScratch(plan.WorkSize() + padded_length * 6);
+			float* zi = zr + padded_length;
+			float* y1r = zi + padded_length;
+			float* y1i = y1r + padded_length;
+			float* y2r = y1i + padded_length;
+			float* y2i = y2r + padded_length;
+			float* work = y2i + padded_length;
+
+			for (int a = begin; a < end; ++a) {
+				float angle = (a + 0.5f) * two_pi / num_angles;
+				float ca = cosf(angle), sa = sinf(angle);
+
+				// Log-polar resampling, aperture in the real and dust in the imaginary part
+				for (int j = 0; j < padded_length; ++j) {
+					float r = sample_radius[j];
+					SamplePower(spectrum, r * ca, r * sa, zr[j], zi[j]);
+					zr[j] *= r * r;
+					zi[j] *= r * r;
+				}
+
+				plan.Forward(zr, zi, work);
+
+				// Split the two real rows, apply the kernels and pack the four real outputs
+				// back into two complex rows
+				for (int k = 0; k < padded_length; ++k) {
+					int mk = (padded_length - k) % padded_length;
+					float a_re = (zr[k] + zr[mk]) * 0.5f, a_im = (zi[k] - zi[mk]) * 0.5f;
+					float d_re = (zi[k] + zi[mk]) * 0.5f, d_im = (zr[mk] - zr[k]) * 0.5f;
+
+					float o_re[4], o_im[4];
+					o_re[0] = a_re * kernel_re[0][k] - a_im * kernel_im[0][k];
+					o_im[0] = a_re * kernel_im[0][k] + a_im * kernel_re[0][k];
+					for (int c = 1; c < 4; ++c) {
+						o_re[c] = d_re * kernel_re[c][k] - d_im * kernel_im[c][k];
+						o_im[c] = d_re * kernel_im[c][k] + d_im * kernel_re[c][k];
+					}
+
+					y1r[k] = o_re[0] - o_im[1];
+					y1i[k] = o_im[0] + o_re[1];
+					y2r[k] = o_re[2] - o_im[3];
+					y2i[k] = o_im[2] + o_re[3];
+				}
+
+				plan.Inverse(y1r, y1i, work);
+				plan.Inverse(y2r, y2i, work);
+
+				// Output ring j reads the resampled rings j .. j + kernel span
+				float* out = &grid[(size_t)a * num_rings * 4];
+				for (int j = 0; j < num_rings; ++j) {
+					int i = j - first_tap;
+					float r = sample_radius[i];
+					float inv_r2 = 1.f / (r * r);
+					out[j * 4 + 0] = y1r[i] * inv_r2;
+					out[j * 4 + 1] = y1i[i] * inv_r2;
+					out[j * 4 + 2] = y2r[i] * inv_r2;
+					out[j * 4 + 3] = y2i[i] * inv_r2;
+				}
+			}
+		});
+
+	}
+
+	float RingRadius(int j) const {
+		return expf(log_r_min + j * log_step);
+	}
+
+	// Radial weights of PSStarburstFromFFT applied to one grid cell, d = length(uv) * 2
+	void Shade(const float* s, float d, float* rgb) const {
+		float starburst = s[0] * fft_scale * (25.f * d);
+		float dust_weight = fft_scale * (0.5f * (1.f - d)) * 0.25f;
+		for (int c = 0; c < 3; ++c)
+			rgb[c] = (starburst + s[1 + c] * dust_weight) / (float)num_steps;
+	}
+
+	// Bilinear lookup of a polar grid (angle major, channels floats per cell) for every pixel of
+	// a resolution * resolution image, shade(values, d, rgb) turns the lookup into a colour
+	template<class ShadeFunction>
+	void Resolve(const vector<float>& polar, int channels, int resolution, vector<float>& rgb, ShadeFunction shade) const {
+		rgb.resize((size_t)resolution * resolution * 3);
+		Workers.ParallelFor(resolution, 16, [&](int begin, int end) {
+			float s[8];
+			for (int py = begin; py < end; ++py) {
+				for (int px = 0; px < resolution; ++px) {
+					float u = (px + 0.5f) / resolution - 0.5f;
+					float v = (py + 0.5f) / resolution - 0.5f;
+					float r = sqrtf(u * u + v * v);
+
+					float ring = (logf(max(r, expf(log_r_min))) - log_r_min) / log_step;
+					float angle = atan2f(v, u) / two_pi;
+					angle = (angle < 0.f ? angle + 1.f : angle) * num_angles - 0.5f;
+
+					int j0 = min((int)ring, num_rings - 2);
+					float tj = min(ring - j0, 1.f);
+					float fa = floorf(angle);
+					float ta = angle - fa;
+					int a0 = ((int)fa + num_angles) % num_angles;
+					int a1 = (a0 + 1) % num_angles;
+
+					const float* g00 = &polar[((size_t)a0 * num_rings + j0) * channels];
+					const float* g10 = &polar[((size_t)a1 * num_rings + j0) * channels];
+					for (int c = 0; c < channels; ++c) {
+						float s0 = g00[c] * (1.f - tj) + g00[c + channels] * tj;
+						float s1 = g10[c] * (1.f - tj) + g10[c + channels] * tj;
+						s[c] = s0 * (1.f - ta) + s1 * ta;
+					}
+
+					shade(s, r * 2.f, &rgb[((size_t)py * resolution + px) * 3]);
+				}
+			}
+		});
+	}
+
+	// rgb receives resolution * resolution * 3 floats, same image PSStarburstFromFFT renders
+	void Synthesize(const RealPairSpectrum& spectrum, int resolution, vector<float>& rgb) {
+		Transform(spectrum);
+		Resolve(grid, 4, resolution, rgb, [this](const float* s, float d, float* o) { Shade(s, d, o); });
+	}
+
+	// Straight port of PSStarburstFromFFT (including the per step wavelength colour), only meant
+	// to validate Synthesize on small resolutions
+	void SynthesizeReference(const RealPairSpectrum& spectrum, int resolution, vector<float>& rgb) const {
+		rgb.assign((size_t)resolution * resolution * 3, 0.f);
+		Workers.ParallelFor(resolution, 1, [&](int begin, int end) {
+			for (int py = begin; py < end; ++py) {
+				for (int px = 0; px < resolution; ++px) {
+					float u = (px + 0.5f) / resolution - 0.5f;
+					float v = (py + 0.5f) / resolution - 0.5f;
+					float d = sqrtf(u * u + v * v) * 2.f;
+
+					float result[3] = { 0.f, 0.f, 0.f };
+					for (int i = 0; i <= num_steps; ++i) {
+						float p1, p2, unused;
+						SamplePower(spectrum, u * Scale1(i), v * Scale1(i), p1, unused);
+						SamplePower(spectrum, u * Scale2(i), v * Scale2(i), unused, p2);
+
+						float starburst = p1 * fft_scale * (25.f * d);
+						float dust = p2 * fft_scale * (0.5f * (1.f - d));
+
+						float color[3];
+						DustColor(i, color);
+						for (int c = 0; c < 3; ++c)
+							result[c] += starburst + dust * color[c] * 0.25f;
+					}
+
+					float* o = &rgb[((size_t)py * resolution + px) * 3];
+					for (int c = 0; c < 3; ++c)
+						o[c] = result[c] / (float)num_steps;
+				}
+			}
+		});
+	}
+};
+
+//--------------------------------------------------------------------------------------
+// CPU version of PSStarburstFilter. The rotational part of its 257 taps is a shift along
+// the angle axis of the synthesis grid, so it becomes a short 1D convolution per ring with
+// the rainbow tint folded into three kernels. The small spiral offsets are applied after
+// mapping back, as one sparse 2D kernel on the image.
+//--------------------------------------------------------------------------------------
+struct StarburstFilter {
+	// Constants of PSStarburstFilter
+	const int num_steps = 256;
+	const float rotation = 0.05f;
+	const float spiral_radius = 0.002f;
+	const float spiral_turns = 2.f;
+
+	struct Tap {
+		int dx, dy;
+		float weight;
+	};
+
+	int num_angles = 0;
+	vector<float> kernel[3];  // angle kernels, tinted r, g, b
+	vector<Tap> spiral;       // pixel offsets of the spiral blur
+	int spiral_resolution = 0;
+
+	vector<float> polar;      // filtered grid, rgb per cell
+	vector<float> smeared;    // image before the spiral blur
+
+	void Tint(int i, float rgb[3]) const {
+		const float* palette = &SpectralColor.filter_palette[(i % SpectralColor.num_filter_steps) * 3];
+		for (int c = 0; c < 3; ++c)
+			rgb[c] = palette[c];
+	}
+
+	void InitAngleKernels(int angles) {
+		num_angles = angles;
+
+		// Rotate(uv, a) reads the starburst at polar angle + a
+		float step = 6.28318530718f / num_angles;
+		int last_tap = (int)floorf(rotation / step) + 1;
+		for (int c = 0; c < 3; ++c)
+			kernel[c].assign(last_tap + 1, 0.f);
+
+		for (int i = 0; i <= num_steps; ++i) {
+			float n = (float)i / (float)num_steps;
+			float offset = n * rotation / step;
+			int t = (int)floorf(offset);
+			float f = offset - t;
+
+			float rgb[3];
+			Tint(i, rgb);
+			for (int c = 0; c < 3; ++c) {
+				kernel[c][t] += rgb[c] * (1.f - f) / (float)num_steps;
+				kernel[c][t + 1] += rgb[c] * f / (float)num_steps;
+			}
+		}
+	}
+
+	void InitSpiral(int resolution) {
+		spiral_resolution = resolution;
+
+		// Bilinear splat of the offsets, the rotation of the offset itself (at most 0.05 rad) is ignored
+		map<pair<int, int>, float> taps;
+		for (int i = 0; i <= num_steps; ++i) {
+			float n = (float)i / (float)num_steps;
+			float a = n * 6.28318530718f * spiral_turns;
+			float x = cosf(a) * n * spiral_radius * resolution;
+			float y = sinf(a) * n * spiral_radius * resolution;
+			float fx = floorf(x), fy = floorf(y);
+			float tx = x - fx, ty = y - fy;
+			float w = 1.f / (num_steps + 1);
+			taps[make_pair((int)fx, (int)fy)] += w * (1.f - tx) * (1.f - ty);
+			taps[make_pair((int)fx + 1, (int)fy)] += w * tx * (1.f - ty);
+			taps[make_pair((int)fx, (int)fy + 1)] += w * (1.f - tx) * ty;
+			taps[make_pair((int)fx + 1, (int)fy + 1)] += w * tx * ty;
+		}
+
+		spiral.clear();
+		for (auto& t : taps) {
+			Tap tap = { t.first.first, t.first.second, t.second };
+			spiral.push_back(tap);
+		}
+	}
+
+	// Filters the starburst held in synthesis.grid (see StarburstSynthesis::Transform) and writes
+	// the resolution * resolution * 3 image PSStarburstFilter would produce
+	void Filter(const StarburstSynthesis& synthesis, int resolution, vector<float>& rgb) {
+		if (synthesis.num_angles != num_angles)
+			InitAngleKernels(synthesis.num_angles);
+		if (resolution != spiral_resolution)
+			InitSpiral(resolution);
+
+		int num_rings = synthesis.num_rings;
+		int kernel_size = (int)kernel[0].size();
+		polar.resize((size_t)num_angles * num_rings * 3);
+
+		// Blocks of rings so the angle major grid is read and written in contiguous runs
+		const int block = 16;
+		int num_blocks = (num_rings + block - 1) / block;
+		Workers.ParallelFor(num_blocks, 1, [&](int begin, int end) {
+			float* rows = FFTScratch((size_t)(num_angles + kernel_size) * block * 3);
+			float step = 6.28318530718f / num_angles;
+
+			for (int b = begin; b < end; ++b) {
+				int j0 = b * block;
+				int count = min(block, num_rings - j0);
+
+				float radius[block];
+				for (int j = 0; j < count; ++j)
+					radius[j] = synthesis.RingRadius(j0 + j);
+
+				// Shaded starburst along the rings, zero where Clamped() would reject the sample
+				for (int a = 0; a < num_angles; ++a) {
+					float angle = (a + 0.5f) * step;
+					float ca = fabsf(cosf(angle)), sa = fabsf(sinf(angle));
+					const float* g = &synthesis.grid[((size_t)a * num_rings + j0) * 4];
+					float* o = &rows[(size_t)a * block * 3];
+					for (int j = 0; j < count; ++j, g += 4, o += 3) {
+						if (radius[j] * ca > 0.5f || radius[j] * sa > 0.5f)
+							o[0] = o[1] = o[2] = 0.f;
+						else
+							synthesis.Shade(g, radius[j] * 2.f, o);
+					}
+				}
+				memcpy(&rows[(size_t)num_angles * block * 3], rows, (size_t)kernel_size * block * 3 * sizeof(float));
+
+				for (int a = 0; a < num_angles; ++a) {
+					float* o = &polar[((size_t)a * num_rings + j0) * 3];
+					for (int j = 0; j < count * 3; j += 3) {
+						float sum[3] = { 0.f, 0.f, 0.f };
+						for (int t = 0; t < kernel_size; ++t) {
+							const float* s = &rows[((size_t)(a + t) * block) * 3 + j];
+							sum[0] += kernel[0][t] * s[0];
+							sum[1] += kernel[1][t] * s[1];
+							sum[2] += kernel[2][t] * s[2];
+						}
+						o[j + 0] = sum[0];
+						o[j + 1] = sum[1];
+						o[j + 2] = sum[2];
+					}
+				}
+			}
+		});
+
+		synthesis.Resolve(polar, 3, resolution, smeared, [](const float* s, float, float* o) {
+			o[0] = s[0];
+			o[1] = s[1];
+			o[2] = s[2];
+		});
+
+		// Spiral offsets, samples outside of the image are dropped like Clamped() does
+		rgb.assign((size_t)resolution * resolution * 3, 0.f);
+		Workers.ParallelFor(resolution, 16, [&](int begin, int end) {
+			for (int y = begin; y < end; ++y) {
+				float* o = &rgb[(size_t)y * resolution * 3];
+				for (const Tap& tap : spiral) {
+					int sy = y + tap.dy;
+					if (sy < 0 || sy >= resolution)
+						continue;
+
+					int x0 = max(0, -tap.dx);
+					int x1 = min(resolution, resolution - tap.dx);
+					const float* s = &smeared[(size_t)sy * resolution * 3];
+					int shift = tap.dx * 3;
+					for (int i = x0 * 3; i < x1 * 3; ++i)
+						o[i] += tap.weight * s[i + shift];
+				}
+			}
+		});
+	}
+
+	// Straight port of PSStarburstFilter on a starburst image, only meant to validate Filter on
+	// small resolutions
+	void FilterReference(const vector<float>& starburst, int resolution, vector<float>& rgb) const {
+		rgb.assign((size_t)resolution * resolution * 3, 0.f);
+		Workers.ParallelFor(resolution, 1, [&](int begin, int end) {
+			for (int py = begin; py < end; ++py) {
+				for (int px = 0; px < resolution; ++px) {
+					float u = (px + 0.5f) / resolution - 0.5f;
+					float v = (py + 0.5f) / resolution - 0.5f;
+
+					float result[3] = { 0.f, 0.f, 0.f };
+					for (int i = 0; i <= num_steps; ++i) {
+						float n = (float)i / (float)num_steps;
+						float a = n * 6.28318530718f * spiral_turns;
+						float x = u + cosf(a) * n * spiral_radius;
+						float y = v + sinf(a) * n * spiral_radius;
+						float ca = cosf(n * rotation), sa = sinf(n * rotation);
+						float ru = x * ca - y * sa;
+						float rv = y * ca + x * sa;
+						if (fabsf(ru) > 0.5f || fabsf(rv) > 0.5f)
+							continue;
+
+						// Wrap sampler lookup at rotated_uv + 0.5
+						float tx = (ru + 0.5f) * resolution - 0.5f;
+						float ty = (rv + 0.5f) * resolution - 0.5f;
+						float fx = floorf(tx), fy = floorf(ty);
+						float wx = tx - fx, wy = ty - fy;
+						int x0 = ((int)fx + resolution) % resolution, x1 = (x0 + 1) % resolution;
+						int y0 = ((int)fy + resolution) % resolution, y1 = (y0 + 1) % resolution;
+
+						float rgb_tint[3];
+						Tint(i, rgb_tint);
+						for (int c = 0; c < 3; ++c) {
+							float s00 = starburst[((size_t)y0 * resolution + x0) * 3 + c];
+							float s10 = starburst[((size_t)y0 * resolution + x1) * 3 + c];
+							float s01 = starburst[((size_t)y1 * resolution + x0) * 3 + c];
+							float s11 = starburst[((size_t)y1 * resolution + x1) * 3 + c];
+							float s = (s00 * (1.f - wx) + s10 * wx) * (1.f - wy) + (s01 * (1.f - wx) + s11 * wx) * wy;
+							result[c] += s * rgb_tint[c];
+						}
+					}
+
+					float* o = &rgb[((size_t)py * resolution + px) * 3];
+					for (int c = 0; c < 3; ++c)
+						o[c] = result[c] / (float)num_steps;
+				}
+			}
+		});
+	}
+};
+
+//--------------------------------------------------------------------------------------
+// Starburst stage that keeps the spectrum of the last aperture, so only a new aperture
+// needs a new FFT and transform.
+//--------------------------------------------------------------------------------------
+struct ApertureKey {
+	float num_of_blades;
+	float opening;  // blade rotation in radians, see PSAperture
+
+	// Same blades, possibly turned
+	bool SameShape(const ApertureKey& key) const {
+		return num_of_blades == key.num_of_blades;
+	}
+
+	bool Same(const ApertureKey& key) const {
+		return num_of_blades == key.num_of_blades && opening == key.opening;
+	}
+};
+
+struct StarburstPipeline {
+	FFT2D fft;
+	RealPairSpectrum spectrum;
+	StarburstSynthesis synthesis;
+	StarburstFilter filter;
+
+	bool has_spectrum = false;
+	ApertureKey spectrum_key = {};
+
+	bool NeedsSpectrum(const ApertureKey& key) const {
+		return !has_spectrum || !key.Same(spectrum_key);
+	}
+
+	// aperture and dust are the size * size real images PSAperture writes to r and g
+	void SetSpectrum(const ApertureKey& key, const float* aperture, const float* dust, int size) {
+		PROFILE_SCOPE("starburst spectrum");
+		fft.ForwardRealPair(aperture, dust, size, size, spectrum);
+		UseSpectrum(key);
+	}
+
+	// For a spectrum filled in directly, e.g. from the starburst cache
+	void UseSpectrum(const ApertureKey& key) {
+		synthesis.Transform(spectrum);
+		spectrum_key = key;
+		has_spectrum = true;
+	}
+
+	// Filtered starburst (what PSStarburstFilter writes) of the aperture of the spectrum
+	void Render(int resolution, vector<float>& rgb) {
+		PROFILE_SCOPE("starburst synthesis");
+		filter.Filter(synthesis, resolution, rgb);
+	}
+};
@@ -5,37 +5,8 @@ struct StarbustInput {
 	float3 uv : TEXCOORD0;
 };
 
-float3 wl2rgbTannenbaum(float w){
-	float3 r;
-
-	if(w < 350.0)
-		r = float3(0.5, 0.0, 1.0);
-	else if((w >= 350.0) && (w < 440.0))
-		r = float3((440.0 - w) / 90.0, 0.0, 1.0);
-	else if((w >= 440.0) && (w <= 490.0))
-		r = float3(0.0, (w - 440.0) / 50.0, 1.0);
-	else if((w >= 490.0) && (w < 510.0))
-		r = float3(0.0, 1.0, (-(w - 510.0)) / 20.0);
-	else if ((w >= 510.0) && (w < 580.0))
-		r = float3((w - 510.0) / 70.0, 1.0, 0.0);
-	else if((w >= 580.0) && (w < 645.0))
-		r = float3(1.0, (-(w - 645.0)) / 65.0, 0.0);
-	else
-		r = float3(1.0, 0.0, 0.0);
-	
-	if(w < 350.0)
-		r *= 0.3;
-	else if((w >= 350.0) && (w < 420.0))
-		r *= 0.3 + (0.7 * ((w - 350.0) / 70.0));
-	else if((w >= 420.0) && (w <= 700.0))
-		r *= 1.0;
-	else if((w > 700.0) && (w <= 780.0))
-		r *= 0.3 + (0.7 * ((780.0 - w) / 80.0));
-	else
-		r *= 0.3;
-
-	return r;
-}
+// Rainbow steps of PSStarburstFromFFT then the 80 of PSStarburstFilter, see spectral_color.h
+StructuredBuffer<float4> starburst_palette : register(t3);
 
 float3 IntersectPlane(float3 n, float3 p0, float3 l0, float3 l) { 
     float denom = dot(n, l); 
@@ -74,6 +45,9 @@ StarbustInput VSStarburst(float4 pos : POSITION, uint id : SV_VertexID) {
 	result.pos.xy += c.xy * float2(0.5f, 1.f);
 
 	result.uv.xy = (pos.xy * float2(1.f, 0.5f) + 1.f) * 0.5f;
+
+	// While the opening is dragged the last exact starburst is rotated to it, see UpdateAperture
+	result.uv.xy = Rotate(result.uv.xy - 0.5f, -starburst_rotation) + 0.5f;
 	result.uv.z = intensity;
 	return result;
 }
@@ -84,11 +58,25 @@ float4 PSStarburst(StarbustInput input) : SV_Target {
 	float intensity = input.uv.z;
 	float3 starburst = input_texture1.Sample(LinearSampler, input.uv.xy).rgb * intensity;
 
-	starburst *= TemperatureToColor(INCOMING_LIGHT_TEMP);
+	starburst *= light_color;
 
 	return float4(starburst, 1.f);
 }
 
+// The FFT holds z = aperture + i * dust (see PackRealPairCS). Both inputs are real, so their
+// spectra are Hermitian and are separated from z(k) and conj(z(-k)). uv = 0 is the DC texel
+// centre so rotations of the lookup happen around DC
+void SampleRealPairSpectrum(float2 uv, out float2 aperture, out float2 dust) {
+	uv += 0.5f / aperture_resolution;
+	float2 mirrored_uv = 1.f / aperture_resolution - uv;
+
+	float2 z  = float2(input_texture1.Sample(LinearSampler, uv).r, input_texture2.Sample(LinearSampler, uv).r);
+	float2 zc = float2(input_texture1.Sample(LinearSampler, mirrored_uv).r, -input_texture2.Sample(LinearSampler, mirrored_uv).r);
+
+	aperture = (z + zc) * 0.5f;
+	dust = float2(z.y - zc.y, zc.x - z.x) * 0.5f;
+}
+
 float4 PSStarburstFromFFT(float4 pos : SV_POSITION ) : SV_Target {
 
 	float2 uv = pos.xy / starburst_resolution - 0.5;
@@ -110,21 +98,16 @@ float4 PSStarburstFromFFT(float4 pos : SV_POSITION ) : SV_Target {
 		bool clamped1 = Clamped(scaled_uv1);
 		bool clamped2 = Clamped(scaled_uv2);
 
-		float r1 = input_texture1.Sample(LinearSampler, scaled_uv1).r * !clamped1;
-		float i1 = input_texture2.Sample(LinearSampler, scaled_uv1).r * !clamped1;
-
-		float r2 = input_texture1.Sample(LinearSampler, scaled_uv2).g * !clamped2;
-		float i2 = input_texture2.Sample(LinearSampler, scaled_uv2).g * !clamped2;
-
-		float2 p1 = float2(r1, i1);
-		float2 p2 = float2(r2, i2);
+		float2 p1, p2, unused;
+		SampleRealPairSpectrum(scaled_uv1, p1, unused);
+		SampleRealPairSpectrum(scaled_uv2, unused, p2);
+		p1 *= !clamped1;
+		p2 *= !clamped2;
 
 		float starburst = pow(length(p1), 2.f) * fft_scale * lerp(0.0f, 25.f, d);
 		float dust      = pow(length(p2), 2.f) * fft_scale * lerp(0.5f,  0.f, d);
 
-		float lambda = lerp(380.f, 700.f, n);
-		float3 rgb = wl2rgbTannenbaum(lambda);
-		rgb = lerp(1.f, rgb, 0.75f);
+		float3 rgb = starburst_palette[i].rgb;
 
 		result += (starburst + dust * rgb * 0.25f);
 	}
@@ -147,9 +130,7 @@ float4 PSStarburstFilter(float4 pos : SV_POSITION ) : SV_Target {
 
 		float3 starburst = input_texture1.Sample(LinearSampler, rotated_uv + 0.5f).rgb * !Clamped(rotated_uv);
 
-		float lambda = lerp(380.f, 700.f, (i % 80)/80.f);
-		float3 rgb = wl2rgbTannenbaum(lambda);
-		rgb = lerp(rgb, 1.f, 0.5f);
+		float3 rgb = starburst_palette[257 + i % 80].rgb;
 
 		result += starburst * rgb;
 	}
@@ -0,0 +1,437 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// Content addressed cache for aperture masks, aperture spectra and filtered starbursts.
+// They only depend on the blade count, the opening, the dust texture, the resolutions and
+// on whether the GPU shaders or the CPU stages made them (the two differ in the last bits),
+// so a hash of those names the image. Only exact images are stored, never the rotated
+// starburst shown while the opening is dragged. Images live in memory under an LRU byte budget and,
+// when a directory is set, in half float files that later sessions (or other machines
+// sharing the directory) map instead of recomputing.
+//--------------------------------------------------------------------------------------
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// FNV-1a
+inline uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+inline uint16_t FloatToHalf(float value) {
+	uint32_t f;
+	memcpy(&f, &value, 4);
+	uint32_t sign = (f >> 16) & 0x8000;
+	int exponent = (int)((f >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = f & 0x7fffff;
+
+	if (exponent >= 31) {
+		// Overflow to infinity, keep NaNs NaN
+		bool nan = ((f >> 23) & 0xff) == 0xff && mantissa != 0;
+		return (uint16_t)(sign | 0x7c00 | (nan ? 0x200 : 0));
+	}
+	if (exponent <= 0) {
+		if (exponent < -10)
+			return (uint16_t)sign;
+		mantissa |= 0x800000;
+		uint32_t shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1)))
+			half++;
+		return (uint16_t)(sign | half);
+	}
+
+	uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+		half++;
+	return (uint16_t)half;
+}
+
+inline float HalfToFloat(uint16_t half) {
+	uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+	uint32_t exponent = (half >> 10) & 0x1f;
+	uint32_t mantissa = half & 0x3ff;
+	uint32_t f;
+
+	if (exponent == 0) {
+		if (mantissa == 0) {
+			f = sign;
+		} else {
+			// Subnormal, renormalize
+			exponent = 127 - 15 + 1;
+			while (!(mantissa & 0x400)) {
+				mantissa <<= 1;
+				exponent--;
+			}
+			f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+		}
+	} else if (exponent == 31) {
+		f = sign | 0x7f800000 | (mantissa << 13);
+	} else {
+		f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+	}
+
+	float value;
+	memcpy(&value, &f, 4);
+	return value;
+}
+
+// Read only view of a whole file, released with the object
+struct MappedFile {
+	const void* data = nullptr;
+	size_t size = 0;
+
+	#if defined(_WIN32)
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+	#else
+	int file = -1;
+	#endif
+
+	MappedFile() {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// Replaces any file open before
+	bool Open(const string& path) {
+		Close();
+
+		#if defined(_WIN32)
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+			return false;
+
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping)
+			return false;
+
+		data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		size = (size_t)file_size.QuadPart;
+		#else
+		file = open(path.c_str(), O_RDONLY);
+		if (file < 0)
+			return false;
+
+		struct stat info;
+		if (fstat(file, &info) != 0 || info.st_size == 0)
+			return false;
+
+		void* view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, file, 0);
+		data = view == MAP_FAILED ? nullptr : view;
+		size = (size_t)info.st_size;
+		#endif
+
+		return data != nullptr;
+	}
+
+	void Close() {
+		#if defined(_WIN32)
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+		mapping = nullptr;
+		#else
+		if (data)
+			munmap((void*)data, size);
+		if (file >= 0)
+			close(file);
+		file = -1;
+		#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	~MappedFile() {
+		Close();
+	}
+};
+
+enum StarburstAsset {
+	AssetApertureMask = 1,
+	AssetSpectrum = 2,
+	AssetStarburst = 3,
+};
+
+// Stages made by the CPU path rather than the GPU shaders
+enum StarburstStage {
+	StageCPUAperture = 1,
+	StageCPUStarburst = 2,
+};
+
+// Everything the aperture and starburst images are a function of
+struct StarburstParameters {
+	float number_of_blades;
+	float aperture_opening;
+	uint64_t dust_hash;
+	int aperture_resolution;
+	int starburst_resolution;
+	int cpu_stages;  // StarburstStage bits
+
+	// Hash naming one asset. Masks and spectra do not depend on the starburst resolution, masks
+	// not on how the starburst is made
+	uint64_t Key(StarburstAsset asset) const {
+		const uint32_t version = 2;
+		int32_t starburst = asset == AssetStarburst ? starburst_resolution : 0;
+		int32_t stages = asset == AssetApertureMask ? cpu_stages & StageCPUAperture : cpu_stages;
+
+		uint64_t hash = HashBytes(&version, sizeof(version));
+		hash = HashBytes(&asset, sizeof(asset), hash);
+		hash = HashBytes(&number_of_blades, sizeof(number_of_blades), hash);
+		hash = HashBytes(&aperture_opening, sizeof(aperture_opening), hash);
+		hash = HashBytes(&dust_hash, sizeof(dust_hash), hash);
+		hash = HashBytes(&aperture_resolution, sizeof(aperture_resolution), hash);
+		hash = HashBytes(&starburst, sizeof(starburst), hash);
+		hash = HashBytes(&stages, sizeof(stages), hash);
+		return hash;
+	}
+};
+
+// Half float image, values are half * scale. pixels points either into storage or into a
+// mapped cache file
+struct CachedImage {
+	uint64_t key = 0;
+	int width = 0;
+	int height = 0;
+	int channels = 0;
+	float scale = 1.f;
+	const uint16_t* pixels = nullptr;
+
+	vector<uint16_t> storage;
+	unique_ptr<MappedFile> file;
+
+	size_t NumValues() const {
+		return (size_t)width * height * channels;
+	}
+
+	size_t Bytes() const {
+		return NumValues() * sizeof(uint16_t);
+	}
+
+	void ToFloat(float* out) const {
+		size_t n = NumValues();
+		for (size_t i = 0; i < n; ++i)
+			out[i] = HalfToFloat(pixels[i]) * scale;
+	}
+};
+
+struct StarburstCache {
+	// On-disk layout: header followed by width * height * channels halfs
+	struct FileHeader {
+		char magic[4];
+		uint32_t version;
+		uint64_t key;
+		int32_t width;
+		int32_t height;
+		int32_t channels;
+		float scale;
+	};
+
+	size_t budget = size_t(512) << 20;
+	string directory;  // empty keeps the cache in memory only
+
+	list<shared_ptr<const CachedImage>> lru;  // most recently used first
+	unordered_map<uint64_t, list<shared_ptr<const CachedImage>>::iterator> index;
+	size_t bytes = 0;
+	mutex cache_mutex;
+
+	string FilePath(uint64_t key) const {
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.half", (unsigned long long)key);
+		return directory + "/" + name;
+	}
+
+	// Caller holds cache_mutex
+	void Insert(const shared_ptr<const CachedImage>& image) {
+		auto it = index.find(image->key);
+		if (it != index.end()) {
+			bytes -= (*it->second)->Bytes();
+			lru.erase(it->second);
+		}
+
+		lru.push_front(image);
+		index[image->key] = lru.begin();
+		bytes += image->Bytes();
+
+		// Evicted images stay valid for whoever still holds them
+		while (bytes > budget && lru.size() > 1) {
+			bytes -= lru.back()->Bytes();
+			index.erase(lru.back()->key);
+			lru.pop_back();
+		}
+	}
+
+	shared_ptr<const CachedImage> LoadFile(uint64_t key) const {
+		if (directory.empty())
+			return nullptr;
+
+		unique_ptr<MappedFile> file(new MappedFile());
+		if (!file->Open(FilePath(key)) || file->size < sizeof(FileHeader))
+			return nullptr;
+
+		FileHeader header;
+		memcpy(&header, file->data, sizeof(header));
+		size_t values = (size_t)header.width * header.height * header.channels;
+		if (memcmp(header.magic, "LFSB", 4) != 0 || header.version != 1 || header.key != key ||
+			file->size != sizeof(header) + values * sizeof(uint16_t))
+			return nullptr;
+
+		shared_ptr<CachedImage> image(new CachedImage());
+		image->key = key;
+		image->width = header.width;
+		image->height = header.height;
+		image->channels = header.channels;
+		image->scale = header.scale;
+		image->pixels = (const uint16_t*)((const char*)file->data + sizeof(header));
+		image->file = move(file);
+		return image;
+	}
+
+	// Written to a temporary name first so concurrent readers never see half a file
+	void SaveFile(const CachedImage& image) const {
+		if (directory.empty())
+			return;
+
+		string path = FilePath(image.key);
+		// Unique enough between threads and machines sharing the directory
+		uint64_t id[2] = { (uint64_t)hash<thread::id>()(this_thread::get_id()), (uint64_t)chrono::steady_clock::now().time_since_epoch().count() };
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%llx.tmp", (unsigned long long)HashBytes(id, sizeof(id)));
+		string temp_path = path + suffix;
+
+		FILE* file = fopen(temp_path.c_str(), "wb");
+		if (!file)
+			return;
+
+		FileHeader header = { { 'L', 'F', 'S', 'B' }, 1, image.key, image.width, image.height, image.channels, image.scale };
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+		ok = ok && fwrite(image.pixels, sizeof(uint16_t), image.NumValues(), file) == image.NumValues();
+		ok = fclose(file) == 0 && ok;
+
+		#if defined(_WIN32)
+		ok = ok && MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+		#else
+		ok = ok && rename(temp_path.c_str(), path.c_str()) == 0;
+		#endif
+		if (!ok)
+			remove(temp_path.c_str());
+	}
+
+	// Memory first, then the cache directory
+	shared_ptr<const CachedImage> Find(uint64_t key) {
+		{
+			lock_guard<mutex> lock(cache_mutex);
+			auto it = index.find(key);
+			if (it != index.end()) {
+				lru.splice(lru.begin(), lru, it->second);
+				return *it->second;
+			}
+		}
+
+		shared_ptr<const CachedImage> image = LoadFile(key);
+		if (image) {
+			lock_guard<mutex> lock(cache_mutex);
+			Insert(image);
+		}
+		return image;
+	}
+
+	// Converts width * height * channels floats to halfs. Values beyond the half range (the DC
+	// of large spectra) are stored with a power of two scale
+	shared_ptr<const CachedImage> Store(uint64_t key, int width, int height, int channels, const float* values) {
+		shared_ptr<CachedImage> image(new CachedImage());
+		image->key = key;
+		image->width = width;
+		image->height = height;
+		image->channels = channels;
+
+		size_t n = image->NumValues();
+		float largest = 0.f;
+		for (size_t i = 0; i < n; ++i)
+			largest = fabsf(values[i]) > largest ? fabsf(values[i]) : largest;
+		if (largest > 32768.f)
+			image->scale = exp2f(ceilf(log2f(largest / 32768.f)));
+
+		image->storage.resize(n);
+		float inv_scale = 1.f / image->scale;
+		for (size_t i = 0; i < n; ++i)
+			image->storage[i] = FloatToHalf(values[i] * inv_scale);
+		image->pixels = image->storage.data();
+		return Commit(image);
+	}
+
+	// Stores halfs as they are, rows pitch bytes apart (a mapped texture)
+	shared_ptr<const CachedImage> StoreHalf(uint64_t key, int width, int height, int channels, const void* rows, size_t pitch) {
+		shared_ptr<CachedImage> image(new CachedImage());
+		image->key = key;
+		image->width = width;
+		image->height = height;
+		image->channels = channels;
+
+		size_t row_values = (size_t)width * channels;
+		image->storage.resize(image->NumValues());
+		for (int y = 0; y < height; ++y)
+			memcpy(&image->storage[y * row_values], (const char*)rows + y * pitch, row_values * sizeof(uint16_t));
+		image->pixels = image->storage.data();
+		return Commit(image);
+	}
+
+	shared_ptr<const CachedImage> Commit(const shared_ptr<CachedImage>& image) {
+		SaveFile(*image);
+
+		lock_guard<mutex> lock(cache_mutex);
+		Insert(image);
+		return image;
+	}
+
+	bool Contains(uint64_t key) {
+		return Find(key) != nullptr;
+	}
+
+	// Runs produce for every entry whose starburst is not cached yet, produce is expected to
+	// Store it. Used to fill the cache for the blade counts and openings a job will use
+	void Prewarm(const vector<StarburstParameters>& list, const function<void(const StarburstParameters&)>& produce) {
+		for (const StarburstParameters& parameters : list) {
+			if (!Contains(parameters.Key(AssetStarburst)))
+				produce(parameters);
+		}
+	}
+} StarburstCache;
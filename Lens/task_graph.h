@@ -0,0 +1,102 @@
+#pragma once
+
+//--------------------------------------------------------------------------------------
+// Stages of a frame and what each waits on. Add returns a task's index and the task runs
+// once the tasks it is added after have finished, so indices are always in an order the
+// graph may run in. Run executes the graph on Workers: every thread of the pool takes the
+// next ready task, so independent stages run at the same time, and a thread without a
+// ready task helps the ParallelFor of the stages that are running. RunInOrder runs the
+// tasks one after the other on the calling thread, to compare against. The tasks are kept
+// until Clear, so the same graph can run every frame.
+//--------------------------------------------------------------------------------------
+
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "profiler.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+struct TaskGraph {
+	struct Task {
+		const char* name;
+		function<void()> run;
+		vector<int> next;  // tasks waiting on this one
+		int num_dependencies;
+	};
+
+	vector<Task> tasks;
+
+	void Clear() {
+		tasks.clear();
+	}
+
+	// after may hold -1 for a stage that is not part of this graph
+	int Add(const char* name, function<void()> run, initializer_list<int> after = {}) {
+		int index = (int)tasks.size();
+		Task task = { name, move(run), {}, 0 };
+		for (int dependency : after) {
+			if (dependency < 0)
+				continue;
+			tasks[dependency].next.push_back(index);
+			task.num_dependencies++;
+		}
+		tasks.push_back(move(task));
+		return index;
+	}
+
+	void RunInOrder() {
+		for (Task& task : tasks) {
+			PROFILE_SCOPE(task.name);
+			task.run();
+		}
+	}
+
+	void Run() {
+		int count = (int)tasks.size();
+		vector<int> waiting(count);
+		deque<int> ready;
+		mutex ready_mutex;
+		for (int t = 0; t < count; ++t) {
+			waiting[t] = tasks[t].num_dependencies;
+			if (waiting[t] == 0)
+				ready.push_back(t);
+		}
+
+		// Every item runs one task, the first that is ready. One is always running or ready
+		// until all have run, so the wait ends
+		function<void(int, int)> kernel = [&](int first, int last) {
+			for (int item = first; item < last; ++item) {
+				int t = -1;
+				while (true) {
+					{
+						lock_guard<mutex> lock(ready_mutex);
+						if (!ready.empty()) {
+							t = ready.front();
+							ready.pop_front();
+							break;
+						}
+					}
+					if (!Workers.Help(&kernel))
+						this_thread::yield();
+				}
+
+				{
+					PROFILE_SCOPE(tasks[t].name);
+					tasks[t].run();
+				}
+
+				lock_guard<mutex> lock(ready_mutex);
+				for (int n : tasks[t].next)
+					if (--waiting[n] == 0)
+						ready.push_back(n);
+			}
+		};
+		Workers.ParallelFor(count, 1, kernel);
+	}
+};
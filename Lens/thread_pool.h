@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+//--------------------------------------------------------------------------------------
+// Minimal persistent worker pool for the CPU paths. ParallelFor can be called from any
+// thread (including from inside another ParallelFor); the calling thread always helps
+// with its own job so nested or concurrent calls never wait on an idle pool.
+//--------------------------------------------------------------------------------------
+struct ThreadPool {
+	struct Job {
+		const function<void(int, int)>* kernel;
+		int count;
+		int grain;
+		atomic<int> next;
+		atomic<int> done;
+		atomic<int> active;
+	};
+
+	vector<thread> threads;
+	deque<Job*> jobs;
+	mutex jobs_mutex;
+	condition_variable jobs_cv;
+	bool quit = false;
+
+	ThreadPool() {
+		Start(max(1, (int)thread::hardware_concurrency()));
+	}
+
+	~ThreadPool() {
+		Stop();
+	}
+
+	void Start(int num_threads) {
+		quit = false;
+		for (int i = 0; i < num_threads - 1; ++i)
+			threads.push_back(thread([this]() { WorkerLoop(); }));
+	}
+
+	void Stop() {
+		{
+			lock_guard<mutex> lock(jobs_mutex);
+			quit = true;
+		}
+		jobs_cv.notify_all();
+		for (auto& t : threads)
+			t.join();
+		threads.clear();
+	}
+
+	// Restarts the pool with num_threads threads, the caller included. Only while no
+	// ParallelFor is running, e.g. to measure how a kernel scales
+	void SetNumThreads(int num_threads) {
+		Stop();
+		Start(max(1, num_threads));
+	}
+
+	int NumThreads() const {
+		return (int)threads.size() + 1;
+	}
+
+	static void RunChunks(Job& job) {
+		int begin;
+		while ((begin = job.next.fetch_add(job.grain)) < job.count) {
+			int end = min(begin + job.grain, job.count);
+			(*job.kernel)(begin, end);
+			job.done.fetch_add(end - begin);
+		}
+	}
+
+	void WorkerLoop() {
+		while (true) {
+			Job* job = nullptr;
+			{
+				unique_lock<mutex> lock(jobs_mutex);
+				jobs_cv.wait(lock, [this]() { return quit || !jobs.empty(); });
+				if (quit)
+					return;
+
+				job = jobs.front();
+				if (job->next.load() >= job->count) {
+					jobs.pop_front();
+					continue;
+				}
+				job->active++;
+			}
+
+			RunChunks(*job);
+			job->active--;
+		}
+	}
+
+	// Runs kernel(begin, end) over [0, count) in chunks of at most grain items
+	void ParallelFor(int count, int grain, const function<void(int, int)>& kernel) {
+		grain = max(1, grain);
+		if (threads.empty() || count <= grain) {
+			if (count > 0)
+				kernel(0, count);
+			return;
+		}
+
+		Job job;
+		job.kernel = &kernel;
+		job.count = count;
+		job.grain = grain;
+		job.next = 0;
+		job.done = 0;
+		job.active = 0;
+
+		{
+			lock_guard<mutex> lock(jobs_mutex);
+			jobs.push_back(&job);
+		}
+		jobs_cv.notify_all();
+
+		RunChunks(job);
+
+		{
+			lock_guard<mutex> lock(jobs_mutex);
+			auto it = find(jobs.begin(), jobs.end(), &job);
+			if (it != jobs.end())
+				jobs.erase(it);
+		}
+
+		while (job.done.load() < count || job.active.load() > 0)
+			this_thread::yield();
+	}
+
+	// Runs the chunks of one queued job, except the one of kernel skip, for a thread that
+	// would otherwise wait. Returns false when there was none
+	bool Help(const function<void(int, int)>* skip = nullptr) {
+		Job* job = nullptr;
+		{
+			lock_guard<mutex> lock(jobs_mutex);
+			for (Job* queued : jobs) {
+				if (queued->kernel != skip && queued->next.load() < queued->count) {
+					job = queued;
+					break;
+				}
+			}
+			if (!job)
+				return false;
+			job->active++;
+		}
+
+		RunChunks(*job);
+		job->active--;
+		return true;
+	}
+} Workers;